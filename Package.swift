@@ -38,7 +38,10 @@ let package = Package(
     .testTarget(
       name: "MkCheck2Tests",
       dependencies: [
-        .product(name: "Testing", package: "swift-testing")
+        "mkcheck2",
+        "mkcheck2abi",
+        .product(name: "Testing", package: "swift-testing"),
+        .product(name: "SystemPackage", package: "swift-system"),
       ]),
     .executableTarget(
       name: "mkcheck2-test-utils",
@@ -52,6 +52,90 @@ class ProcessTree {
     }
 }
 
+const BINARY_MAGIC = "mkcheck2";
+const BINARY_VERSION = 1;
+
+/**
+ * @param {ArrayBuffer} buffer
+ */
+export function isBinaryGraph(buffer) {
+    const magic = new TextDecoder().decode(new Uint8Array(buffer, 0, Math.min(8, buffer.byteLength)));
+    return magic === BINARY_MAGIC;
+}
+
+/**
+ * Decode a trace in the binary format written by `mkcheck2 convert`.
+ * See `BinaryTrace` in BinaryTrace.swift for the layout.
+ * @param {ArrayBuffer} buffer
+ * @returns {GraphData}
+ */
+export function decodeBinaryGraph(buffer) {
+    const view = new DataView(buffer);
+    const u32 = (offset) => view.getUint32(offset, true);
+    const u64 = (offset) => Number(view.getBigUint64(offset, true));
+    if (u32(8) !== BINARY_VERSION) {
+        throw new Error(`Unsupported binary format version ${u32(8)}`);
+    }
+    const footer = u64(buffer.byteLength - 16);
+    const sections = new Map();
+    for (let i = 0; i < u32(footer); i++) {
+        const entry = footer + 16 + i * 24;
+        sections.set(u32(entry), {offset: u64(entry + 8), length: u64(entry + 16)});
+    }
+    const [pathNodes, pathBytes, files, depOffsets, deps, procs, inputOffsets, inputs, outputOffsets, outputs] =
+        [1, 2, 3, 4, 5, 6, 7, 8, 9, 10].map(kind => sections.get(kind));
+
+    const decoder = new TextDecoder();
+    const names = new Map();
+    const pathOf = (node) => {
+        if (node === 0) return "/";
+        if (node === 1) return "";
+        if (!names.has(node)) {
+            const record = pathNodes.offset + node * 12;
+            const parent = pathOf(u32(record));
+            const start = pathBytes.offset + u32(record + 4);
+            const component = decoder.decode(new Uint8Array(buffer, start, u32(record + 8)));
+            names.set(node, parent === "/" || parent === "" ? parent + component : `${parent}/${component}`);
+        }
+        return names.get(node);
+    };
+    const list = (offsets, targets, index) => {
+        const start = u64(offsets.offset + index * 8);
+        const end = u64(offsets.offset + (index + 1) * 8);
+        const ids = [];
+        for (let i = start; i < end; i++) {
+            ids.push(u64(targets.offset + i * 8));
+        }
+        return ids;
+    };
+
+    const data = {files: [], procs: []};
+    for (let i = 0; i < files.length / 16; i++) {
+        const record = files.offset + i * 16;
+        const flags = u32(record + 12);
+        data.files.push({
+            id: u64(record),
+            name: pathOf(u32(record + 8)),
+            deleted: (flags & 1) !== 0,
+            exists: (flags & 2) !== 0,
+            deps: list(depOffsets, deps, i),
+        });
+    }
+    // The fields of a process record are uid, parent and image first
+    const processSize = 15 * 8;
+    for (let i = 0; i < procs.length / processSize; i++) {
+        const record = procs.offset + i * processSize;
+        data.procs.push({
+            uid: u64(record),
+            parent: u64(record + 8),
+            image: u64(record + 16),
+            input: list(inputOffsets, inputs, i),
+            output: list(outputOffsets, outputs, i),
+        });
+    }
+    return data;
+}
+
 /**
  * @param {GraphData} data 
  */
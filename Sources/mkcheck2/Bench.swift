@@ -0,0 +1,672 @@
+import ArgumentParser
+import Foundation
+import mkcheck2abi
+import mkcheck2syslinux
+
+extension Mkcheck2 {
+  struct Bench: ParsableCommand {
+    static let configuration = CommandConfiguration(
+      abstract: "Benchmark the analysis of recorded events, without root nor BPF",
+      subcommands: [Replay.self, Generate.self])
+
+    struct Replay: ParsableCommand {
+      static let configuration = CommandConfiguration(
+        abstract: "Time the analysis and the writers over a recording")
+
+      @Argument(help: "The events recorded with --record or generated by `bench generate`")
+      var events: String
+
+      @Option(help: "The number of timed runs. The median of each measure is reported.")
+      var iterations: Int = 5
+
+      @Option(help: "The format of the report (text or json)")
+      var format: StatsFormat = .text
+
+      func validate() throws {
+        guard iterations >= 1 else {
+          throw ValidationError("--iterations must be at least 1")
+        }
+      }
+
+      func run() throws {
+        let benchmark = try ReplayBenchmark(recording: EventRecording(path: events))
+        print(try benchmark.run(iterations: iterations).render(format: format), terminator: "")
+      }
+    }
+
+    struct Generate: ParsableCommand {
+      static let configuration = CommandConfiguration(
+        abstract: "Generate the recording of a synthetic C++ build")
+
+      @Option(name: .shortAndLong, help: "The file to write the recording to")
+      var output: String
+
+      @Option(help: "The number of translation units to compile")
+      var translationUnits: Int = 10_000
+
+      @Option(help: "The number of headers each translation unit includes")
+      var headers: Int = 40
+
+      @Option(help: "The number of compile jobs whose events are interleaved")
+      var jobs: Int = 16
+
+      @Option(help: "The seed of the choices of headers and timings")
+      var seed: UInt64 = 1
+
+      @Option(
+        help: "Derive the recording from the ASCII output of a snapshot test instead")
+      var snapshot: String?
+
+      func validate() throws {
+        guard translationUnits >= 1, headers >= 0, jobs >= 1 else {
+          throw ValidationError(
+            "--translation-units and --jobs must be at least 1, --headers at least 0")
+        }
+      }
+
+      func run() throws {
+        let count: Int
+        if let snapshot {
+          count = try SnapshotBuild(path: snapshot).write(to: output)
+        } else {
+          var build = SyntheticBuild(
+            translationUnits: translationUnits, headers: headers, jobs: jobs, seed: seed)
+          count = try build.write(to: output)
+        }
+        print("\(count) events written to \(output)")
+      }
+    }
+  }
+}
+
+/// Times the userland side of mkcheck2 over a recording
+///
+/// ## Discussion
+/// The records are read into memory once, and then each run decodes them in
+/// batches as a live session does, applies them to a fresh trace, and writes
+/// the trace in JSON and binary format to /dev/null. A separate profiling
+/// run times each `Trace.handleEvent` call, to break the cost down by event
+/// type. Its per-call clock reads are left out of the timed runs.
+struct ReplayBenchmark {
+  let recording: EventRecording
+
+  private struct Run {
+    var decode: UInt64 = 0
+    var apply: UInt64 = 0
+    var json: UInt64 = 0
+    var binary: UInt64 = 0
+    /// Bytes allocated by the trace and still in use once every event is applied
+    var traceHeap: Int = 0
+  }
+
+  private static func now() -> UInt64 {
+    DispatchTime.now().uptimeNanoseconds
+  }
+
+  func run(iterations: Int) throws -> BenchReport {
+    var batches: [[ShardedConsumer.Record]] = []
+    _ = try recording.forEachBatch { batches.append($0) }
+    let events = batches.reduce(0) { $0 + $1.count }
+    let bytes = batches.reduce(0) { sum, batch in sum + batch.reduce(0) { $0 + $1.bytes.count } }
+
+    let (profile, files, processes) = try profileEventTypes(batches)
+    var runs: [Run] = []
+    for _ in 0..<iterations {
+      runs.append(try timedRun(batches))
+    }
+
+    func median<Value: Comparable>(_ value: (Run) -> Value) -> Value {
+      runs.map(value).sorted()[runs.count / 2]
+    }
+    let decode = median { $0.decode }
+    let apply = median { $0.apply }
+    return BenchReport(
+      events: events, bytes: bytes, files: files, processes: processes, iterations: iterations,
+      decodeNanoseconds: decode, applyNanoseconds: apply,
+      jsonNanoseconds: median { $0.json }, binaryNanoseconds: median { $0.binary },
+      eventsPerSecond: decode + apply > 0 ? Double(events) * 1e9 / Double(decode + apply) : 0,
+      traceHeapBytes: median { $0.traceHeap },
+      peakRSSBytes: swift_peak_rss(),
+      eventTypes: profile)
+  }
+
+  /// Apply the events while timing each of them
+  /// - Returns: The cost by event type, most expensive first, and the number
+  ///   of files and processes of the trace
+  private func profileEventTypes(
+    _ batches: [[ShardedConsumer.Record]]
+  ) throws -> ([BenchReport.EventType], Int, Int) {
+    var costs: [Int32: (count: UInt64, nanoseconds: UInt64)] = [:]
+    let trace = recording.makeTrace()
+    for batch in batches {
+      for result in DecodedEvent.decode(batch) {
+        var event = try result.get()
+        event.clearSession()
+        let start = ReplayBenchmark.now()
+        try trace.handleEvent(event)
+        let elapsed = ReplayBenchmark.now() - start
+        costs[event.header._type, default: (0, 0)].count += 1
+        costs[event.header._type, default: (0, 0)].nanoseconds += elapsed
+      }
+    }
+    let eventTypes = costs.map { type, cost in
+      BenchReport.EventType(
+        type: mkcheck2_event_type(rawValue: type)?.description ?? "\(type)", count: cost.count,
+        totalNanoseconds: cost.nanoseconds,
+        nanosecondsPerEvent: Double(cost.nanoseconds) / Double(cost.count))
+    }.sorted { ($0.totalNanoseconds, $1.type) > ($1.totalNanoseconds, $0.type) }
+    return (eventTypes, trace.fileInfos.ids.count, trace.serializedProcs.count)
+  }
+
+  private func timedRun(_ batches: [[ShardedConsumer.Record]]) throws -> Run {
+    var run = Run()
+    let heapBefore = swift_heap_in_use()
+    let trace = recording.makeTrace()
+    for batch in batches {
+      let start = ReplayBenchmark.now()
+      let results = DecodedEvent.decode(batch)
+      let decoded = ReplayBenchmark.now()
+      for result in results {
+        var event = try result.get()
+        event.clearSession()
+        try trace.handleEvent(event)
+      }
+      run.decode += decoded - start
+      run.apply += ReplayBenchmark.now() - decoded
+    }
+    run.traceHeap = Int(swift_heap_in_use()) - Int(heapBefore)
+
+    var start = ReplayBenchmark.now()
+    var json = try FileOutputStream(path: "/dev/null")
+    trace.dump(output: &json)
+    try json.close()
+    run.json = ReplayBenchmark.now() - start
+
+    start = ReplayBenchmark.now()
+    try BinaryTraceWriter.write(
+      files: trace.serializedFiles, procs: trace.serializedProcs,
+      droppedEvents: trace.droppedEvents, toFile: "/dev/null")
+    run.binary = ReplayBenchmark.now() - start
+    return run
+  }
+}
+
+/// The results of `bench replay`
+struct BenchReport: Codable {
+  struct EventType: Codable {
+    let type: String
+    let count: UInt64
+    let totalNanoseconds: UInt64
+    let nanosecondsPerEvent: Double
+  }
+
+  let events: Int
+  /// The size of the records
+  let bytes: Int
+  let files: Int
+  let processes: Int
+  let iterations: Int
+  /// Medians over the runs
+  let decodeNanoseconds: UInt64
+  let applyNanoseconds: UInt64
+  let jsonNanoseconds: UInt64
+  let binaryNanoseconds: UInt64
+  /// Events decoded and applied per second
+  let eventsPerSecond: Double
+  /// The bytes allocated by the trace and still in use after the last event
+  let traceHeapBytes: Int
+  /// The peak RSS of the whole benchmark, including the loaded records
+  let peakRSSBytes: Int
+  /// From the profiling run, most expensive first
+  let eventTypes: [EventType]
+
+  func render(format: Mkcheck2.StatsFormat) throws -> String {
+    switch format {
+    case .json:
+      let encoder = JSONEncoder()
+      encoder.outputFormatting = [.prettyPrinted, .sortedKeys]
+      return String(decoding: try encoder.encode(self), as: UTF8.self) + "\n"
+    case .text:
+      return renderText()
+    }
+  }
+
+  private func renderText() -> String {
+    func milliseconds(_ nanoseconds: UInt64) -> String {
+      String(format: "%.1f", Double(nanoseconds) / 1e6)
+    }
+    func mebibytes(_ bytes: Int) -> String {
+      String(format: "%.1f", Double(bytes) / Double(1 << 20))
+    }
+    var output = "\(events) events (\(bytes) bytes), \(files) files, \(processes) processes\n"
+    output += "median of \(iterations) runs:\n"
+    output += renderTable([
+      ["stage", "ms"],
+      ["decode", milliseconds(decodeNanoseconds)],
+      ["apply", milliseconds(applyNanoseconds)],
+      ["json", milliseconds(jsonNanoseconds)],
+      ["binary", milliseconds(binaryNanoseconds)],
+    ])
+    output += "throughput: \(String(format: "%.0f", eventsPerSecond)) events/s\n"
+    output += "trace heap: \(mebibytes(traceHeapBytes)) MiB, "
+    output += "peak RSS: \(mebibytes(peakRSSBytes)) MiB\n"
+    output += "\nhandleEvent by event type:\n"
+    output += renderTable(
+      [["type", "events", "ns/event", "total ms"]]
+        + eventTypes.map {
+          [
+            $0.type, "\($0.count)", String(format: "%.0f", $0.nanosecondsPerEvent),
+            milliseconds($0.totalNanoseconds),
+          ]
+        })
+    return output
+  }
+}
+
+/// Generates the events of a C++ build, as recorded by `--record`
+///
+/// ## Discussion
+/// make runs in `build` and compiles each translation unit with a compiler
+/// driver, which runs cc1plus and as. cc1plus reads the source and headers,
+/// and writes the assembly to /tmp. as writes the object to a temporary
+/// file that is renamed in place, and the driver removes the assembly.
+/// Finally ld links every object. The events of `jobs` translation units are
+/// interleaved, as with `make -j`.
+///
+/// The events cover the three record layouts and the kernel file ids: system
+/// headers are announced once and then referred to by id, as with the VFS
+/// backend, while the other paths are inline. Every absolute path is under
+/// `prefix`, which no machine has, so the symlink lookups of the analysis
+/// fail fast and give the same answers wherever it runs. The same options
+/// always generate the same bytes.
+struct SyntheticBuild {
+  let translationUnits: Int
+  let headers: Int
+  let jobs: Int
+  private var random: SplitMix64
+  private var records = EventRecordBuilder()
+  private let root: pid_t = 1000
+  private let selfPid: pid_t = 999
+  private var nextPid: pid_t = 1001
+  private var nextUID: UInt64 = 1
+  /// The kernel file ids of the system headers announced so far
+  private var announced: [Int: UInt64] = [:]
+  /// Announcements of the translation units being interleaved. They are
+  /// submitted before the events of the units, any of which may refer to
+  /// the files first.
+  private var announcements: [[UInt8]] = []
+
+  /// The directory every path of the build is in
+  static let prefix = "/nonexistent-mkcheck2-bench"
+  private static let projectRoot = prefix + "/src/project"
+  private static let temporaryDirectory = prefix + "/tmp"
+  private static let systemHeaders = 500
+  private var modules: Int { max(1, translationUnits / 100) }
+
+  init(translationUnits: Int, headers: Int, jobs: Int, seed: UInt64) {
+    self.translationUnits = translationUnits
+    self.headers = headers
+    self.jobs = jobs
+    self.random = SplitMix64(seed: seed)
+  }
+
+  /// Write the recording
+  /// - Returns: The number of events
+  mutating func write(to path: String) throws -> Int {
+    let recorder = try EventRecorder(
+      path: path, root: root, selfPid: selfPid, cwd: SyntheticBuild.projectRoot)
+    var count = 0
+    func emit(_ events: [[UInt8]]) {
+      for var record in events {
+        let delay = UInt64.random(in: 1_000...50_000, using: &random)
+        records.stamp(&record, after: delay)
+        recorder.append(record)
+        count += 1
+      }
+    }
+
+    let (make, makeEvents) = process(
+      image: SyntheticBuild.prefix + "/usr/bin/make", parent: selfPid, clone: false)
+    var events = makeEvents
+    events.append(records.event(.eventTypeChdir, make, path: "build"))
+    events.append(records.event(.eventTypeInput, make, path: "Makefile"))
+    emit(events)
+
+    for group in stride(from: 0, to: translationUnits, by: jobs) {
+      var queues = (group..<min(group + jobs, translationUnits)).map {
+        compile(translationUnit: $0, make: make)[...]
+      }
+      emit(announcements)
+      announcements.removeAll()
+      // One event of each running job in turn
+      while !queues.isEmpty {
+        for index in queues.indices {
+          emit([queues[index].removeFirst()])
+        }
+        queues.removeAll { $0.isEmpty }
+      }
+    }
+
+    let ld: EventRecordBuilder.Process
+    (ld, events) = process(image: SyntheticBuild.prefix + "/usr/bin/ld", parent: make.pid)
+    for unit in 0..<translationUnits {
+      events.append(records.event(.eventTypeInput, ld, path: "obj/tu\(unit).o"))
+    }
+    events.append(records.event(.eventTypeOutput, ld, path: "app"))
+    events.append(exitEvent(ld, seconds: 5))
+    events.append(records.fatEvent(.eventTypeSymlink, make, paths: ["app", "app-latest"]))
+    events.append(exitEvent(make, seconds: 1))
+    emit(events)
+
+    try recorder.finish(exitCode: 0, droppedEvents: 0)
+    return count
+  }
+
+  /// The events of compiling a translation unit, in order
+  private mutating func compile(translationUnit unit: Int, make: EventRecordBuilder.Process)
+    -> [[UInt8]]
+  {
+    let module = unit % modules
+    let (driver, driverEvents) = process(
+      image: SyntheticBuild.prefix + "/usr/bin/c++", parent: make.pid)
+    var events = driverEvents
+
+    let (cc1plus, compilerEvents) = process(
+      image: SyntheticBuild.prefix + "/usr/libexec/gcc/x86_64-linux-gnu/13/cc1plus",
+      parent: driver.pid)
+    events += compilerEvents
+    events.append(
+      records.event(.eventTypeInput, cc1plus, path: "../src/module\(module)/tu\(unit).cpp"))
+    for _ in 0..<headers {
+      // Most includes are system headers
+      if Int.random(in: 0..<10, using: &random) < 6 {
+        let header = Int.random(in: 0..<SyntheticBuild.systemHeaders, using: &random)
+        let fileID: UInt64
+        if let id = announced[header] {
+          fileID = id
+        } else {
+          fileID = UInt64(announced.count + 1)
+          announced[header] = fileID
+          let path = "\(SyntheticBuild.prefix)/usr/include/c++/13/bits/h\(header).h"
+          announcements.append(
+            records.event(
+              .eventTypeFileName, cc1plus, path: path, fileID: fileID, dentries: true))
+        }
+        events.append(records.event(.eventTypeInput, cc1plus, fileID: fileID))
+      } else {
+        let header = Int.random(in: 0..<20, using: &random)
+        let headerModule = Int.random(in: 0..<modules, using: &random)
+        events.append(
+          records.fatEvent(
+            .eventTypeInputAt, cc1plus,
+            paths: ["\(SyntheticBuild.projectRoot)/include", "module\(headerModule)/h\(header).h"]))
+      }
+    }
+    let assembly = "cc\(unit).s"
+    events.append(
+      records.fatEvent(
+        .eventTypeOutputAt, cc1plus, paths: [SyntheticBuild.temporaryDirectory, assembly]))
+    events.append(exitEvent(cc1plus, seconds: 2))
+
+    let (assembler, assemblerEvents) = process(
+      image: SyntheticBuild.prefix + "/usr/bin/as", parent: driver.pid)
+    events += assemblerEvents
+    events.append(
+      records.event(
+        .eventTypeInput, assembler, path: "\(SyntheticBuild.temporaryDirectory)/\(assembly)"))
+    events.append(records.event(.eventTypeOutput, assembler, path: "obj/tu\(unit).o.tmp"))
+    if unit % 2 == 0 {
+      events.append(
+        records.fatEvent(
+          .eventTypeRename, assembler, paths: ["obj/tu\(unit).o.tmp", "obj/tu\(unit).o"]))
+    } else {
+      let objects = "\(SyntheticBuild.projectRoot)/build/obj"
+      events.append(
+        records.fat2Event(
+          .eventTypeRenameAt, assembler,
+          paths: [objects, objects, "tu\(unit).o.tmp", "tu\(unit).o"]))
+    }
+    events.append(exitEvent(assembler, seconds: 0.2))
+
+    events.append(
+      records.event(
+        .eventTypeRemove, driver, path: "\(SyntheticBuild.temporaryDirectory)/\(assembly)"))
+    events.append(exitEvent(driver, seconds: 0.01))
+    return events
+  }
+
+  /// A new process executing the given image, and its clone and exec events
+  private mutating func process(image: String, parent: pid_t, clone: Bool = true)
+    -> (EventRecordBuilder.Process, [[UInt8]])
+  {
+    let pid = clone ? nextPid : root
+    if clone {
+      nextPid += 1
+    }
+    let process = EventRecordBuilder.Process(pid: pid, uid: nextUID)
+    nextUID += 1
+    var events: [[UInt8]] = []
+    if clone {
+      events.append(records.event(.eventTypeClone, process, payload: parent))
+    }
+    events.append(records.event(.eventTypeExec, process, payload: parent, path: image))
+    return (process, events)
+  }
+
+  /// The exit event of a process that used about the given CPU time
+  private mutating func exitEvent(_ process: EventRecordBuilder.Process, seconds: Double)
+    -> [UInt8]
+  {
+    let cpu = UInt64(seconds * 1e9 * Double.random(in: 0.5...1.5, using: &random))
+    let usage = mkcheck2_rusage(
+      utime: cpu * 9 / 10, stime: cpu / 10,
+      maxrss: UInt64(seconds * 20_000) + UInt64.random(in: 500...2_000, using: &random),
+      nvcsw: UInt64.random(in: 1...100, using: &random),
+      nivcsw: UInt64.random(in: 0...50, using: &random),
+      read_bytes: 0, write_bytes: UInt64.random(in: 0...1 << 20, using: &random))
+    return records.exit(process, status: 0, usage: usage)
+  }
+}
+
+/// Generates the events of a snapshot test from its expected output
+///
+/// ## Discussion
+/// The ASCII output of a snapshot test lists each process with the files it
+/// read and wrote. Each process becomes a child of the root that executes its
+/// image, reads and writes its files in the order listed, and exits. Absolute
+/// paths are moved under `SyntheticBuild.prefix`, and the working directory
+/// the relative ones are resolved against is there too, so that the recording
+/// replays the same wherever it runs. The snapshots are checked in, so the
+/// recording is derived again whenever the record layout changes.
+struct SnapshotBuild {
+  let path: String
+
+  /// Write the recording
+  /// - Returns: The number of events
+  func write(to output: String) throws -> Int {
+    let text = try String(contentsOfFile: path, encoding: .utf8)
+    var records = EventRecordBuilder()
+    let selfPid: pid_t = 999
+    let root = EventRecordBuilder.Process(pid: 1000, uid: 1)
+    let recorder = try EventRecorder(
+      path: output, root: root.pid, selfPid: selfPid, cwd: SyntheticBuild.prefix + "/mkcheck2")
+    var count = 0
+    func emit(_ event: [UInt8]) {
+      var record = event
+      records.stamp(&record, after: 10_000)
+      recorder.append(record)
+      count += 1
+    }
+    func place(_ path: Substring) -> String {
+      if path.isEmpty {
+        return "."
+      }
+      return path.hasPrefix("/") ? SyntheticBuild.prefix + path : String(path)
+    }
+
+    emit(
+      records.event(
+        .eventTypeExec, root, payload: selfPid, path: SyntheticBuild.prefix + "/usr/bin/bash"))
+    var current: EventRecordBuilder.Process?
+    var nextPid = root.pid + 1
+    let processPrefix = "PROCESS (image: "
+    for line in text.split(separator: "\n") {
+      if line.hasPrefix(processPrefix) && line.hasSuffix(")") {
+        if let current {
+          emit(records.exit(current, status: 0, usage: mkcheck2_rusage()))
+        }
+        let process = EventRecordBuilder.Process(pid: nextPid, uid: UInt64(nextPid - root.pid) + 1)
+        nextPid += 1
+        let image = line.dropFirst(processPrefix.count).dropLast()
+        emit(records.event(.eventTypeClone, process, payload: root.pid))
+        emit(records.event(.eventTypeExec, process, payload: root.pid, path: place(image)))
+        current = process
+      } else if let current, line.hasPrefix("  INPUT ") {
+        emit(records.event(.eventTypeInput, current, path: place(line.dropFirst(8))))
+      } else if let current, line.hasPrefix("  OUTPUT ") {
+        emit(records.event(.eventTypeOutput, current, path: place(line.dropFirst(9))))
+      }
+    }
+    if let current {
+      emit(records.exit(current, status: 0, usage: mkcheck2_rusage()))
+    }
+    emit(records.exit(root, status: 0, usage: mkcheck2_rusage()))
+    try recorder.finish(exitCode: 0, droppedEvents: 0)
+    return count
+  }
+}
+
+/// Builds records in the layout submitted by the BPF program
+struct EventRecordBuilder {
+  struct Process {
+    let pid: pid_t
+    let uid: UInt64
+  }
+
+  private var seq: UInt64 = 0
+  /// The CLOCK_MONOTONIC time of the last stamped record
+  private var now: UInt64 = 1_000_000_000
+
+  /// Set the sequence number and timestamp of a record as it is submitted
+  mutating func stamp(_ record: inout [UInt8], after nanoseconds: UInt64) {
+    now += nanoseconds
+    record.withUnsafeMutableBytes { bytes in
+      bytes.storeBytes(
+        of: seq, toByteOffset: MemoryLayout<mkcheck2_event_header>.offset(of: \.seq)!,
+        as: UInt64.self)
+      bytes.storeBytes(
+        of: now, toByteOffset: MemoryLayout<mkcheck2_event_header>.offset(of: \.timestamp)!,
+        as: UInt64.self)
+    }
+    seq += 1
+  }
+
+  /// A `mkcheck2_event`. An announcement of a kernel file id carries both the
+  /// path and the id, while the events referring to the id carry no path.
+  /// - Parameter dentries: Encode the path as walked from dentries, as the
+  ///   kernel announces files, instead of as a user string
+  func event(
+    _ type: mkcheck2_event_type, _ process: Process, payload: pid_t = 0, path: String? = nil,
+    fileID: UInt64 = 0, dentries: Bool = false
+  ) -> [UInt8] {
+    var event = mkcheck2_event()
+    event.header = header(type, process)
+    event.payload = payload
+    event.file_id = fileID
+    let encoded = path.map { EventRecordBuilder.encode($0, dentries: dentries) } ?? []
+    return record(
+      event, lengthsOffset: MemoryLayout<mkcheck2_event>.offset(of: \.path_len)!, paths: [encoded])
+  }
+
+  func fatEvent(
+    _ type: mkcheck2_event_type, _ process: Process, payload: Int32 = 0, paths: [String]
+  ) -> [UInt8] {
+    precondition(paths.count == 2)
+    var event = mkcheck2_fat_event()
+    event.header = header(type, process)
+    event.payload = payload
+    return record(
+      event, lengthsOffset: MemoryLayout<mkcheck2_fat_event>.offset(of: \.path_len)!,
+      paths: paths.map { EventRecordBuilder.encode($0, dentries: false) })
+  }
+
+  func fat2Event(_ type: mkcheck2_event_type, _ process: Process, paths: [String]) -> [UInt8] {
+    precondition(paths.count == 4)
+    var event = mkcheck2_fat2_event()
+    event.header = header(type, process)
+    return record(
+      event, lengthsOffset: MemoryLayout<mkcheck2_fat2_event>.offset(of: \.path_len)!,
+      paths: paths.map { EventRecordBuilder.encode($0, dentries: false) })
+  }
+
+  func exit(_ process: Process, status: Int32, usage: mkcheck2_rusage) -> [UInt8] {
+    var event = mkcheck2_exit_event()
+    event.header = header(.eventTypeExit, process)
+    event.payload = status
+    event.usage = usage
+    return record(event, lengthsOffset: 0, paths: [])
+  }
+
+  private func header(_ type: mkcheck2_event_type, _ process: Process) -> mkcheck2_event_header {
+    var header = mkcheck2_event_header()
+    header._type = type.rawValue
+    header.pid = process.pid
+    header.uid = process.uid
+    return header
+  }
+
+  /// Lay out the fixed-size part of the event, followed by the encoded paths
+  /// and their lengths
+  private func record<Event>(_ event: Event, lengthsOffset: Int, paths: [[UInt8]]) -> [UInt8] {
+    var bytes = withUnsafeBytes(of: event) { Array($0) }
+    // The paths start at `sizeof(Event)` in C, which is the stride in Swift
+    bytes += repeatElement(0, count: MemoryLayout<Event>.stride - bytes.count)
+    bytes.withUnsafeMutableBytes { raw in
+      for (index, path) in paths.enumerated() {
+        raw.storeBytes(
+          of: UInt16(path.count), toByteOffset: lengthsOffset + index * 2, as: UInt16.self)
+      }
+    }
+    for path in paths {
+      bytes += path
+    }
+    let size = UInt32(bytes.count)
+    bytes.withUnsafeMutableBytes {
+      $0.storeBytes(
+        of: size, toByteOffset: MemoryLayout<mkcheck2_event_header>.offset(of: \.size)!,
+        as: UInt32.self)
+    }
+    return bytes
+  }
+
+  /// Encode a path the way `readPathString` decodes it: NUL-terminated
+  /// chunks, the last of which is the prefix of the others in reverse order
+  static func encode(_ path: String, dentries: Bool) -> [UInt8] {
+    guard dentries, path.hasPrefix("/") else {
+      return Array(path.utf8) + [0]
+    }
+    var bytes: [UInt8] = []
+    for component in path.split(separator: "/").reversed() {
+      bytes += Array(component.utf8) + [0]
+    }
+    return bytes + Array("/".utf8) + [0]
+  }
+}
+
+/// A small seedable generator, so that the same seed generates the same build
+/// on every platform
+struct SplitMix64: RandomNumberGenerator {
+  private var state: UInt64
+
+  init(seed: UInt64) {
+    state = seed
+  }
+
+  mutating func next() -> UInt64 {
+    state &+= 0x9e37_79b9_7f4a_7c15
+    var z = state
+    z = (z ^ (z >> 30)) &* 0xbf58_476d_1ce4_e5b9
+    z = (z ^ (z >> 27)) &* 0x94d0_49bb_1331_11eb
+    return z ^ (z >> 31)
+  }
+}
@@ -0,0 +1,471 @@
+import ArgumentParser
+import Foundation
+import SystemPackage
+
+extension Mkcheck2 {
+  struct Convert: ParsableCommand {
+    static let configuration = CommandConfiguration(
+      abstract: "Convert a trace between the JSON and binary formats")
+
+    enum Format: String, ExpressibleByArgument, CaseIterable {
+      case json
+      case binary
+    }
+
+    @Argument(help: "The trace file in JSON or binary format")
+    var input: String
+
+    @Argument(help: "The file to write the converted trace")
+    var output: String
+
+    @Option(help: "The format to convert to. Defaults to the other one than the input's.")
+    var to: Format?
+
+    @Flag(name: .long, help: "Write the JSON output on a single line instead of indenting it")
+    var compact: Bool = false
+
+    func run() throws {
+      // The trace is decoded completely before the output is opened, which
+      // may be the input itself
+      let binary = try BinaryTraceReader(path: input)
+      let trace = try binary?.dumpFormat() ?? DumpFormat.load(from: input)
+      switch to ?? (binary == nil ? .binary : .json) {
+      case .json:
+        var stream = try FileOutputStream(path: output)
+        trace.dump(output: &stream, pretty: !compact)
+        try stream.close()
+      case .binary:
+        try BinaryTraceWriter.write(
+          files: trace.files, procs: trace.procs, droppedEvents: trace.droppedEvents,
+          toFile: output)
+      }
+    }
+  }
+}
+
+/// The layout of binary traces
+///
+/// ## Discussion
+/// A binary trace holds the same data as `DumpFormat`, laid out so that it can
+/// be mapped into memory and read in place. Opening a trace only reads its
+/// header and footer, and a record is only decoded when it is asked for.
+///
+///     header    "mkcheck2", UInt32 version, UInt32 reserved
+///     sections  in any order, each starting at a multiple of 8 bytes
+///     footer    UInt32 section count, UInt32 flags, UInt64 dropped events,
+///               then per section UInt32 kind, UInt32 reserved, UInt64 offset
+///               and UInt64 length
+///     trailer   UInt64 offset of the footer, "mkcheck2"
+///
+/// All integers are little-endian. Paths are stored as the nodes of a
+/// `PathTable` and its arena, so a directory prefix is stored once. Files and
+/// processes are fixed-width records in the order of their ids and uids. The
+/// file ids of each of them are stored in compressed sparse row form: an
+/// array of `count + 1` offsets into an array of all the lists back to back.
+enum BinaryTrace {
+  static let magic = Array("mkcheck2".utf8)
+  /// Bumped on any change that readers of the previous version misread.
+  /// Sections of unknown kinds are skipped, so adding one is not such a change.
+  static let version: UInt32 = 1
+
+  static let headerSize = 16
+  static let trailerSize = 16
+
+  enum Section: UInt32 {
+    /// Per path node: UInt32 parent, offset and length of its component in `pathBytes`
+    case pathNodes = 1
+    case pathBytes = 2
+    /// Per file: UInt64 id, UInt32 path node, UInt32 `FileFlags`
+    case files = 3
+    /// UInt64 offsets into `deps`, one per file and a last one
+    case depOffsets = 4
+    case deps = 5
+    /// Per process: the UInt64 fields of `ProcessField`
+    case procs = 6
+    case inputOffsets = 7
+    case inputs = 8
+    case outputOffsets = 9
+    case outputs = 10
+  }
+
+  static let pathNodeSize = 12
+  static let fileSize = 16
+
+  struct FileFlags: OptionSet {
+    let rawValue: UInt32
+    static let deleted = FileFlags(rawValue: 1 << 0)
+    static let exists = FileFlags(rawValue: 1 << 1)
+  }
+
+  /// The fields of a process record, by index
+  enum ProcessField: Int, CaseIterable {
+    case uid, parent, image
+    case start, end, firstInput, lastOutput
+    case userTime, systemTime, maxRSS, voluntaryContextSwitches, involuntaryContextSwitches
+    case readBytes, writeBytes
+    /// `ProcessFlags`
+    case flags
+  }
+
+  static let processSize = ProcessField.allCases.count * 8
+
+  /// Which optional fields of a process record are present
+  struct ProcessFlags: OptionSet {
+    let rawValue: UInt64
+    static let start = ProcessFlags(rawValue: 1 << 0)
+    static let end = ProcessFlags(rawValue: 1 << 1)
+    static let firstInput = ProcessFlags(rawValue: 1 << 2)
+    static let lastOutput = ProcessFlags(rawValue: 1 << 3)
+    static let usage = ProcessFlags(rawValue: 1 << 4)
+  }
+
+  /// The footer has the number of dropped events
+  static let footerHasDroppedEvents: UInt32 = 1 << 0
+}
+
+/// Writes a trace in the binary format while walking it
+final class BinaryTraceWriter {
+  private let output: FileOutputStream
+  private var sections: [(kind: BinaryTrace.Section, offset: Int, length: Int)] = []
+
+  private init(output: FileOutputStream) {
+    self.output = output
+  }
+
+  /// Write the given files and processes, in the order they are given
+  static func write(
+    files: some Collection<Serialization.FileInfo>,
+    procs: some Collection<Serialization.Process>, droppedEvents: UInt64?,
+    toFile path: String
+  ) throws {
+    let writer = BinaryTraceWriter(output: try FileOutputStream(path: path))
+    writer.output.write(bytes: BinaryTrace.magic)
+    writer.emit(BinaryTrace.version)
+    writer.emit(UInt32(0))
+
+    // Rebuilding the name of a file may be costly, so the files are walked once
+    var paths = PathTable()
+    var records: [(id: FileID, node: PathTable.Node, flags: BinaryTrace.FileFlags)] = []
+    var deps: [FileID] = []
+    var depOffsets: [UInt64] = [0]
+    records.reserveCapacity(files.count)
+    depOffsets.reserveCapacity(files.count + 1)
+    for file in files {
+      var flags: BinaryTrace.FileFlags = []
+      if file.deleted ?? false { flags.insert(.deleted) }
+      if file.exists ?? false { flags.insert(.exists) }
+      records.append((file.id, paths.intern(file.name), flags))
+      deps += file.deps ?? []
+      depOffsets.append(UInt64(deps.count))
+    }
+
+    writer.section(.pathNodes) {
+      for node in 0..<paths.count {
+        writer.emit(paths.parents[node])
+        writer.emit(paths.offsets[node])
+        writer.emit(UInt32(paths.lengths[node]))
+      }
+    }
+    writer.section(.pathBytes) { writer.output.write(bytes: paths.arena) }
+    writer.section(.files) {
+      for record in records {
+        writer.emit(record.id)
+        writer.emit(record.node)
+        writer.emit(record.flags.rawValue)
+      }
+    }
+    writer.section(.depOffsets) { writer.emit(depOffsets) }
+    writer.section(.deps) { writer.emit(deps) }
+
+    writer.section(.procs) {
+      for proc in procs {
+        writer.emit(proc)
+      }
+    }
+    writer.adjacency(procs, offsets: .inputOffsets, targets: .inputs) { $0.input }
+    writer.adjacency(procs, offsets: .outputOffsets, targets: .outputs) { $0.output }
+
+    let footerOffset = writer.output.position
+    writer.emit(UInt32(writer.sections.count))
+    writer.emit(droppedEvents == nil ? 0 : BinaryTrace.footerHasDroppedEvents)
+    writer.emit(droppedEvents ?? 0)
+    for section in writer.sections {
+      writer.emit(section.kind.rawValue)
+      writer.emit(UInt32(0))
+      writer.emit(UInt64(section.offset))
+      writer.emit(UInt64(section.length))
+    }
+    writer.emit(UInt64(footerOffset))
+    writer.output.write(bytes: BinaryTrace.magic)
+    try writer.output.close()
+  }
+
+  /// Write a section and pad it to a multiple of 8 bytes
+  private func section(_ kind: BinaryTrace.Section, _ body: () -> Void) {
+    let offset = output.position
+    body()
+    sections.append((kind, offset, output.position - offset))
+    output.write(bytes: repeatElement(0, count: (8 - output.position % 8) % 8))
+  }
+
+  /// Write the sorted file ids of each process, and then their offsets
+  private func adjacency<Procs: Collection>(
+    _ procs: Procs, offsets: BinaryTrace.Section, targets: BinaryTrace.Section,
+    _ list: (Procs.Element) -> Set<FileID>?
+  ) {
+    var listOffsets: [UInt64] = [0]
+    listOffsets.reserveCapacity(procs.count + 1)
+    section(targets) {
+      var count: UInt64 = 0
+      for proc in procs {
+        let ids = (list(proc) ?? []).sorted()
+        emit(ids)
+        count += UInt64(ids.count)
+        listOffsets.append(count)
+      }
+    }
+    section(offsets) { emit(listOffsets) }
+  }
+
+  private func emit(_ proc: Serialization.Process) {
+    var flags: BinaryTrace.ProcessFlags = []
+    func optional(_ value: UInt64?, _ flag: BinaryTrace.ProcessFlags) -> UInt64 {
+      guard let value else { return 0 }
+      flags.insert(flag)
+      return value
+    }
+    let usage = proc.usage
+    if usage != nil {
+      flags.insert(.usage)
+    }
+    // In the order of `BinaryTrace.ProcessField`
+    let fields: [UInt64] = [
+      proc.uid, proc.parent, proc.image,
+      optional(proc.start, .start), optional(proc.end, .end),
+      optional(proc.firstInput, .firstInput), optional(proc.lastOutput, .lastOutput),
+      usage?.userTime ?? 0, usage?.systemTime ?? 0, usage?.maxRSS ?? 0,
+      usage?.voluntaryContextSwitches ?? 0, usage?.involuntaryContextSwitches ?? 0,
+      usage?.readBytes ?? 0, usage?.writeBytes ?? 0,
+    ]
+    emit(fields)
+    emit(flags.rawValue)
+  }
+
+  private func emit(_ values: [UInt64]) {
+    for value in values {
+      emit(value)
+    }
+  }
+
+  private func emit<Value: FixedWidthInteger>(_ value: Value) {
+    output.write(littleEndian: value)
+  }
+}
+
+/// A trace in the binary format, mapped into memory
+///
+/// Opening a trace checks its header and footer only. Records are checked
+/// when they are read, and reading a malformed one throws.
+final class BinaryTraceReader {
+  private let file: MappedFile
+  private var sections: [BinaryTrace.Section: UnsafeRawBufferPointer] = [:]
+  /// The number of events lost while tracing, if the trace is incomplete
+  private(set) var droppedEvents: UInt64?
+
+  private(set) var fileCount = 0
+  private(set) var processCount = 0
+
+  /// Map the trace at the given path
+  /// - Returns: nil if the file is not a binary trace
+  init?(path: String) throws {
+    file = try MappedFile(path: path)
+    guard file.bytes.starts(with: BinaryTrace.magic) else {
+      return nil
+    }
+    guard file.bytes.count >= BinaryTrace.headerSize + BinaryTrace.trailerSize else {
+      throw Mkcheck2Error("\(path) is truncated")
+    }
+    (fileCount, processCount) = try readFooter(path: path)
+  }
+
+  /// Check the header and footer, and locate the sections
+  /// - Returns: The number of files and processes
+  private func readFooter(path: String) throws -> (Int, Int) {
+    let file = self.file.bytes
+    let size = file.count
+    func integer<Value: FixedWidthInteger>(at offset: Int, as type: Value.Type) -> Value {
+      Value(littleEndian: file.loadUnaligned(fromByteOffset: offset, as: Value.self))
+    }
+    let malformed = Mkcheck2Error("\(path) is not a valid binary trace")
+
+    let version = integer(at: 8, as: UInt32.self)
+    guard version == BinaryTrace.version else {
+      throw Mkcheck2Error(
+        "\(path) has binary format version \(version), expected \(BinaryTrace.version)")
+    }
+    guard file[(size - BinaryTrace.magic.count)...].elementsEqual(BinaryTrace.magic) else {
+      throw malformed
+    }
+    let footerOffset = integer(at: size - BinaryTrace.trailerSize, as: UInt64.self)
+    let footerEnd = size - BinaryTrace.trailerSize
+    guard footerOffset >= BinaryTrace.headerSize, footerOffset <= footerEnd - 16 else {
+      throw malformed
+    }
+    let footer = Int(footerOffset)
+    let sectionCount = Int(integer(at: footer, as: UInt32.self))
+    guard sectionCount <= (footerEnd - footer - 16) / 24 else {
+      throw malformed
+    }
+    if integer(at: footer + 4, as: UInt32.self) & BinaryTrace.footerHasDroppedEvents != 0 {
+      droppedEvents = integer(at: footer + 8, as: UInt64.self)
+    }
+    for index in 0..<sectionCount {
+      let entry = footer + 16 + index * 24
+      let offset = integer(at: entry + 8, as: UInt64.self)
+      let length = integer(at: entry + 16, as: UInt64.self)
+      guard offset % 8 == 0, offset >= BinaryTrace.headerSize, offset <= footerOffset,
+        length <= footerOffset - offset
+      else {
+        throw malformed
+      }
+      // Sections of a later minor revision are skipped
+      guard let kind = BinaryTrace.Section(rawValue: integer(at: entry, as: UInt32.self)) else {
+        continue
+      }
+      sections[kind] = UnsafeRawBufferPointer(
+        rebasing: file[Int(offset)..<Int(offset + length)])
+    }
+
+    func count(_ kind: BinaryTrace.Section, stride: Int) throws -> Int {
+      guard let section = sections[kind], section.count % stride == 0 else {
+        throw malformed
+      }
+      return section.count / stride
+    }
+    let nodeCount = try count(.pathNodes, stride: BinaryTrace.pathNodeSize)
+    _ = try count(.pathBytes, stride: 1)
+    let fileCount = try count(.files, stride: BinaryTrace.fileSize)
+    let processCount = try count(.procs, stride: BinaryTrace.processSize)
+    guard nodeCount >= 2,
+      try count(.depOffsets, stride: 8) == fileCount + 1,
+      try count(.inputOffsets, stride: 8) == processCount + 1,
+      try count(.outputOffsets, stride: 8) == processCount + 1
+    else {
+      throw malformed
+    }
+    for targets in [BinaryTrace.Section.deps, .inputs, .outputs] {
+      _ = try count(targets, stride: 8)
+    }
+    return (fileCount, processCount)
+  }
+
+  private func section(_ kind: BinaryTrace.Section) -> UnsafeRawBufferPointer {
+    sections[kind]!
+  }
+
+  /// Read the integer at the given byte offset of a section. Sections are
+  /// aligned, and so are the fields of their records.
+  private func integer<Value: FixedWidthInteger>(
+    _ kind: BinaryTrace.Section, at offset: Int, as type: Value.Type
+  ) -> Value {
+    Value(littleEndian: section(kind).load(fromByteOffset: offset, as: Value.self))
+  }
+
+  private func integer(_ kind: BinaryTrace.Section, at offset: Int) -> UInt64 {
+    integer(kind, at: offset, as: UInt64.self)
+  }
+
+  /// Read the file ids of the record at the given index from a pair of
+  /// adjacency sections
+  private func list(
+    _ offsets: BinaryTrace.Section, _ targets: BinaryTrace.Section, at index: Int
+  ) throws -> [FileID] {
+    let start = integer(offsets, at: index * 8)
+    let end = integer(offsets, at: (index + 1) * 8)
+    guard start <= end, end <= section(targets).count / 8 else {
+      throw Mkcheck2Error("Malformed binary trace: \(targets) offsets are out of bounds")
+    }
+    return (Int(start)..<Int(end)).map { integer(targets, at: $0 * 8) }
+  }
+
+  /// Rebuild the path of the given node
+  func path(of node: PathTable.Node) throws -> FilePath {
+    let nodeCount = section(.pathNodes).count / BinaryTrace.pathNodeSize
+    let bytes = section(.pathBytes)
+    var components: [UnsafeRawBufferPointer] = []
+    var current = node
+    while current > PathTable.relativeRoot {
+      guard current < nodeCount else {
+        throw Mkcheck2Error("Malformed binary trace: path node \(current) is out of bounds")
+      }
+      let record = Int(current) * BinaryTrace.pathNodeSize
+      let parent = integer(.pathNodes, at: record, as: UInt32.self)
+      let offset = Int(integer(.pathNodes, at: record + 4, as: UInt32.self))
+      let length = Int(integer(.pathNodes, at: record + 8, as: UInt32.self))
+      // Parents are interned before their children, so walking up ends
+      guard parent < current, offset <= bytes.count, length <= bytes.count - offset else {
+        throw Mkcheck2Error("Malformed binary trace: path node \(current) is out of bounds")
+      }
+      components.append(UnsafeRawBufferPointer(rebasing: bytes[offset..<offset + length]))
+      current = parent
+    }
+    var path: [UInt8] = current == PathTable.root ? [UInt8(ascii: "/")] : []
+    for (index, component) in components.reversed().enumerated() {
+      if index > 0 {
+        path.append(UInt8(ascii: "/"))
+      }
+      path += component
+    }
+    return FilePath(platformBytes: path)
+  }
+
+  /// Decode the file at the given index, in the order of ids
+  func file(at index: Int) throws -> Serialization.FileInfo {
+    let record = index * BinaryTrace.fileSize
+    let flags = BinaryTrace.FileFlags(
+      rawValue: integer(.files, at: record + 12, as: UInt32.self))
+    return Serialization.FileInfo(
+      id: integer(.files, at: record),
+      name: try path(of: integer(.files, at: record + 8, as: UInt32.self)),
+      deleted: flags.contains(.deleted), exists: flags.contains(.exists),
+      deps: try list(.depOffsets, .deps, at: index))
+  }
+
+  /// Decode the process at the given index, in the order of uids
+  func process(at index: Int) throws -> Serialization.Process {
+    let record = index * BinaryTrace.processSize
+    func field(_ index: BinaryTrace.ProcessField) -> UInt64 {
+      integer(.procs, at: record + index.rawValue * 8)
+    }
+    let flags = BinaryTrace.ProcessFlags(rawValue: field(.flags))
+    func optional(_ index: BinaryTrace.ProcessField, _ flag: BinaryTrace.ProcessFlags) -> UInt64? {
+      flags.contains(flag) ? field(index) : nil
+    }
+    let usage =
+      flags.contains(.usage)
+      ? ResourceUsage(
+        userTime: field(.userTime), systemTime: field(.systemTime), maxRSS: field(.maxRSS),
+        voluntaryContextSwitches: field(.voluntaryContextSwitches),
+        involuntaryContextSwitches: field(.involuntaryContextSwitches),
+        readBytes: field(.readBytes), writeBytes: field(.writeBytes)) : nil
+    return Serialization.Process(
+      uid: field(.uid), parent: field(.parent), image: field(.image),
+      output: Set(try list(.outputOffsets, .outputs, at: index)),
+      input: Set(try list(.inputOffsets, .inputs, at: index)),
+      start: optional(.start, .start), end: optional(.end, .end),
+      firstInput: optional(.firstInput, .firstInput),
+      lastOutput: optional(.lastOutput, .lastOutput), usage: usage)
+  }
+
+  /// Decode all the files, without the processes
+  func files() throws -> [Serialization.FileInfo] {
+    try (0..<fileCount).map(file(at:))
+  }
+
+  /// Decode the whole trace
+  func dumpFormat() throws -> DumpFormat {
+    DumpFormat(
+      files: try files(), procs: try (0..<processCount).map(process(at:)),
+      droppedEvents: droppedEvents)
+  }
+}
@@ -0,0 +1,126 @@
+import Foundation
+import mkcheck2abi
+import mkcheck2bpf_skelton
+
+/// A cgroup v2 created for the traced command
+///
+/// The BPF program traces the tasks in this cgroup and its descendants,
+/// instead of following the process ancestry. Tasks stay in the cgroup when
+/// they double-fork or are reparented, and tasks outside of it are rejected
+/// with a single helper call.
+///
+/// The daemon installs a cgroup of its own instead, and creates the cgroup of
+/// each session below it.
+///
+/// The cgroup is removed once released, or earlier with `remove()` on error
+/// paths. Tasks still in it, such as processes that outlived the root or a
+/// root that never ran, are moved back to the cgroup mkcheck2 started in.
+final class TracingCgroup {
+  static let mountPath = "/sys/fs/cgroup"
+  /// CGROUP2_SUPER_MAGIC from linux/magic.h
+  private static let superMagic = 0x6367_7270
+
+  /// The path relative to the cgroup root
+  let name: String
+  let path: String
+  /// A descriptor of the cgroup directory, as stored in `traced_cgroup`
+  let fd: Int32
+  /// The cgroup id, as returned by `bpf_get_current_cgroup_id`
+  let id: UInt64
+  /// The cgroup of mkcheck2 when the cgroup was created, which left tasks are
+  /// moved to
+  let origin: String
+  private var removed = false
+
+  init(name: String) throws {
+    var fs = statfs()
+    guard statfs(TracingCgroup.mountPath, &fs) == 0, fs.f_type == TracingCgroup.superMagic else {
+      throw Mkcheck2Error("cgroup v2 is not mounted at \(TracingCgroup.mountPath)")
+    }
+    self.name = name
+    origin = TracingCgroup.currentCgroupPath()
+    // Created right below the root (or below a cgroup of mkcheck2), which is
+    // not subject to the rule that a cgroup with enabled controllers cannot
+    // have tasks of its own
+    path = "\(TracingCgroup.mountPath)/\(name)"
+    guard mkdir(path, 0o755) == 0 else {
+      throw Mkcheck2Error("Failed to create cgroup \(path): \(String(cString: strerror(errno)))")
+    }
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+    guard fd >= 0 else {
+      let message = "Failed to open cgroup \(path): \(String(cString: strerror(errno)))"
+      rmdir(path)
+      throw Mkcheck2Error(message)
+    }
+    // The id of a cgroup is the inode number of its directory
+    var st = stat()
+    fstat(fd, &st)
+    id = UInt64(st.st_ino)
+  }
+
+  /// Create a cgroup for the given stopped process and move it there
+  /// - Parameter parent: The cgroup to create it in, or nil for the root
+  static func create(for pid: pid_t, in parent: TracingCgroup? = nil) throws -> TracingCgroup {
+    let name = "mkcheck2-\(pid)"
+    let cgroup = try TracingCgroup(name: parent.map { "\($0.name)/\(name)" } ?? name)
+    try cgroup.add(pid: pid)
+    return cgroup
+  }
+
+  /// Move the given process into the cgroup. Its future children follow it.
+  func add(pid: pid_t) throws {
+    do {
+      try "\(pid)\n".write(toFile: "\(path)/cgroup.procs", atomically: false, encoding: .utf8)
+    } catch {
+      throw Mkcheck2Error("Failed to move PID \(pid) into cgroup \(path): \(error)")
+    }
+  }
+
+  /// Make the BPF program trace the tasks in the cgroup
+  func install(_ obj: UnsafeMutablePointer<mkcheck2_bpf>) throws {
+    var key: UInt32 = 0
+    var value = fd
+    let mapFD = bpf_map__fd(obj.pointee.maps.traced_cgroup)
+    guard bpf_map_update_elem(mapFD, &key, &value, UInt64(BPF_ANY)) == 0 else {
+      throw Mkcheck2Error("Failed to set traced cgroup: \(String(cString: strerror(errno)))")
+    }
+  }
+
+  /// The path of the cgroup of the current process
+  private static func currentCgroupPath() -> String {
+    // A single "0::/path" line with cgroup v2 only
+    let lines = (try? String(contentsOfFile: "/proc/self/cgroup", encoding: .utf8)) ?? ""
+    let relative = lines.split(separator: "\n").first { $0.hasPrefix("0::") }?.dropFirst(3) ?? "/"
+    return relative == "/" ? mountPath : "\(mountPath)\(relative)"
+  }
+
+  /// Move the tasks left in the cgroup to `origin`
+  private func migrateTasks() {
+    guard let procs = try? String(contentsOfFile: "\(path)/cgroup.procs", encoding: .utf8) else {
+      return
+    }
+    for pid in procs.split(separator: "\n") {
+      // Fails for tasks that exited in the meantime
+      try? "\(pid)\n".write(toFile: "\(origin)/cgroup.procs", atomically: false, encoding: .utf8)
+    }
+  }
+
+  /// Move the tasks left in the cgroup out of it and remove it. Does nothing
+  /// if it is already removed.
+  func remove() {
+    guard !removed else { return }
+    removed = true
+    close(fd)
+    // Tasks can fork while they are moved, so retry a few times
+    for _ in 0..<10 {
+      if rmdir(path) == 0 { return }
+      guard errno == EBUSY else { break }
+      migrateTasks()
+    }
+    logger.warning("Failed to remove cgroup \(path): \(String(cString: strerror(errno)))")
+  }
+
+  deinit {
+    remove()
+  }
+}
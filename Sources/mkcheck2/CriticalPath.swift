@@ -0,0 +1,209 @@
+import ArgumentParser
+import Foundation
+
+extension Mkcheck2 {
+  struct CriticalPath: ParsableCommand {
+    static let configuration = CommandConfiguration(
+      commandName: "critical-path",
+      abstract: "Report the longest dependency chain and the parallelism of a traced build")
+
+    @Argument(help: "The trace file in JSON or binary format")
+    var trace: String
+
+    @Option(help: "The number of steps with the least slack to list")
+    var top: Int = 20
+
+    func run() throws {
+      let format = try DumpFormat.load(from: trace)
+      let schedule = BuildSchedule(format)
+      guard !schedule.steps.isEmpty else {
+        throw Mkcheck2Error("No process in the trace has timestamps")
+      }
+      print(schedule.render(top: top), terminator: "")
+    }
+  }
+}
+
+/// The schedule of the steps of a traced build
+///
+/// A step is a process that did not spawn any traced process. The processes
+/// that did, like make or a shell, mostly wait for their children, and would
+/// otherwise span the whole build. Step Q depends on step P if Q read a file
+/// that P wrote, and P is the step that last wrote it before Q first read any
+/// file. Traces without the times of the first input and the last output fall
+/// back to the step that last started before Q. Only steps that started before
+/// Q are considered, which keeps the dependencies acyclic.
+struct BuildSchedule {
+  struct Step {
+    let uid: UID
+    let image: String
+    /// CLOCK_MONOTONIC times in nanoseconds
+    let start: UInt64
+    let end: UInt64
+    /// When the step first read and last wrote any file, if known
+    let firstInput: UInt64?
+    let lastOutput: UInt64?
+    /// Indices of the steps this step depends on
+    var predecessors: [Int] = []
+    /// The finish time relative to the start of the build if every step
+    /// started as soon as its predecessors finished
+    var earliestFinish: UInt64 = 0
+    /// The latest finish time that does not delay the end of the build
+    var latestFinish: UInt64 = 0
+
+    var duration: UInt64 { end - start }
+    var slack: UInt64 { latestFinish - earliestFinish }
+  }
+
+  /// Steps sorted by their start time
+  private(set) var steps: [Step] = []
+  /// Indices of the steps on the longest dependency chain, first step first
+  private(set) var criticalPath: [Int] = []
+  /// The length of the longest dependency chain in nanoseconds
+  private(set) var criticalPathLength: UInt64 = 0
+  /// The time from the first start to the last end of any process
+  private(set) var wallTime: UInt64 = 0
+  /// The time spent with each number of steps running, in nanoseconds
+  private(set) var concurrency: [UInt64] = []
+
+  init(_ trace: DumpFormat) {
+    let names = Dictionary(uniqueKeysWithValues: trace.files.map { ($0.id, $0.name.string) })
+    let parents = Set(trace.procs.map(\.parent))
+    let timed = trace.procs.filter { $0.start != nil && $0.end != nil }
+    guard let buildStart = timed.map({ $0.start! }).min(),
+      let buildEnd = timed.map({ $0.end! }).max()
+    else { return }
+    wallTime = buildEnd - buildStart
+
+    let leaves = timed.filter { !parents.contains($0.uid) }.sorted {
+      ($0.start!, $0.uid) < ($1.start!, $1.uid)
+    }
+    // Steps writing each file, in the order of their start times
+    var producers: [FileID: [Int]] = [:]
+    for (index, proc) in leaves.enumerated() {
+      steps.append(
+        Step(
+          uid: proc.uid, image: names[proc.image] ?? "unknown",
+          start: proc.start!, end: max(proc.end!, proc.start!), firstInput: proc.firstInput,
+          lastOutput: proc.lastOutput))
+      for file in proc.output ?? [] {
+        producers[file, default: []].append(index)
+      }
+    }
+    for (index, proc) in leaves.enumerated() {
+      let predecessors = (proc.input ?? []).compactMap { file in
+        producer(before: index, among: producers[file] ?? [])
+      }
+      steps[index].predecessors = Array(Set(predecessors)).sorted()
+    }
+
+    computeFinishTimes()
+    computeConcurrency()
+  }
+
+  /// The step among the given producers of a file that the step at `consumer` read it from
+  private func producer(before consumer: Int, among producers: [Int]) -> Int? {
+    func lastWrite(_ producer: Int) -> UInt64 {
+      steps[producer].lastOutput ?? steps[producer].start
+    }
+    let firstInput = steps[consumer].firstInput
+    return producers.filter { producer in
+      guard producer < consumer else { return false }
+      guard let firstInput, let lastOutput = steps[producer].lastOutput else { return true }
+      return lastOutput <= firstInput
+    }.max { (lastWrite($0), $0) < (lastWrite($1), $1) }
+  }
+
+  /// The critical path method: forward pass for the earliest finish times,
+  /// backward pass for the latest ones. Predecessors always precede a step.
+  private mutating func computeFinishTimes() {
+    for index in steps.indices {
+      let earliestStart = steps[index].predecessors.map { steps[$0].earliestFinish }.max() ?? 0
+      steps[index].earliestFinish = earliestStart + steps[index].duration
+    }
+    guard let last = steps.indices.max(by: { steps[$0].earliestFinish < steps[$1].earliestFinish })
+    else { return }
+    criticalPathLength = steps[last].earliestFinish
+
+    for index in steps.indices {
+      steps[index].latestFinish = criticalPathLength
+    }
+    for index in steps.indices.reversed() {
+      let latestStart = steps[index].latestFinish - steps[index].duration
+      for predecessor in steps[index].predecessors {
+        steps[predecessor].latestFinish = min(steps[predecessor].latestFinish, latestStart)
+      }
+    }
+
+    var current: Int? = last
+    while let index = current {
+      criticalPath.append(index)
+      let earliestStart = steps[index].earliestFinish - steps[index].duration
+      current = steps[index].predecessors.last { steps[$0].earliestFinish == earliestStart }
+    }
+    criticalPath.reverse()
+  }
+
+  /// Sweep the start and end times of the steps as they actually ran
+  private mutating func computeConcurrency() {
+    let edges = (steps.map { ($0.start, 1) } + steps.map { ($0.end, -1) }).sorted { $0 < $1 }
+    guard var previous = edges.first?.0 else { return }
+    var running = 0
+    for (time, delta) in edges {
+      if running >= concurrency.count {
+        concurrency.append(contentsOf: repeatElement(0, count: running - concurrency.count + 1))
+      }
+      concurrency[running] += time - previous
+      running += delta
+      previous = time
+    }
+  }
+
+  /// The sum of the durations of the steps
+  var totalWork: UInt64 {
+    steps.reduce(0) { $0 + $1.duration }
+  }
+
+  func render(top: Int) -> String {
+    func seconds(_ nanoseconds: UInt64) -> String {
+      String(format: "%.3f", Double(nanoseconds) / 1e9)
+    }
+    func percent(_ part: UInt64, of whole: UInt64) -> String {
+      whole > 0 ? String(format: "%.1f%%", Double(part) * 100 / Double(whole)) : "-"
+    }
+    let buildStart = steps.map(\.start).min() ?? 0
+
+    var output = "wall time: \(seconds(wallTime)) s\n"
+    output += "critical path: \(seconds(criticalPathLength)) s "
+    output += "(\(percent(criticalPathLength, of: wallTime)) of wall time), "
+    output += "\(criticalPath.count) of \(steps.count) steps\n"
+    output += "total work: \(seconds(totalWork)) s, average parallelism: "
+    output += String(format: "%.2f", wallTime > 0 ? Double(totalWork) / Double(wallTime) : 0)
+    output += "\n\ncritical path:\n"
+    output += renderTable(
+      [["image", "uid", "start", "duration"]]
+        + criticalPath.map {
+          let step = steps[$0]
+          let start = seconds(step.start - buildStart)
+          return [step.image, "\(step.uid)", start, seconds(step.duration)]
+        })
+
+    output += "\nleast slack:\n"
+    let bySlack = steps.indices.sorted { (steps[$0].slack, $0) < (steps[$1].slack, $1) }
+    output += renderTable(
+      [["image", "uid", "duration", "slack"]]
+        + bySlack.prefix(top).map {
+          let step = steps[$0]
+          return [step.image, "\(step.uid)", seconds(step.duration), seconds(step.slack)]
+        })
+
+    output += "\nconcurrency:\n"
+    let busy = concurrency.reduce(0, +)
+    output += renderTable(
+      [["steps", "time", "share"]]
+        + concurrency.enumerated().filter { $0.element > 0 }.map {
+          ["\($0.offset)", seconds($0.element), percent($0.element, of: busy)]
+        })
+    return output
+  }
+}
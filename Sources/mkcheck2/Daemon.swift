@@ -0,0 +1,473 @@
+import ArgumentParser
+import Foundation
+import mkcheck2abi
+import mkcheck2bpf_skelton
+import mkcheck2syslinux
+
+extension Mkcheck2 {
+  struct Daemon: ParsableCommand {
+    static let configuration = CommandConfiguration(
+      abstract: "Keep the BPF programs loaded and serve trace sessions over a unix socket")
+
+    /// --output, --format and --compact are chosen by the client of each session
+    @OptionGroup()
+    var traceOptions: TraceOptions
+
+    @Option(help: "The unix socket to listen on")
+    var socket: String = TraceDaemon.defaultSocketPath
+
+    @Option(help: "The bpffs directory to pin the maps and links in")
+    var pinPath: String = TraceDaemon.defaultPinPath
+
+    func validate() throws {
+      guard traceOptions.record == nil else {
+        throw ValidationError("--record is not supported by the daemon")
+      }
+    }
+
+    func run() throws {
+      traceOptions.bootstrapLogger()
+      let daemon = try TraceDaemon(options: traceOptions, pinPath: pinPath)
+      try daemon.serve(socketPath: socket)
+    }
+  }
+
+  struct Client: ParsableCommand {
+    static let configuration = CommandConfiguration(
+      abstract: "Trace a command with a running mkcheck2 daemon")
+
+    @Option(help: "The unix socket of the daemon")
+    var socket: String = TraceDaemon.defaultSocketPath
+
+    @Option(name: .shortAndLong, help: "The output file to write the trace")
+    var output: String?
+
+    @Option(name: .shortAndLong, help: "The output format")
+    var format: OutputFormat = .json
+
+    @Flag(name: .long, help: "Write the JSON output on a single line instead of indenting it")
+    var compact: Bool = false
+
+    @Option(name: .long, help: "The log level")
+    var logLevel: LogLevel = LogLevel(.warning)
+
+    @Argument(parsing: .postTerminator)
+    var args: [String]
+
+    func run() throws {
+      Mkcheck2.bootstrapLogger(level: logLevel)
+      guard !args.isEmpty else {
+        throw Mkcheck2Error("No command specified")
+      }
+
+      let connection = try UnixSocket.connect(path: socket)
+      let pid = try Mkcheck2.spawnStopped(args)
+      let result: TraceDaemon.Response
+      do {
+        try connection.send(TraceDaemon.Request(pid: pid, format: format, compact: compact))
+        // The daemon is tracing the child once it replies
+        _ = try connection.receive(TraceDaemon.Response.self).check()
+        logger.info("Resuming PID \(pid)")
+        kill(pid, SIGCONT)
+        result = try connection.receive(TraceDaemon.Response.self).check()
+      } catch {
+        kill(pid, SIGKILL)
+        throw error
+      }
+
+      var status: Int32 = 0
+      let exitCode =
+        waitpid(pid, &status, 0) == pid && swift_WIFEXITED(status)
+        ? swift_WEXITSTATUS(status) : result.exitCode
+      guard let exitCode else {
+        throw Mkcheck2Error("The exit status of the traced command is unknown")
+      }
+      guard exitCode == 0 else { throw ExitCode(exitCode) }
+
+      if let outputPath = output, let output = result.output {
+        try output.write(toFile: outputPath, atomically: false, encoding: .utf8)
+        print("Trace written to \(outputPath)")
+      }
+    }
+  }
+}
+
+/// Serves trace sessions with a BPF object that is loaded and attached once
+///
+/// ## Discussion
+/// Loading, attaching and destroying the BPF programs takes seconds, which
+/// dominates the tracing of small build steps. The daemon keeps them attached
+/// and only registers a session for each client, so starting a session costs
+/// a few map updates.
+///
+/// Sessions are served concurrently, each on a thread of its own, while a
+/// single consumer thread drains the ring buffers and hands each record to
+/// the trace of its session. In cgroup mode, the daemon creates a cgroup of
+/// its own and the cgroup of each session below it.
+///
+/// The maps and links are pinned under `pinPath` while the daemon runs, so
+/// that they can be inspected with bpftool. Pins left by a daemon that did not
+/// exit cleanly are removed at startup.
+final class TraceDaemon {
+  static let defaultSocketPath = "/run/mkcheck2.sock"
+  static let defaultPinPath = "/sys/fs/bpf/mkcheck2"
+  /// How long a client may take to send its request, so that a client that
+  /// connects and stays silent does not hold a session thread forever
+  static let requestTimeoutSeconds = 10
+
+  struct Request: Codable {
+    /// The stopped process to trace from its next exec
+    let pid: pid_t
+    let format: Mkcheck2.OutputFormat
+    var compact: Bool?
+  }
+
+  /// A reply without any field means that the session has started
+  struct Response: Codable {
+    var error: String?
+    /// The exit code of the root process, or nil if it is unknown
+    var exitCode: Int32?
+    /// The rendered trace, or nil if the format is `.none`
+    var output: String?
+
+    func check() throws -> Response {
+      if let error {
+        throw Mkcheck2Error("Daemon: \(error)")
+      }
+      return self
+    }
+  }
+
+  let obj: UnsafeMutablePointer<mkcheck2_bpf>
+  let options: Mkcheck2.TraceOptions
+  let pinPath: String
+  /// struct bpf_link* of the attached programs
+  private var links: [OpaquePointer] = []
+  /// Released before the BPF object is destroyed
+  private var tracer: Tracer!
+  /// The cgroup containing the cgroups of the sessions, in cgroup mode
+  private var cgroup: TracingCgroup?
+
+  init(options: Mkcheck2.TraceOptions, pinPath: String) throws {
+    self.options = options
+    self.pinPath = pinPath
+    // The cgroups of the sessions are below the cgroup of the daemon
+    self.obj = try Mkcheck2.load(options: options, sessionCgroupLevel: 2)
+    // deinit cleans up if these fail
+    try removePins()
+    try attachAndPin()
+    if options.cgroup {
+      let cgroup = try TracingCgroup(name: "mkcheck2-daemon-\(getpid())")
+      self.cgroup = cgroup
+      try cgroup.install(obj)
+    }
+    tracer = try Tracer(
+      obj: obj, ringShards: Int(options.ringShards), ringSize: options.ringSize,
+      stats: options.stats, pathFilter: options.pathFilter(), ownsObject: false)
+  }
+
+  /// Attach the loaded programs one by one, as the skeleton does not expose
+  /// its links for pinning
+  private func attachAndPin() throws {
+    guard mkdir(pinPath, 0o700) == 0 else {
+      throw Mkcheck2Error("Failed to create \(pinPath): \(String(cString: strerror(errno)))")
+    }
+    var program = bpf_object__next_program(obj.pointee.obj, nil)
+    while let current = program {
+      program = bpf_object__next_program(obj.pointee.obj, current)
+      guard bpf_program__autoload(current) else { continue }
+      let name = String(cString: bpf_program__name(current))
+      guard let link = bpf_program__attach(current) else {
+        throw Mkcheck2Error("Failed to attach \(name): \(String(cString: strerror(errno)))")
+      }
+      links.append(link)
+      guard bpf_link__pin(link, "\(pinPath)/link_\(name)") == 0 else {
+        throw Mkcheck2Error("Failed to pin link \(name): \(String(cString: strerror(errno)))")
+      }
+    }
+    guard bpf_object__pin_maps(obj.pointee.obj, pinPath) == 0 else {
+      throw Mkcheck2Error("Failed to pin maps: \(String(cString: strerror(errno)))")
+    }
+  }
+
+  private func removePins() throws {
+    guard FileManager.default.fileExists(atPath: pinPath) else { return }
+    logger.warning("Removing stale pins in \(pinPath)")
+    try FileManager.default.removeItem(atPath: pinPath)
+  }
+
+  private func detach() {
+    // FIXME: Destroying BPF links is slow (takes 1-2 seconds)
+    links.forEach { bpf_link__destroy($0) }
+    links.removeAll()
+  }
+
+  /// Accept sessions until SIGINT or SIGTERM
+  func serve(socketPath: String) throws {
+    let listener = try UnixSocket.listen(path: socketPath)
+    defer { unlink(socketPath) }
+
+    // Stop accepting on a signal. The sessions being served run to completion.
+    var signalSources: [DispatchSourceSignal] = []
+    for signo in [SIGINT, SIGTERM] {
+      signal(signo, SIG_IGN)
+      let source = DispatchSource.makeSignalSource(signal: signo, queue: .global())
+      source.setEventHandler {
+        logger.info("Shutting down")
+        listener.shutdown()
+      }
+      source.resume()
+      signalSources.append(source)
+    }
+    defer { signalSources.forEach { $0.cancel() } }
+
+    let stopping = NSLock()
+    var stopped = false
+    let consumerFinished = DispatchSemaphore(value: 0)
+    let tracer = self.tracer!
+    let consumer = Thread {
+      defer { consumerFinished.signal() }
+      do {
+        try tracer.pump {
+          stopping.lock()
+          defer { stopping.unlock() }
+          return stopped
+        }
+      } catch {
+        // The BPF program cannot be trusted anymore
+        logger.error("Tracing failed: \(error)")
+        exit(1)
+      }
+    }
+    consumer.name = "mkcheck2-consumer"
+    consumer.start()
+
+    logger.info("Listening on \(socketPath)")
+    let sessions = DispatchGroup()
+    // A failure to accept still waits for the sessions and the consumer below,
+    // which use the BPF object until then
+    var acceptError: Error?
+    while true {
+      let accepted: UnixSocket?
+      do {
+        accepted = try listener.accept()
+      } catch {
+        logger.error("Failed to accept a client: \(error)")
+        acceptError = error
+        break
+      }
+      guard let connection = accepted else { break }
+      do {
+        try connection.setReceiveTimeout(seconds: TraceDaemon.requestTimeoutSeconds)
+      } catch {
+        logger.error("Dropping client: \(error)")
+        continue
+      }
+      sessions.enter()
+      let thread = Thread { [self] in
+        defer { sessions.leave() }
+        do {
+          try serveSession(connection)
+        } catch {
+          logger.error("Session failed: \(error)")
+          try? connection.send(Response(error: "\(error)"))
+        }
+      }
+      thread.name = "mkcheck2-session"
+      thread.start()
+    }
+
+    sessions.wait()
+    stopping.lock()
+    stopped = true
+    stopping.unlock()
+    consumerFinished.wait()
+    if let acceptError {
+      throw acceptError
+    }
+    // Collected across all sessions
+    try tracer.reportStats(format: options.statsFormat)
+  }
+
+  private func serveSession(_ connection: UnixSocket) throws {
+    let request = try connection.receive(Request.self)
+    let client = try authorize(connection, pid: request.pid)
+    logger.info("Tracing PID \(request.pid)")
+
+    let cgroup = try self.cgroup.map { try TracingCgroup.create(for: request.pid, in: $0) }
+    // The client is the real parent of the root
+    let session: TraceSession
+    do {
+      session = try tracer.begin(root: request.pid, selfPid: client, cgroup: cgroup)
+    } catch {
+      cgroup?.remove()
+      throw error
+    }
+    try connection.send(Response())
+
+    // The session completes once the root exits, even if the client is gone
+    session.completion.wait()
+    let trace = session.trace
+    let output = trace.render(format: request.format, compact: request.compact ?? false)
+    try connection.send(Response(exitCode: trace.rootExitCode, output: output))
+  }
+
+  /// Only let a client trace its own processes, unless it is root
+  /// - Returns: The pid of the client
+  private func authorize(_ connection: UnixSocket, pid: pid_t) throws -> pid_t {
+    var peerPID: pid_t = 0
+    var peerUID: uid_t = 0
+    guard swift_peer_cred(connection.fd, &peerPID, &peerUID) == 0 else {
+      throw Mkcheck2Error("Failed to get peer credentials: \(String(cString: strerror(errno)))")
+    }
+    var st = stat()
+    guard stat("/proc/\(pid)", &st) == 0 else {
+      throw Mkcheck2Error("Process \(pid) not found")
+    }
+    guard peerUID == 0 || st.st_uid == peerUID else {
+      throw Mkcheck2Error("Permission denied to trace process \(pid)")
+    }
+    return peerPID
+  }
+
+  deinit {
+    tracer = nil
+    bpf_object__unpin_maps(obj.pointee.obj, pinPath)
+    try? FileManager.default.removeItem(atPath: pinPath)
+    detach()
+    mkcheck2_bpf__destroy(obj)
+  }
+}
+
+/// A unix stream socket exchanging newline-delimited JSON messages
+final class UnixSocket {
+  let fd: Int32
+  /// Bytes received after the last complete message
+  private var buffer: [UInt8] = []
+
+  private init(fd: Int32) {
+    self.fd = fd
+  }
+
+  private static func open() throws -> UnixSocket {
+    let fd = socket(AF_UNIX, Int32(SOCK_STREAM.rawValue) | Int32(SOCK_CLOEXEC.rawValue), 0)
+    guard fd >= 0 else {
+      throw Mkcheck2Error("Failed to create socket: \(String(cString: strerror(errno)))")
+    }
+    return UnixSocket(fd: fd)
+  }
+
+  private static func withAddress<R>(
+    _ path: String, _ body: (UnsafePointer<sockaddr>, socklen_t) -> R
+  ) throws -> R {
+    var address = sockaddr_un()
+    address.sun_family = sa_family_t(AF_UNIX)
+    let bytes = Array(path.utf8)
+    guard bytes.count < MemoryLayout.size(ofValue: address.sun_path) else {
+      throw Mkcheck2Error("Socket path is too long: \(path)")
+    }
+    withUnsafeMutableBytes(of: &address.sun_path) { $0.copyBytes(from: bytes) }
+    return withUnsafePointer(to: &address) {
+      $0.withMemoryRebound(to: sockaddr.self, capacity: 1) {
+        body($0, socklen_t(MemoryLayout<sockaddr_un>.size))
+      }
+    }
+  }
+
+  /// Listen on the given path, replacing any stale socket there
+  static func listen(path: String) throws -> UnixSocket {
+    let socket = try open()
+    unlink(path)
+    guard try withAddress(path, { bind(socket.fd, $0, $1) }) == 0 else {
+      throw Mkcheck2Error("Failed to bind \(path): \(String(cString: strerror(errno)))")
+    }
+    guard Glibc.listen(socket.fd, SOMAXCONN) == 0 else {
+      throw Mkcheck2Error("Failed to listen on \(path): \(String(cString: strerror(errno)))")
+    }
+    return socket
+  }
+
+  static func connect(path: String) throws -> UnixSocket {
+    let socket = try open()
+    guard try withAddress(path, { Glibc.connect(socket.fd, $0, $1) }) == 0 else {
+      throw Mkcheck2Error("Failed to connect to \(path): \(String(cString: strerror(errno)))")
+    }
+    return socket
+  }
+
+  /// - Returns: The accepted connection, or nil if the socket was shut down
+  func accept() throws -> UnixSocket? {
+    while true {
+      let connection = accept4(fd, nil, nil, Int32(SOCK_CLOEXEC.rawValue))
+      if connection >= 0 {
+        return UnixSocket(fd: connection)
+      }
+      switch errno {
+      case EINTR, ECONNABORTED: continue
+      case EINVAL: return nil
+      default:
+        throw Mkcheck2Error("Failed to accept: \(String(cString: strerror(errno)))")
+      }
+    }
+  }
+
+  /// Make `receive` fail if no data arrives for the given time
+  func setReceiveTimeout(seconds: Int) throws {
+    var timeout = timeval(tv_sec: seconds, tv_usec: 0)
+    guard
+      setsockopt(
+        fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, socklen_t(MemoryLayout<timeval>.size)) == 0
+    else {
+      throw Mkcheck2Error(
+        "Failed to set receive timeout: \(String(cString: strerror(errno)))")
+    }
+  }
+
+  /// Wake up `accept` and make it return nil
+  func shutdown() {
+    _ = Glibc.shutdown(fd, Int32(SHUT_RDWR))
+  }
+
+  func send<Message: Encodable>(_ message: Message) throws {
+    // JSONEncoder escapes newlines in strings, so a message is a single line
+    var data = try JSONEncoder().encode(message)
+    data.append(UInt8(ascii: "\n"))
+    try data.withUnsafeBytes { bytes in
+      var offset = 0
+      while offset < bytes.count {
+        // Do not die of SIGPIPE if the peer is gone
+        let written = Glibc.send(
+          fd, bytes.baseAddress! + offset, bytes.count - offset, Int32(MSG_NOSIGNAL))
+        guard written >= 0 else {
+          if errno == EINTR { continue }
+          throw Mkcheck2Error("Failed to send: \(String(cString: strerror(errno)))")
+        }
+        offset += written
+      }
+    }
+  }
+
+  func receive<Message: Decodable>(_ type: Message.Type) throws -> Message {
+    var chunk = [UInt8](repeating: 0, count: 64 * 1024)
+    while true {
+      if let newline = buffer.firstIndex(of: UInt8(ascii: "\n")) {
+        let line = Data(buffer[..<newline])
+        buffer.removeSubrange(...newline)
+        return try JSONDecoder().decode(type, from: line)
+      }
+      let count = read(fd, &chunk, chunk.count)
+      guard count > 0 else {
+        if count < 0 && errno == EINTR { continue }
+        if count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) {
+          throw Mkcheck2Error("Timed out waiting for a message")
+        }
+        throw Mkcheck2Error("Connection closed")
+      }
+      buffer.append(contentsOf: chunk[..<count])
+    }
+  }
+
+  deinit {
+    close(fd)
+  }
+}
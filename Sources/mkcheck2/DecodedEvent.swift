@@ -0,0 +1,124 @@
+import Foundation
+import SystemPackage
+import mkcheck2abi
+
+/// An event record copied out of the ring buffer, with its paths decoded
+///
+/// ## Discussion
+/// Decoding a record only depends on its bytes, while applying it to a `Trace`
+/// depends on the processes and files seen so far. The consumer decodes the
+/// records of a batch in parallel, and then applies them one by one in
+/// submission order.
+///
+/// Only decoding is parallel. Normalizing the paths stays on the tracing
+/// thread, as it depends on the working directory of the process and on the
+/// `SymlinkCache`, which the symlinks, renames and removals of earlier events
+/// update. Applying the events is the ceiling of the consumer throughput.
+struct DecodedEvent {
+  var header: mkcheck2_event_header
+  /// The payload of the event, or 0 if its layout has none
+  var payload: Int32 = 0
+  /// The kernel file id of a `mkcheck2_event`, or 0
+  var fileID: UInt64 = 0
+  /// The paths of the event, one per element of its `path_len` array
+  var paths: [FilePath?] = []
+  /// The resource usage carried by an exit event
+  var usage: mkcheck2_rusage?
+
+  /// Decode a record, which may come from a recording on disk and is checked
+  /// to hold the layout of its type before it is read
+  init(_ data: UnsafeMutableRawPointer, size: Int) throws {
+    guard size >= MemoryLayout<mkcheck2_event_header>.size else {
+      throw Mkcheck2Error("Event record is shorter than its header: \(size) bytes")
+    }
+    let eventHeader = data.bindMemory(to: mkcheck2_event_header.self, capacity: 1)
+    guard Int(eventHeader.pointee.size) <= size else {
+      throw Mkcheck2Error("Event record is truncated: \(eventHeader.pointee.size) > \(size)")
+    }
+    guard let type = mkcheck2_event_type(rawValue: eventHeader.pointee._type) else {
+      throw Mkcheck2Error("Unknown event type \(eventHeader.pointee._type)")
+    }
+    header = eventHeader.pointee
+
+    switch type {
+    case .eventTypeExit:
+      let event = try DecodedEvent.bind(data, as: mkcheck2_exit_event.self, size: header.size)
+      payload = event.pointee.payload
+      usage = event.pointee.usage
+    case .eventTypeExec, .eventTypeClone, .eventTypeFileName, .eventTypeChdir, .eventTypeInput,
+      .eventTypeOutput, .eventTypeRemove:
+      let event = try DecodedEvent.bind(data, as: mkcheck2_event.self, size: header.size)
+      payload = event.pointee.payload
+      fileID = event.pointee.file_id
+      paths = [try event.path]
+    case .eventTypeExecAt, .eventTypeInputAt, .eventTypeOutputAt, .eventTypeRemoveAt,
+      .eventTypeRename, .eventTypeLink, .eventTypeSymlink:
+      let event = try DecodedEvent.bind(data, as: mkcheck2_fat_event.self, size: header.size)
+      payload = event.pointee.payload
+      let (path0, path1) = try event.paths
+      paths = [path0, path1]
+    case .eventTypeRenameAt, .eventTypeLinkAt, .eventTypeSymlinkAt:
+      let event = try DecodedEvent.bind(data, as: mkcheck2_fat2_event.self, size: header.size)
+      let (path0, path1, path2, path3) = try event.paths
+      paths = [path0, path1, path2, path3]
+    }
+  }
+
+  /// Bind a record to the layout of its type
+  /// - Parameter size: The size of the record as stated by its header
+  private static func bind<Event>(
+    _ data: UnsafeMutableRawPointer, as type: Event.Type, size: UInt32
+  ) throws -> UnsafeMutablePointer<Event> {
+    guard Int(size) >= MemoryLayout<Event>.stride else {
+      throw Mkcheck2Error("Event record is too short for \(Event.self): \(size) bytes")
+    }
+    return data.bindMemory(to: Event.self, capacity: 1)
+  }
+
+  /// Keep the uids in a trace independent of the session id the BPF program
+  /// tagged them with
+  mutating func clearSession() {
+    header.uid &= (1 << MKCHECK2_UID_SESSION_SHIFT) - 1
+  }
+
+  /// The path of a `mkcheck2_event`
+  var path: FilePath? {
+    paths.first ?? nil
+  }
+
+  /// The path of a `mkcheck2_event`, or a placeholder naming the inode of a
+  /// file without a path like a pipe
+  var pathOrInode: FilePath {
+    path ?? FilePath("/inode:\(payload)")
+  }
+
+  /// Decode the given records, in parallel if there are enough of them
+  /// - Returns: The decoded records or decoding errors, in the order of `records`
+  static func decode(_ records: [ShardedConsumer.Record]) -> [Result<DecodedEvent, Error>] {
+    let decodeOne = { (record: ShardedConsumer.Record) in
+      Result<DecodedEvent, Error> {
+        // Decoding only reads the record
+        try record.bytes.withUnsafeBytes {
+          try DecodedEvent(UnsafeMutableRawPointer(mutating: $0.baseAddress!), size: $0.count)
+        }
+      }
+    }
+    // Below this, handing the records to the workers costs more than decoding them
+    let parallelThreshold = 256
+    guard records.count >= parallelThreshold else {
+      return records.map(decodeOne)
+    }
+
+    var results = [Result<DecodedEvent, Error>?](repeating: nil, count: records.count)
+    let chunkSize = 64
+    let chunks = (records.count + chunkSize - 1) / chunkSize
+    results.withUnsafeMutableBufferPointer { results in
+      DispatchQueue.concurrentPerform(iterations: chunks) { chunk in
+        for index in chunk * chunkSize..<min((chunk + 1) * chunkSize, records.count) {
+          results[index] = decodeOne(records[index])
+        }
+      }
+    }
+    return results.map { $0! }
+  }
+}
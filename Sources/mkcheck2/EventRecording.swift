@@ -0,0 +1,278 @@
+import ArgumentParser
+import Foundation
+import SystemPackage
+import mkcheck2abi
+
+extension Mkcheck2 {
+  struct Analyze: ParsableCommand {
+    static let configuration = CommandConfiguration(
+      abstract: "Build the trace of the events recorded with --record")
+
+    @Argument(help: "The file the events were recorded to")
+    var events: String
+
+    @Option(name: .shortAndLong, help: "The output file to write the trace")
+    var output: String
+
+    @Option(name: .shortAndLong, help: "The output format")
+    var format: OutputFormat = .json
+
+    @Flag(name: .long, help: "Write the JSON output on a single line instead of indenting it")
+    var compact: Bool = false
+
+    @Option(name: .long, help: "The log level")
+    var logLevel: LogLevel = LogLevel(.warning)
+
+    @Option(name: .long, help: "Only report inputs and outputs under the given path prefix")
+    var includePrefix: [String] = []
+
+    @Option(name: .long, help: "Do not report inputs and outputs under the given path prefix")
+    var excludePrefix: [String] = []
+
+    @Flag(
+      name: .long,
+      help: "Analyze a recording cut short up to the cut, leaving the exit status unknown")
+    var allowTruncated: Bool = false
+
+    func run() throws {
+      Mkcheck2.bootstrapLogger(level: logLevel)
+      let pathFilter = try PathFilter(includes: includePrefix, excludes: excludePrefix)
+      // Only the paths and symlinks created by the build are known from the records
+      logger.warning(
+        "Symlinks are resolved against the file system as it is now, not as during the build")
+      let trace = try EventRecording(path: events).replay(
+        pathFilter: pathFilter, allowTruncated: allowTruncated)
+      if try trace.write(format: format, compact: compact, toFile: output) {
+        print("Trace written to \(output)")
+      }
+    }
+  }
+}
+
+/// The layout of event recordings
+///
+/// ## Discussion
+/// In record mode, the consumer appends the records of the ring buffer to a
+/// file as they are, instead of decoding them and applying them to a trace.
+/// `mkcheck2 analyze` applies them later, in the order they were recorded.
+///
+///     header   "mkc2evts", UInt32 version, UInt64 layout fingerprint,
+///              Int32 root pid, Int32 pid of mkcheck2, UInt32 length of the
+///              working directory, its bytes
+///     records  UInt32 length, then the record as submitted by the BPF program
+///     trailer  UInt32 0, Int32 exit code of the root or -1 if unknown,
+///              UInt64 dropped events
+///
+/// All integers are little-endian. A recording without its trailer was cut
+/// short, and is only analyzed up to the cut on request. The records are in
+/// the layout of `mkcheck2.h`, so a recording is only analyzed by a build of
+/// mkcheck2 whose layout has the same fingerprint.
+enum EventRecordingFormat {
+  static let magic = Array("mkc2evts".utf8)
+  static let version: UInt32 = 2
+  /// The size of the header before the bytes of the working directory
+  static let fixedHeaderSize = magic.count + 24
+
+  /// A hash of the sizes and field offsets of the records in `mkcheck2.h`
+  static let layoutFingerprint: UInt64 = {
+    func offset<T>(_ key: PartialKeyPath<T>) -> Int { MemoryLayout<T>.offset(of: key)! }
+    let layout = [
+      MemoryLayout<mkcheck2_event_header>.size, offset(\mkcheck2_event_header._type),
+      offset(\mkcheck2_event_header.pid), offset(\mkcheck2_event_header.uid),
+      offset(\mkcheck2_event_header.source_line), offset(\mkcheck2_event_header.size),
+      offset(\mkcheck2_event_header.seq), offset(\mkcheck2_event_header.session),
+      offset(\mkcheck2_event_header.epoch), offset(\mkcheck2_event_header.timestamp),
+      MemoryLayout<mkcheck2_event>.size, offset(\mkcheck2_event.payload),
+      offset(\mkcheck2_event.path_len), offset(\mkcheck2_event.file_id),
+      MemoryLayout<mkcheck2_fat_event>.size, offset(\mkcheck2_fat_event.payload),
+      offset(\mkcheck2_fat_event.path_len),
+      MemoryLayout<mkcheck2_fat2_event>.size, offset(\mkcheck2_fat2_event.path_len),
+      MemoryLayout<mkcheck2_exit_event>.size, offset(\mkcheck2_exit_event.payload),
+      offset(\mkcheck2_exit_event.usage), MemoryLayout<mkcheck2_rusage>.size,
+      Int(MKCHECK2_UID_SESSION_SHIFT),
+    ]
+    // FNV-1a
+    return layout.reduce(0xcbf2_9ce4_8422_2325) { hash, value in
+      (hash ^ UInt64(truncatingIfNeeded: value)) &* 0x100_0000_01b3
+    }
+  }()
+
+  /// The exit code of the trailer when the exit status of the root is unknown
+  static let unknownExitCode: Int32 = -1
+}
+
+/// Appends the raw records of a session to a file
+final class EventRecorder {
+  let path: String
+  private let output: FileOutputStream
+
+  /// Create the recording and write its header
+  /// - Parameter cwd: The working directory the root process starts in
+  init(path: String, root: pid_t, selfPid: pid_t, cwd: String) throws {
+    self.path = path
+    // Records are small, so write them out in large chunks
+    output = try FileOutputStream(path: path, bufferSize: 4 << 20)
+    output.write(bytes: EventRecordingFormat.magic)
+    output.write(littleEndian: EventRecordingFormat.version)
+    output.write(littleEndian: EventRecordingFormat.layoutFingerprint)
+    output.write(littleEndian: root)
+    output.write(littleEndian: selfPid)
+    let cwd = Array(cwd.utf8)
+    output.write(littleEndian: UInt32(cwd.count))
+    output.write(bytes: cwd)
+  }
+
+  func append(_ record: [UInt8]) {
+    output.write(littleEndian: UInt32(record.count))
+    output.write(bytes: record)
+  }
+
+  /// Write the outcome of the session, once it completed, and close the file
+  /// - Parameter exitCode: The exit code of the root, or nil if it is unknown
+  func finish(exitCode: Int32?, droppedEvents: UInt64) throws {
+    output.write(littleEndian: UInt32(0))
+    output.write(littleEndian: exitCode ?? EventRecordingFormat.unknownExitCode)
+    output.write(littleEndian: droppedEvents)
+    try output.close()
+  }
+}
+
+/// Events recorded by `EventRecorder`, mapped into memory
+final class EventRecording {
+  /// The outcome of the session, as written by `EventRecorder.finish`
+  struct Outcome {
+    /// The exit code of the root, or nil if it is unknown
+    let exitCode: Int32?
+    let droppedEvents: UInt64
+  }
+
+  let root: pid_t
+  let selfPid: pid_t
+  /// The working directory of mkcheck2, which the root started in
+  let cwd: FilePath
+  let path: String
+  private let file: MappedFile
+  /// The offset of the first record
+  private let recordsStart: Int
+
+  init(path: String) throws {
+    self.path = path
+    file = try MappedFile(path: path)
+    let bytes = file.bytes
+    let fixedSize = EventRecordingFormat.fixedHeaderSize
+    guard bytes.starts(with: EventRecordingFormat.magic), bytes.count >= fixedSize else {
+      throw Mkcheck2Error("\(path) is not an event recording")
+    }
+    // self is not initialized yet
+    func integer<Value: FixedWidthInteger>(at offset: Int, as type: Value.Type) -> Value {
+      Value(littleEndian: bytes.loadUnaligned(fromByteOffset: offset, as: Value.self))
+    }
+    let version = integer(at: 8, as: UInt32.self)
+    guard version == EventRecordingFormat.version else {
+      throw Mkcheck2Error(
+        "\(path) has recording version \(version), expected \(EventRecordingFormat.version)")
+    }
+    guard integer(at: 12, as: UInt64.self) == EventRecordingFormat.layoutFingerprint else {
+      throw Mkcheck2Error(
+        "\(path) was recorded by a build of mkcheck2 with a different event layout")
+    }
+    root = integer(at: 20, as: Int32.self)
+    selfPid = integer(at: 24, as: Int32.self)
+    let cwdLength = Int(integer(at: 28, as: UInt32.self))
+    guard cwdLength <= bytes.count - fixedSize else {
+      throw Mkcheck2Error("\(path) is truncated")
+    }
+    cwd = FilePath(
+      String(decoding: bytes[fixedSize..<fixedSize + cwdLength], as: UTF8.self))
+    recordsStart = fixedSize + cwdLength
+  }
+
+  private func integer<Value: FixedWidthInteger>(at offset: Int, as type: Value.Type) -> Value {
+    Value(littleEndian: file.bytes.loadUnaligned(fromByteOffset: offset, as: Value.self))
+  }
+
+  /// Calls the body with the records in the order they were recorded, in
+  /// batches. Records are copied out of the mapping, where they are not
+  /// aligned.
+  /// - Returns: The outcome of the session, or nil if the recording was cut
+  ///   short
+  func forEachBatch(
+    size batchSize: Int = 4096, _ body: ([ShardedConsumer.Record]) throws -> Void
+  ) throws -> Outcome? {
+    let bytes = file.bytes
+    var batch: [ShardedConsumer.Record] = []
+    batch.reserveCapacity(batchSize)
+    var offset = recordsStart
+    var outcome: Outcome?
+    var seq: UInt64 = 0
+    while offset + 4 <= bytes.count {
+      let length = Int(integer(at: offset, as: UInt32.self))
+      offset += 4
+      guard length > 0 else {
+        guard offset + 12 <= bytes.count else { break }
+        let exitCode = integer(at: offset, as: Int32.self)
+        outcome = Outcome(
+          exitCode: exitCode == EventRecordingFormat.unknownExitCode ? nil : exitCode,
+          droppedEvents: integer(at: offset + 4, as: UInt64.self))
+        break
+      }
+      guard length <= bytes.count - offset else { break }
+      batch.append(
+        ShardedConsumer.Record(seq: seq, bytes: Array(bytes[offset..<offset + length])))
+      offset += length
+      seq += 1
+      if batch.count == batchSize {
+        try body(batch)
+        batch.removeAll(keepingCapacity: true)
+      }
+    }
+    if !batch.isEmpty {
+      try body(batch)
+    }
+    return outcome
+  }
+
+  /// Returns an empty trace of the recorded session
+  func makeTrace() -> Trace {
+    Trace(root: root, selfPid: selfPid, cwd: cwd)
+  }
+
+  /// Apply the recorded events to a new trace
+  /// - Parameters:
+  ///   - pathFilter: Applied to the paths read from user space. The prefixes
+  ///     given to `--record` only filtered the paths of open files.
+  ///   - allowTruncated: Return the trace of a recording cut short, whose root
+  ///     exit status is unknown, instead of failing
+  func replay(pathFilter: PathFilter? = nil, allowTruncated: Bool = false) throws -> Trace {
+    let trace = makeTrace()
+    trace.pathFilter = pathFilter
+    var count = 0
+    // Decoded in parallel batches like the ones of a live session
+    let outcome = try forEachBatch { batch in
+      count += batch.count
+      for result in DecodedEvent.decode(batch) {
+        var event = try result.get()
+        event.clearSession()
+        try trace.handleEvent(event)
+      }
+    }
+
+    if let outcome {
+      if let exitCode = outcome.exitCode {
+        trace.rootExited(exitCode: exitCode)
+      } else if trace.rootExitCode == nil {
+        logger.error("Exit status of the root process is unknown")
+      }
+      trace.droppedEvents = outcome.droppedEvents
+    } else if allowTruncated {
+      logger.warning("\(path) is truncated, the trace only covers its first \(count) events")
+    } else {
+      throw Mkcheck2Error(
+        "\(path) is truncated after \(count) events, pass --allow-truncated to analyze them")
+    }
+    if trace.droppedEvents > 0 {
+      logger.warning("The trace is incomplete: \(trace.droppedEvents) events dropped")
+    }
+    return trace
+  }
+}
@@ -0,0 +1,37 @@
+import Foundation
+
+/// A file mapped read-only into memory
+final class MappedFile {
+  /// The contents of the file
+  let bytes: UnsafeRawBufferPointer
+
+  init(path: String) throws {
+    let fd = open(path, O_RDONLY | O_CLOEXEC)
+    guard fd >= 0 else {
+      throw Mkcheck2Error("Failed to open \(path): \(String(cString: strerror(errno)))")
+    }
+    defer { close(fd) }
+    var st = stat()
+    guard fstat(fd, &st) == 0 else {
+      throw Mkcheck2Error("Failed to stat \(path): \(String(cString: strerror(errno)))")
+    }
+    let size = Int(st.st_size)
+    guard size > 0 else {
+      // mmap rejects empty mappings
+      bytes = UnsafeRawBufferPointer(start: nil, count: 0)
+      return
+    }
+    guard let mapped = mmap(nil, size, PROT_READ, MAP_PRIVATE, fd, 0),
+      mapped != UnsafeMutableRawPointer(bitPattern: -1)
+    else {
+      throw Mkcheck2Error("Failed to map \(path): \(String(cString: strerror(errno)))")
+    }
+    bytes = UnsafeRawBufferPointer(start: mapped, count: size)
+  }
+
+  deinit {
+    if let base = bytes.baseAddress {
+      munmap(UnsafeMutableRawPointer(mutating: base), bytes.count)
+    }
+  }
+}
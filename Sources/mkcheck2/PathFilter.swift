@@ -0,0 +1,105 @@
+import Foundation
+import SystemPackage
+import mkcheck2abi
+import mkcheck2bpf_skelton
+
+/// Path prefixes whose inputs and outputs are dropped
+///
+/// Each prefix is matched in two ways:
+/// - Paths of open files are matched by the BPF program, by walking up their
+///   dentries and looking up each of them by its (dev, ino), which is
+///   resolved here. A file too deep for the walk is sent with its path
+///   inline, and matched like the paths read from user space.
+/// - Paths read from user space are matched by `allows` once the trace has
+///   normalized them, as the raw strings may be relative or contain "..".
+///
+/// The longest (nearest) matching prefix decides, and a prefix matches the
+/// directory it names as well as the paths below it. Paths matching no prefix
+/// are excluded if any include prefix is given, and included otherwise.
+struct PathFilter {
+  let includes: [FilePath]
+  let excludes: [FilePath]
+
+  init(includes: [String], excludes: [String]) throws {
+    func normalize(_ prefix: String) throws -> FilePath {
+      let path = FilePath(prefix).lexicallyNormalized()
+      guard path.isAbsolute else {
+        throw Mkcheck2Error("Path prefix must be absolute: \(prefix)")
+      }
+      return path
+    }
+    self.includes = try includes.map(normalize)
+    self.excludes = try excludes.map(normalize)
+    guard self.includes.count + self.excludes.count <= Int(MKCHECK2_PATH_FILTER_MAX) else {
+      throw Mkcheck2Error("Too many path prefixes (max \(MKCHECK2_PATH_FILTER_MAX))")
+    }
+  }
+
+  var isEnabled: Bool { !includes.isEmpty || !excludes.isEmpty }
+
+  /// Whether inputs and outputs of the given normalized path are reported
+  func allows(_ path: FilePath) -> Bool {
+    // The number of components of the longest prefix containing the path, or -1
+    func longest(_ prefixes: [FilePath]) -> Int {
+      prefixes.filter { path.starts(with: $0) }.map { $0.components.count }.max() ?? -1
+    }
+    let include = longest(includes)
+    let exclude = longest(excludes)
+    if include < 0 && exclude < 0 {
+      return includes.isEmpty
+    }
+    // An exclude wins over the same include prefix
+    return include > exclude
+  }
+
+  /// Set the read-only configuration. Must be called before loading the BPF object.
+  func configure(_ obj: UnsafeMutablePointer<mkcheck2_bpf>) {
+    obj.pointee.rodata.pointee.path_filter_enabled = isEnabled
+    obj.pointee.rodata.pointee.path_filter_default =
+      includes.isEmpty
+      ? mkcheck2_path_filter_verdict.pathFilterInclude.rawValue
+      : mkcheck2_path_filter_verdict.pathFilterExclude.rawValue
+  }
+
+  /// Populate the directory map. Must be called after loading the BPF object.
+  func install(_ obj: UnsafeMutablePointer<mkcheck2_bpf>) {
+    // Excludes are installed last so that they win over the same include prefix
+    for (prefixes, verdict) in [
+      (includes, mkcheck2_path_filter_verdict.pathFilterInclude),
+      (excludes, mkcheck2_path_filter_verdict.pathFilterExclude),
+    ] {
+      for prefix in prefixes {
+        insertDirectory(prefix, verdict: verdict, obj: obj)
+      }
+    }
+  }
+
+  private func insertDirectory(
+    _ prefix: FilePath, verdict: mkcheck2_path_filter_verdict,
+    obj: UnsafeMutablePointer<mkcheck2_bpf>
+  ) {
+    var st = stat()
+    guard stat(prefix.string, &st) == 0, (st.st_mode & S_IFMT) == S_IFDIR else {
+      // Still matched by `allows` for the paths read from user space
+      logger.warning("Path prefix \(prefix) is not an existing directory")
+      return
+    }
+    var key = mkcheck2_path_filter_dir_key()
+    key.ino = UInt64(st.st_ino)
+    key.dev = PathFilter.kernelDeviceNumber(UInt64(st.st_dev))
+    var value = verdict.rawValue
+    let fd = bpf_map__fd(obj.pointee.maps.path_filter_dirs)
+    if bpf_map_update_elem(fd, &key, &value, UInt64(BPF_ANY)) != 0 {
+      logger.warning(
+        "Failed to add directory \(prefix): \(String(cString: strerror(errno)))")
+    }
+  }
+
+  /// Convert a user-space dev_t (as encoded by glibc) to the kernel-internal
+  /// encoding used by `super_block::s_dev`
+  static func kernelDeviceNumber(_ dev: UInt64) -> UInt32 {
+    let major = ((dev >> 8) & 0xfff) | ((dev >> 32) & ~0xfff)
+    let minor = (dev & 0xff) | ((dev >> 12) & ~0xff)
+    return UInt32(truncatingIfNeeded: (major << 20) | minor)
+  }
+}
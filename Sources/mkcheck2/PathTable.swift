@@ -0,0 +1,218 @@
+import Foundation
+import SystemPackage
+
+/// Interns the paths of a trace
+///
+/// ## Discussion
+/// Each path is a node of a trie, which holds a single component and points
+/// to the node of its parent directory. The component bytes of all nodes are
+/// stored back-to-back in a single arena, so a directory prefix is stored once
+/// however many files are below it. The children of all nodes are found
+/// through a single open-addressing hash table keyed by parent node and
+/// component, which compares the candidates against the arena.
+///
+/// Node ids are dense, so that the per-node data of the table and its users
+/// are plain arrays.
+struct PathTable {
+  typealias Node = UInt32
+
+  /// The node of "/"
+  static let root: Node = 0
+  /// The node relative paths hang off. It has no component.
+  static let relativeRoot: Node = 1
+
+  /// The component bytes of all nodes
+  private(set) var arena: [UInt8] = []
+  /// Per-node parent, and offset and length of the component in the arena
+  private(set) var parents: [Node] = [root, relativeRoot]
+  private(set) var offsets: [UInt32] = [0, 0]
+  private(set) var lengths: [UInt16] = [0, 0]
+  /// Slots of the child lookup table. The roots are never children, so 0
+  /// marks an empty slot.
+  private var slots = [Node](repeating: 0, count: 1024)
+
+  /// The number of nodes, including the two roots
+  var count: Int { parents.count }
+
+  /// Returns the node of the given path, inserting it and its missing
+  /// ancestors. Empty components are skipped, and "." and ".." are kept as is.
+  mutating func intern(_ path: FilePath) -> Node {
+    path.withPlatformString { cString in
+      let bytes = UnsafeRawBufferPointer(start: cString, count: strlen(cString))
+      let slash = UInt8(ascii: "/")
+      var node = bytes.first == slash ? PathTable.root : PathTable.relativeRoot
+      var start = 0
+      while start < bytes.count {
+        let end = bytes[start...].firstIndex(of: slash) ?? bytes.count
+        if end > start {
+          node = child(of: node, named: UnsafeRawBufferPointer(rebasing: bytes[start..<end]))
+        }
+        start = end + 1
+      }
+      return node
+    }
+  }
+
+  /// Returns the node of the parent directory. The parent of a root is itself.
+  func parent(of node: Node) -> Node {
+    parents[Int(node)]
+  }
+
+  /// Rebuild the path of the given node
+  func path(of node: Node) -> FilePath {
+    var ancestors: [Node] = []
+    var current = node
+    while current > PathTable.relativeRoot {
+      ancestors.append(current)
+      current = parents[Int(current)]
+    }
+    var bytes: [UInt8] = current == PathTable.root ? [UInt8(ascii: "/")] : []
+    for (index, ancestor) in ancestors.reversed().enumerated() {
+      if index > 0 {
+        bytes.append(UInt8(ascii: "/"))
+      }
+      bytes += arena[componentRange(of: ancestor)]
+    }
+    return FilePath(platformBytes: bytes)
+  }
+
+  private func componentRange(of node: Node) -> Range<Int> {
+    let offset = Int(offsets[Int(node)])
+    return offset..<offset + Int(lengths[Int(node)])
+  }
+
+  private mutating func child(of parent: Node, named component: UnsafeRawBufferPointer) -> Node {
+    let mask = slots.count - 1
+    var slot = PathTable.hash(parent, component) & mask
+    while slots[slot] != 0 {
+      let candidate = slots[slot]
+      if parents[Int(candidate)] == parent
+        && arena[componentRange(of: candidate)].elementsEqual(component)
+      {
+        return candidate
+      }
+      slot = (slot + 1) & mask
+    }
+
+    precondition(component.count <= UInt16.max, "Path component is too long")
+    precondition(arena.count + component.count <= UInt32.max, "Path arena is full")
+    let node = Node(parents.count)
+    parents.append(parent)
+    offsets.append(UInt32(arena.count))
+    lengths.append(UInt16(component.count))
+    arena.append(contentsOf: component)
+    slots[slot] = node
+
+    // Keep the load factor below 3/4
+    if (parents.count - 2) * 4 > slots.count * 3 {
+      grow()
+    }
+    return node
+  }
+
+  private mutating func grow() {
+    slots = [Node](repeating: 0, count: slots.count * 2)
+    let mask = slots.count - 1
+    for node in Node(2)..<Node(parents.count) {
+      let hash = arena[componentRange(of: node)].withUnsafeBytes {
+        PathTable.hash(parents[Int(node)], $0)
+      }
+      var slot = hash & mask
+      while slots[slot] != 0 {
+        slot = (slot + 1) & mask
+      }
+      slots[slot] = node
+    }
+  }
+
+  /// FNV-1a over the parent node and the component
+  private static func hash(_ parent: Node, _ component: UnsafeRawBufferPointer) -> Int {
+    var hash: UInt64 = 0xcbf2_9ce4_8422_2325 ^ UInt64(parent)
+    for byte in component {
+      hash = (hash ^ UInt64(byte)) &* 0x100_0000_01b3
+    }
+    return Int(truncatingIfNeeded: hash ^ (hash >> 32))
+  }
+}
+
+/// The files of a trace, as a struct of arrays indexed by file id
+///
+/// File ids are dense and start from 1, as 0 means "no file". Only the paths
+/// that were looked up as files get an id, not their ancestors.
+struct FileTable {
+  private var paths = PathTable()
+  /// The path node of each file
+  private var nodes: [PathTable.Node] = [0]
+  private var deletedFlags: [Bool] = [false]
+  private var existsFlags: [Bool] = [false]
+  /// Dependencies of the few files that have any
+  private var dependencies: [FileID: [FileID]] = [:]
+  /// The file id of each path node, or 0 if the path is not a file
+  private var fileOfNode: [UInt32] = [0, 0]
+
+  /// All file ids in ascending order
+  var ids: Range<FileID> { 1..<FileID(nodes.count) }
+
+  /// Finds a file by its normalized path, adding it if it is new
+  mutating func find(_ path: FilePath) -> FileID {
+    file(of: paths.intern(path))
+  }
+
+  /// Finds the file of the parent directory, adding it if it is new
+  mutating func parent(of id: FileID) -> FileID {
+    file(of: paths.parent(of: nodes[Int(id)]))
+  }
+
+  private mutating func file(of node: PathTable.Node) -> FileID {
+    if fileOfNode.count < paths.count {
+      fileOfNode.append(contentsOf: repeatElement(0, count: paths.count - fileOfNode.count))
+    }
+    if fileOfNode[Int(node)] != 0 {
+      return FileID(fileOfNode[Int(node)])
+    }
+    precondition(nodes.count <= UInt32.max, "Too many files")
+    let id = FileID(nodes.count)
+    nodes.append(node)
+    deletedFlags.append(false)
+    // FIXME: Check if the file exists
+    existsFlags.append(true)
+    fileOfNode[Int(node)] = UInt32(id)
+    return id
+  }
+
+  mutating func markDeleted(_ id: FileID) {
+    deletedFlags[Int(id)] = true
+    existsFlags[Int(id)] = false
+  }
+
+  mutating func addDependency(from source: FileID, to dest: FileID) {
+    dependencies[source, default: []].append(dest)
+  }
+
+  /// Returns the path of the file
+  func name(of id: FileID) -> FilePath {
+    paths.path(of: nodes[Int(id)])
+  }
+
+  /// Returns a copy of everything known about the file. The path is rebuilt
+  /// from the trie on each call.
+  subscript(id: FileID) -> Trace.FileInfo? {
+    guard ids.contains(id) else { return nil }
+    return Trace.FileInfo(
+      name: name(of: id), deleted: deletedFlags[Int(id)], exists: existsFlags[Int(id)],
+      deps: dependencies[id] ?? [])
+  }
+}
+
+extension FilePath {
+  /// Creates a path from the bytes of its platform string, without the NUL
+  /// terminator. Unlike decoding them as UTF-8, any byte sequence a path may
+  /// hold on Linux is kept as is.
+  init(platformBytes bytes: [UInt8]) {
+    self = (bytes + [0]).withUnsafeBufferPointer { buffer in
+      buffer.withMemoryRebound(to: CInterop.PlatformChar.self) {
+        FilePath(platformString: $0.baseAddress!)
+      }
+    }
+  }
+}
@@ -2,7 +2,7 @@ import Foundation
 import SystemPackage
 
 enum Serialization {
-  struct FileInfo: Codable {
+  struct FileInfo: Decodable {
     var id: FileID
     var name: FilePath
     var deleted: Bool?
@@ -29,12 +29,38 @@ enum Serialization {
       return attributes.joined(separator: ", ")
     }
   }
-  struct Process: Codable {
+  struct Process: Decodable {
     let uid: UID
     let parent: UID
     var image: FileID
     var output: Set<FileID>?
     var input: Set<FileID>?
+    /// CLOCK_MONOTONIC times in nanoseconds, see `Trace.Process`
+    var start: UInt64?
+    var end: UInt64?
+    var firstInput: UInt64?
+    var lastOutput: UInt64?
+    var usage: ResourceUsage?
+  }
+}
+
+extension Serialization.FileInfo {
+  private enum CodingKeys: String, CodingKey {
+    case id, name, deleted, exists, deps
+  }
+
+  init(from decoder: Decoder) throws {
+    let container = try decoder.container(keyedBy: CodingKeys.self)
+    id = try container.decode(FileID.self, forKey: .id)
+    // Traces written before the streaming writer have the encoding of FilePath
+    if let name = try? container.decode(String.self, forKey: .name) {
+      self.name = FilePath(name)
+    } else {
+      name = try container.decode(FilePath.self, forKey: .name)
+    }
+    deleted = try container.decodeIfPresent(Bool.self, forKey: .deleted)
+    exists = try container.decodeIfPresent(Bool.self, forKey: .exists)
+    deps = try container.decodeIfPresent([FileID].self, forKey: .deps)
   }
 }
 
@@ -45,60 +71,174 @@ func relativePath(_ path: String, root: String) -> String {
   return relative.hasPrefix("/") ? String(relative.dropFirst()) : String(relative)
 }
 
-struct DumpFormat: Codable {
+struct DumpFormat: Decodable {
   var files: [Serialization.FileInfo]
   var procs: [Serialization.Process]
+  /// The number of events lost while tracing. Present only if the trace is incomplete.
+  var droppedEvents: UInt64?
 
   mutating func normalize() {
     for i in files.indices {
       files[i].normalize()
     }
   }
+
+  /// Load a trace dumped in JSON or binary format
+  static func load(from path: String) throws -> DumpFormat {
+    if let binary = try BinaryTraceReader(path: path) {
+      return try binary.dumpFormat()
+    }
+    let data = try Data(contentsOf: URL(fileURLWithPath: path))
+    var format = try JSONDecoder().decode(DumpFormat.self, from: data)
+    format.normalize()
+    return format
+  }
+
+  /// Load the files of a trace only. The processes of a binary trace are not
+  /// decoded at all.
+  static func loadFiles(from path: String) throws -> [Serialization.FileInfo] {
+    if let binary = try BinaryTraceReader(path: path) {
+      return try binary.files()
+    }
+    return try load(from: path).files
+  }
 }
 
-extension Trace {
-  func dump(output: inout some TextOutputStream) {
-    let encoder = JSONEncoder()
-    encoder.outputFormatting = [.prettyPrinted, .sortedKeys, .withoutEscapingSlashes]
-    let format = DumpFormat(
-      files: fileInfos.sorted { $0.key < $1.key }.map {
-        Serialization.FileInfo(
-          id: $0.key,
-          name: $0.value.name,
-          deleted: $0.value.deleted,
-          exists: $0.value.exists,
-          deps: $0.value.deps
-        )
-      },
-      procs: procs.values.uniqued().sorted { $0.uid < $1.uid }.map {
-        Serialization.Process(
-          uid: $0.uid,
-          parent: $0.parent,
-          image: $0.image,
-          output: $0.outputs,
-          input: $0.inputs
-        )
+extension DumpFormat {
+  /// Write a trace in JSON format while walking it, in the layout of
+  /// `DumpFormat`. The file ids of a process are sorted.
+  /// - Parameter pretty: Indent the output. Otherwise it is a single line.
+  static func dump<Files: Sequence, Procs: Sequence, Output: TextOutputStream>(
+    files: Files, procs: Procs, droppedEvents: UInt64?, output: inout Output, pretty: Bool
+  ) where Files.Element == Serialization.FileInfo, Procs.Element == Serialization.Process {
+    var json = JSONStreamWriter(output: output, pretty: pretty)
+    json.beginObject()
+    if let droppedEvents, droppedEvents > 0 {
+      json.key("droppedEvents")
+      json.value(droppedEvents)
+    }
+
+    json.key("files")
+    json.beginArray()
+    for info in files {
+      json.beginObject()
+      json.key("deleted")
+      json.value(info.deleted ?? false)
+      json.key("deps")
+      json.value(info.deps ?? [])
+      json.key("exists")
+      json.value(info.exists ?? false)
+      json.key("id")
+      json.value(info.id)
+      json.key("name")
+      json.value(info.name.string)
+      json.endObject()
+    }
+    json.endArray()
+
+    json.key("procs")
+    json.beginArray()
+    for proc in procs {
+      json.beginObject()
+      func optional(_ key: String, _ value: UInt64?) {
+        guard let value else { return }
+        json.key(key)
+        json.value(value)
       }
-    )
-    let data = try! encoder.encode(format)
-    output.write(String(data: data, encoding: .utf8)!)
+      optional("end", proc.end)
+      optional("firstInput", proc.firstInput)
+      json.key("image")
+      json.value(proc.image)
+      json.key("input")
+      json.value((proc.input ?? []).sorted())
+      optional("lastOutput", proc.lastOutput)
+      json.key("output")
+      json.value((proc.output ?? []).sorted())
+      json.key("parent")
+      json.value(proc.parent)
+      optional("start", proc.start)
+      json.key("uid")
+      json.value(proc.uid)
+      if let usage = proc.usage {
+        json.key("usage")
+        json.beginObject()
+        json.key("involuntaryContextSwitches")
+        json.value(usage.involuntaryContextSwitches)
+        json.key("maxRSS")
+        json.value(usage.maxRSS)
+        json.key("readBytes")
+        json.value(usage.readBytes)
+        json.key("systemTime")
+        json.value(usage.systemTime)
+        json.key("userTime")
+        json.value(usage.userTime)
+        json.key("voluntaryContextSwitches")
+        json.value(usage.voluntaryContextSwitches)
+        json.key("writeBytes")
+        json.value(usage.writeBytes)
+        json.endObject()
+      }
+      json.endObject()
+    }
+    json.endArray()
+    json.endObject()
+    output = json.finish()
+  }
+
+  /// Write the trace in JSON format
+  func dump<Output: TextOutputStream>(output: inout Output, pretty: Bool = true) {
+    DumpFormat.dump(
+      files: files, procs: procs, droppedEvents: droppedEvents, output: &output, pretty: pretty)
+  }
+}
+
+extension Trace {
+  /// The files of the trace in the order of their ids, converted as they are
+  /// walked
+  var serializedFiles: some Collection<Serialization.FileInfo> {
+    fileInfos.ids.lazy.map { id in
+      let info = self.fileInfos[id]!
+      return Serialization.FileInfo(
+        id: id, name: info.name, deleted: info.deleted, exists: info.exists, deps: info.deps)
+    }
+  }
+
+  /// The processes of the trace in the order of their uids, converted as they
+  /// are walked
+  var serializedProcs: some Collection<Serialization.Process> {
+    procs.values.uniqued().sorted(by: { ($0.uid, $0.pid) < ($1.uid, $1.pid) }).lazy.map {
+      Serialization.Process(
+        uid: $0.uid, parent: $0.parent, image: $0.image, output: $0.outputs, input: $0.inputs,
+        start: $0.start, end: $0.end, firstInput: $0.firstInput, lastOutput: $0.lastOutput,
+        usage: $0.usage)
+    }
+  }
+
+  /// Write the trace in JSON format while walking it, in the layout of
+  /// `DumpFormat`. Files are written in the order of their ids, processes in
+  /// the order of their uids, and the file ids of a process are sorted.
+  /// - Parameter pretty: Indent the output. Otherwise it is a single line.
+  func dump<Output: TextOutputStream>(output: inout Output, pretty: Bool = true) {
+    DumpFormat.dump(
+      files: serializedFiles, procs: serializedProcs, droppedEvents: droppedEvents,
+      output: &output, pretty: pretty)
   }
 
   func dumpDot(output: inout some TextOutputStream) {
     output.write("digraph trace {\n")
-    for (pid, proc) in procs {
+    for (pid, proc) in procs.sorted(by: { $0.key < $1.key }) {
       let image = fileInfos[proc.image]?.name ?? "unknown"
       output.write("  PROCESS\(pid) [label=\"\(pid)\\n\(image)\"];\n")
       output.write("  FILE\(proc.image) -> PROCESS\(pid) [color=blue];\n")
-      for inputFID in proc.inputs {
+      for inputFID in proc.inputs.sorted() {
         output.write("  FILE\(inputFID) -> PROCESS\(pid) [color=blue];\n")
       }
-      for outputFID in proc.outputs {
+      for outputFID in proc.outputs.sorted() {
         output.write("  PROCESS\(pid) -> FILE\(outputFID) [color=red];\n")
       }
     }
-    for (fid, info) in fileInfos {
-      output.write("  FILE\(fid) [label=\"\(info.name)\"];\n")
+    for fid in fileInfos.ids {
+      output.write("  FILE\(fid) [label=\"\(fileInfos.name(of: fid))\"];\n")
     }
     output.write("}\n")
   }
@@ -153,11 +293,10 @@ extension Trace {
       private static func toFilePathList(_ fileIDs: Set<FileID>, trace: Trace, root: String)
         -> [String]
       {
-        return fileIDs.filter {
-          trace.fileInfos[$0]?.deleted == false && shouldSnapshot(path: trace.fileInfos[$0]!.name)
-            && trace.fileInfos[$0]!.name.string.hasPrefix(root)
+        return fileIDs.compactMap { trace.fileInfos[$0] }.filter {
+          !$0.deleted && shouldSnapshot(path: $0.name) && $0.name.string.hasPrefix(root)
         }
-        .map { relativePath(trace.fileInfos[$0]!.name.string, root: root) }
+        .map { relativePath($0.name.string, root: root) }
         .sorted()
       }
 
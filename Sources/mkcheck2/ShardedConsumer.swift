@@ -0,0 +1,268 @@
+import Foundation
+import mkcheck2abi
+import mkcheck2bpf_skelton
+import mkcheck2syslinux
+
+/// Drains the ring buffer shards on a thread each, and merges their records
+/// back into submission order on the tracing thread
+///
+/// ## Discussion
+/// A ring buffer that is not sharded is a single shard. Either way, the
+/// threads only copy the records out of the kernel, so that the ring buffers
+/// are drained at the same pace however long the records take to be applied
+/// to their traces.
+///
+/// The BPF program submits each record to the shard of the current CPU and
+/// stamps it with a global sequence number. Records of a CPU are in sequence
+/// order within its shard, but shards are drained independently, so a record
+/// can only be handed to `Trace` once no shard can still yield an earlier one.
+///
+/// Records are reserved in their shard before they are numbered. Before
+/// draining, each shard thread reads the next sequence number to be assigned,
+/// and then the producer position of the shard, which covers every record
+/// numbered below that number. If the drain gets past that position, none of
+/// those records is left in the shard, so that number is a lower bound of what
+/// the shard can still yield. Otherwise a record is still being written, which
+/// stops the drain before it, and the bound stays where it was. Records below
+/// the minimum bound of all shards are released in sequence order.
+///
+/// A shard thread stops draining while `maxPendingRecords` of its records wait
+/// to be merged, so that a tracing thread falling behind makes the ring buffers
+/// fill up, which the BPF program reports, instead of growing the memory of the
+/// tracer without bound.
+final class ShardedConsumer {
+  /// Max number of records drained from a shard but not merged yet
+  static let maxPendingRecords = 1 << 20
+
+  struct Record {
+    let seq: UInt64
+    var bytes: [UInt8]
+  }
+
+  private final class Shard {
+    var rb: OpaquePointer!
+    /// struct ring* of `rb`
+    var ring: OpaquePointer!
+    /// Records drained by the current drain. Only touched by the shard thread.
+    var drained: [Record] = []
+
+    /// Signaled when `pending` is merged or the shard is stopped
+    let lock = NSCondition()
+    /// Records drained but not merged yet. Protected by `lock`.
+    var pending: [Record] = []
+    /// Sequence numbers below this are never yielded anymore. Protected by `lock`.
+    var bound: UInt64 = 0
+    /// Protected by `lock`.
+    var stopped = false
+    /// Protected by `lock`.
+    var error: Error?
+
+    let finished = DispatchSemaphore(value: 0)
+  }
+
+  private let shards: [Shard]
+  /// File descriptors of the shards created by userland
+  private let createdFDs: [Int32]
+  /// The `next_event_seq` variable of the BPF program
+  private let nextSeq: UnsafeMutablePointer<UInt64>
+  /// Records merged from the shards but not released yet
+  private var reorderBuffer = ReorderBuffer()
+  /// An eventfd signaled by the shard threads after each drain, to wake up
+  /// the tracing thread
+  let readyFD: Int32
+
+  /// The number of records held back until no shard can precede them
+  var reorderDepth: Int { reorderBuffer.count }
+  /// Every record below this sequence number has been released by `merge`
+  private(set) var releasedSeq: UInt64 = 0
+  /// Whether the shard threads are running
+  private var running = false
+
+  /// Create the shards other than `events` and register them to the BPF program
+  init(obj: UnsafeMutablePointer<mkcheck2_bpf>, count: Int, ringSize: UInt32) throws {
+    var fds = [bpf_map__fd(obj.pointee.maps.events)]
+    var createdFDs: [Int32] = []
+    let shardsFD = bpf_map__fd(obj.pointee.maps.event_shards)
+    for index in 1..<count {
+      let fd = bpf_map_create(BPF_MAP_TYPE_RINGBUF, nil, 0, 0, ringSize, nil)
+      guard fd >= 0 else {
+        createdFDs.forEach { close($0) }
+        throw Mkcheck2Error(
+          "Failed to create ring buffer shard: \(String(cString: strerror(errno)))")
+      }
+      createdFDs.append(fd)
+      var key = UInt32(index)
+      var value = fd
+      guard bpf_map_update_elem(shardsFD, &key, &value, UInt64(BPF_ANY)) == 0 else {
+        createdFDs.forEach { close($0) }
+        throw Mkcheck2Error(
+          "Failed to register ring buffer shard: \(String(cString: strerror(errno)))")
+      }
+      fds.append(fd)
+    }
+    self.createdFDs = createdFDs
+    readyFD = eventfd(0, Int32(EFD_CLOEXEC | EFD_NONBLOCK))
+    guard readyFD >= 0 else {
+      createdFDs.forEach { close($0) }
+      throw Mkcheck2Error("Failed to create eventfd: \(String(cString: strerror(errno)))")
+    }
+    let seqOffset = MemoryLayout<mkcheck2_bpf__bss>.offset(of: \.next_event_seq)!
+    self.nextSeq = UnsafeMutableRawPointer(obj.pointee.bss).advanced(by: seqOffset)
+      .assumingMemoryBound(to: UInt64.self)
+
+    var shards: [Shard] = []
+    for fd in fds {
+      let shard = Shard()
+      guard
+        let rb = ring_buffer__new(
+          fd,
+          { (ctx, data, size) in
+            let shard = Unmanaged<Shard>.fromOpaque(ctx!).takeUnretainedValue()
+            let bytes = UnsafeRawBufferPointer(start: data, count: size)
+            let seq = bytes.load(
+              fromByteOffset: MemoryLayout<mkcheck2_event_header>.offset(of: \.seq)!,
+              as: UInt64.self)
+            shard.drained.append(Record(seq: seq, bytes: Array(bytes)))
+            return 0
+          },
+          Unmanaged.passUnretained(shard).toOpaque(), nil
+        )
+      else {
+        shards.forEach { ring_buffer__free($0.rb) }
+        createdFDs.forEach { close($0) }
+        close(readyFD)
+        throw Mkcheck2Error("Failed to create ring buffer")
+      }
+      shard.rb = rb
+      shard.ring = ring_buffer__ring(rb, 0)
+      shards.append(shard)
+    }
+    self.shards = shards
+  }
+
+  /// Start a thread draining each shard
+  func start() {
+    running = true
+    for shard in shards {
+      let nextSeq = self.nextSeq
+      let readyFD = self.readyFD
+      let thread = Thread {
+        defer { shard.finished.signal() }
+        while true {
+          shard.lock.lock()
+          while shard.pending.count >= ShardedConsumer.maxPendingRecords && !shard.stopped {
+            shard.lock.wait()
+          }
+          let stopped = shard.stopped
+          shard.lock.unlock()
+
+          if !stopped {
+            // Sleep until the BPF program wakes us up or the timeout expires
+            _ = ring_buffer__poll(shard.rb, 100 /* ms */)
+          }
+          // Drain whatever is in the shard, whether or not it woke us up
+          let bound = nextSeq.pointee
+          // Every record numbered below `bound` was reserved before this
+          let reserved = ring__producer_pos(shard.ring)
+          let consumed = ring_buffer__consume(shard.rb)
+          let complete = ring__consumer_pos(shard.ring) >= reserved
+
+          shard.lock.lock()
+          if consumed < 0 {
+            shard.error = Mkcheck2Error(
+              "Failed to consume ring buffer shard: \(String(cString: strerror(errno)))")
+          }
+          shard.pending.append(contentsOf: shard.drained)
+          if complete {
+            shard.bound = bound
+          }
+          shard.lock.unlock()
+          shard.drained.removeAll(keepingCapacity: true)
+          var one: UInt64 = 1
+          _ = write(readyFD, &one, MemoryLayout<UInt64>.size)
+
+          if stopped || consumed < 0 { return }
+        }
+      }
+      thread.name = "mkcheck2-shard"
+      thread.start()
+    }
+  }
+
+  /// Stop the shard threads after a last drain and wait for them to finish.
+  /// Does nothing if they are not running.
+  func stop() {
+    guard running else { return }
+    running = false
+    for shard in shards {
+      shard.lock.lock()
+      shard.stopped = true
+      shard.lock.broadcast()
+      shard.lock.unlock()
+    }
+    for shard in shards {
+      shard.finished.wait()
+    }
+  }
+
+  /// Release the records that no shard can precede anymore
+  /// - Parameter final: Release all records. Must be called only after `stop()`.
+  /// - Returns: The released records in sequence order
+  func merge(final: Bool) throws -> [Record] {
+    var count: UInt64 = 0
+    _ = read(readyFD, &count, MemoryLayout<UInt64>.size)
+
+    var watermark = UInt64.max
+    var merged: [Record] = []
+    for shard in shards {
+      shard.lock.lock()
+      defer { shard.lock.unlock() }
+      if let error = shard.error {
+        throw error
+      }
+      merged.append(contentsOf: shard.pending)
+      shard.pending.removeAll(keepingCapacity: true)
+      shard.lock.signal()
+      watermark = min(watermark, shard.bound)
+    }
+    if final {
+      watermark = .max
+    }
+
+    reorderBuffer.insert(merged)
+    releasedSeq = max(releasedSeq, watermark)
+    return reorderBuffer.release(below: watermark)
+  }
+
+  deinit {
+    // The threads must not drain freed ring buffers, whatever the owner did
+    stop()
+    shards.forEach { ring_buffer__free($0.rb) }
+    createdFDs.forEach { close($0) }
+    close(readyFD)
+  }
+}
+
+/// Holds the records merged from the shards until they can be released in
+/// sequence order
+struct ReorderBuffer {
+  /// Sorted by sequence number
+  private var records: [ShardedConsumer.Record] = []
+
+  var count: Int { records.count }
+
+  mutating func insert(_ merged: [ShardedConsumer.Record]) {
+    guard !merged.isEmpty else { return }
+    records.append(contentsOf: merged)
+    records.sort { $0.seq < $1.seq }
+  }
+
+  /// Remove the records numbered below the given watermark
+  /// - Returns: The removed records in sequence order
+  mutating func release(below watermark: UInt64) -> [ShardedConsumer.Record] {
+    let ready = records.prefix { $0.seq < watermark }.count
+    let released = Array(records.prefix(ready))
+    records.removeFirst(ready)
+    return released
+  }
+}
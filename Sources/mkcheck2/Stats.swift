@@ -0,0 +1,190 @@
+import Foundation
+import mkcheck2abi
+import mkcheck2bpf_skelton
+
+/// Statistics of the userland consumer, collected with `--stats`
+final class ConsumerStats {
+  /// The number of records handed to `Trace`
+  private(set) var events: UInt64 = 0
+  /// The number of bytes of the records handed to `Trace`
+  private(set) var bytes: UInt64 = 0
+  /// Latencies of `Trace.handleEvent`. Bucket `i` counts latencies in
+  /// [2^(i-1), 2^i) nanoseconds, and bucket 0 counts zero latencies.
+  private(set) var latencyHistogram = [UInt64](repeating: 0, count: UInt64.bitWidth + 1)
+  /// The max number of records handled by a single drain of the ring buffers
+  private(set) var maxBatch = 0
+  /// The max number of records held back to restore the order across shards
+  private(set) var maxReorderDepth = 0
+
+  private let start = DispatchTime.now()
+  private var end: DispatchTime?
+
+  func record(size: Int, nanoseconds: UInt64) {
+    events += 1
+    bytes += UInt64(size)
+    latencyHistogram[UInt64.bitWidth - nanoseconds.leadingZeroBitCount] += 1
+  }
+
+  /// Record the depth of the queues after a drain
+  func sample(batch: Int, reorderDepth: Int) {
+    maxBatch = max(maxBatch, batch)
+    maxReorderDepth = max(maxReorderDepth, reorderDepth)
+  }
+
+  /// Stop the clock
+  func finish() {
+    end = DispatchTime.now()
+  }
+
+  var elapsedSeconds: Double {
+    let end = self.end ?? DispatchTime.now()
+    return Double(end.uptimeNanoseconds - start.uptimeNanoseconds) / 1e9
+  }
+}
+
+/// The statistics printed by `--stats`
+struct StatsReport: Codable {
+  struct Probe: Codable {
+    /// The syscall or kernel function the probe is attached to
+    let name: String
+    /// The syscall number, or a `mkcheck2_probe_id` for the other probes
+    let id: Int
+    let invocations: UInt64
+    let filtered: UInt64
+    let deduped: UInt64
+    let submitted: UInt64
+    let bytes: UInt64
+    let reserveFailures: UInt64
+    let stagingConflicts: UInt64
+  }
+
+  struct LatencyBucket: Codable {
+    /// The exclusive upper bound of the latencies in nanoseconds
+    let belowNanoseconds: UInt64
+    let count: UInt64
+  }
+
+  struct Consumer: Codable {
+    let events: UInt64
+    let bytes: UInt64
+    let elapsedSeconds: Double
+    let eventsPerSecond: Double
+    let maxBatch: Int
+    let maxReorderDepth: Int
+    let handleEventLatency: [LatencyBucket]
+  }
+
+  /// Probes that were hit at least once, most hit first
+  let probes: [Probe]
+  let consumer: Consumer
+
+  init(probes: [Int: mkcheck2_probe_stats], consumer stats: ConsumerStats) {
+    self.probes = probes.filter { $0.value.invocations > 0 }.map { id, stats in
+      Probe(
+        name: StatsReport.probeName(stats, id: id), id: id, invocations: stats.invocations,
+        filtered: stats.filtered, deduped: stats.deduped, submitted: stats.submitted,
+        bytes: stats.bytes, reserveFailures: stats.reserve_failures,
+        stagingConflicts: stats.staging_conflicts)
+    }.sorted { ($0.invocations, $1.id) > ($1.invocations, $0.id) }
+
+    let elapsed = stats.elapsedSeconds
+    self.consumer = Consumer(
+      events: stats.events, bytes: stats.bytes, elapsedSeconds: elapsed,
+      eventsPerSecond: elapsed > 0 ? Double(stats.events) / elapsed : 0,
+      maxBatch: stats.maxBatch, maxReorderDepth: stats.maxReorderDepth,
+      handleEventLatency: stats.latencyHistogram.enumerated().filter { $0.element > 0 }.map {
+        LatencyBucket(
+          belowNanoseconds: $0.offset >= UInt64.bitWidth ? .max : 1 << UInt64($0.offset),
+          count: $0.element)
+      })
+  }
+
+  /// The name the probe wrote into its statistics
+  static func probeName(_ stats: mkcheck2_probe_stats, id: Int) -> String {
+    let name = withUnsafeBytes(of: stats.name) { bytes in
+      String(decoding: bytes.prefix { $0 != 0 }, as: UTF8.self)
+    }
+    return name.isEmpty ? "probe \(id)" : name
+  }
+
+  func render(format: Mkcheck2.StatsFormat) throws -> String {
+    switch format {
+    case .json:
+      let encoder = JSONEncoder()
+      encoder.outputFormatting = [.prettyPrinted, .sortedKeys]
+      return String(decoding: try encoder.encode(self), as: UTF8.self) + "\n"
+    case .text:
+      return renderText()
+    }
+  }
+
+  private func renderText() -> String {
+    let columns = [
+      "probe", "calls", "filtered", "deduped", "submitted", "bytes", "drops", "conflicts",
+    ]
+    let rows = probes.map {
+      [
+        $0.name, "\($0.invocations)", "\($0.filtered)", "\($0.deduped)", "\($0.submitted)",
+        "\($0.bytes)", "\($0.reserveFailures)", "\($0.stagingConflicts)",
+      ]
+    }
+    var output = renderTable([columns] + rows)
+    output += "\n"
+    output += "consumer: \(consumer.events) events, \(consumer.bytes) bytes in "
+    output += "\(String(format: "%.3f", consumer.elapsedSeconds)) s "
+    output += "(\(String(format: "%.0f", consumer.eventsPerSecond)) events/s)\n"
+    output += "max batch: \(consumer.maxBatch) events, "
+    output += "max reorder depth: \(consumer.maxReorderDepth) events\n"
+    output += "handleEvent latency:\n"
+    for bucket in consumer.handleEventLatency {
+      output += "  < \(bucket.belowNanoseconds) ns: \(bucket.count)\n"
+    }
+    return output
+  }
+}
+
+/// Render the given rows as a table with aligned columns. The first column is
+/// left-aligned as it holds the names, and the others are right-aligned.
+func renderTable(_ rows: [[String]]) -> String {
+  guard let first = rows.first else { return "" }
+  let widths = first.indices.map { column in
+    rows.map { $0[column].count }.max()!
+  }
+  var output = ""
+  for row in rows {
+    let cells = row.enumerated().map { column, cell in
+      let padding = String(repeating: " ", count: widths[column] - cell.count)
+      return column == 0 ? cell + padding : padding + cell
+    }
+    output += cells.joined(separator: "  ") + "\n"
+  }
+  return output
+}
+
+extension Tracer {
+  /// Sum up the per-CPU statistics of each probe
+  static func readProbeStats(_ map: OpaquePointer) -> [Int: mkcheck2_probe_stats] {
+    let fd = bpf_map__fd(map)
+    var values = [mkcheck2_probe_stats](
+      repeating: mkcheck2_probe_stats(), count: Int(libbpf_num_possible_cpus()))
+    var result: [Int: mkcheck2_probe_stats] = [:]
+    for id in 0..<Int(MKCHECK2_PROBE_ID_MAX) {
+      var key = UInt32(id)
+      guard bpf_map_lookup_elem(fd, &key, &values) == 0 else { continue }
+      result[id] = values.reduce(into: mkcheck2_probe_stats()) { sum, value in
+        sum.invocations += value.invocations
+        sum.filtered += value.filtered
+        sum.deduped += value.deduped
+        sum.submitted += value.submitted
+        sum.bytes += value.bytes
+        sum.reserve_failures += value.reserve_failures
+        sum.staging_conflicts += value.staging_conflicts
+        // Only written on the CPUs the probe was hit on
+        if sum.name.0 == 0 {
+          sum.name = value.name
+        }
+      }
+    }
+    return result
+  }
+}
@@ -0,0 +1,123 @@
+import Foundation
+import SystemPackage
+
+/// Memoizes which paths are symbolic links, for `Trace.Process.normalize`
+///
+/// ## Discussion
+/// Paths read from syscall arguments are normalized on the consumer thread,
+/// and asking the file system about each of them costs a readlink per event.
+/// The answers are cached per directory instead. The symlinks, renames and
+/// removals observed in the trace update the cache, so that a cached answer
+/// does not go stale as the build changes the tree. A miss still asks the file
+/// system when the event is consumed, which may be after the build changed the
+/// path again, so the answer is the one at that time rather than the one when
+/// the event happened.
+///
+/// The cache holds up to `maxDirectories` directories and is emptied when full.
+///
+/// Paths announced by the kernel are walked from dentries and are resolved by
+/// `resolve` like the paths of the same events sent inline, so that a file is
+/// named the same whether or not its path was announced.
+final class SymlinkCache {
+  private enum Entry {
+    case link(FilePath)
+    case notLink
+  }
+
+  /// Max number of cached directories
+  static let maxDirectories = 65536
+
+  /// Entries by normalized directory and name
+  private var directories: [FilePath: [FilePath.Component: Entry]] = [:]
+  /// The number of cached directories strictly below each directory, so that
+  /// renames only scan the cache when they move a directory it knows about
+  private var descendants: [FilePath: Int] = [:]
+
+  /// Returns the destination of the symlink at the given normalized path as
+  /// stored in the link, or nil if it is not a symlink
+  func destination(of path: FilePath) -> FilePath? {
+    guard let name = path.lastComponent else { return nil }
+    let directory = path.removingLastComponent()
+    if let entry = directories[directory]?[name] {
+      guard case .link(let destination) = entry else { return nil }
+      return destination
+    }
+    let destination = SymlinkCache.readLink(path)
+    insert(destination.map { .link($0) } ?? .notLink, name: name, in: directory)
+    return destination
+  }
+
+  /// Resolve the last component of the given normalized path if it is a
+  /// symlink
+  func resolve(_ path: FilePath) -> FilePath {
+    guard let resolved = destination(of: path) else {
+      return path
+    }
+    return path.removingLastComponent().pushing(resolved).lexicallyNormalized()
+  }
+
+  /// Record a symlink created by a traced process
+  func symlinkCreated(at path: FilePath, destination: FilePath) {
+    guard let name = path.lastComponent else { return }
+    insert(.link(destination), name: name, in: path.removingLastComponent())
+  }
+
+  /// Forget what is known about the given path, e.g. when it is removed or
+  /// replaced by a hard link
+  func invalidate(_ path: FilePath) {
+    guard let name = path.lastComponent else { return }
+    directories[path.removingLastComponent()]?[name] = nil
+    // A removed directory is empty, so only its own entries are stale
+    removeDirectory(path)
+  }
+
+  /// Move what is known about the source to the destination of a rename
+  func renamed(from source: FilePath, to dest: FilePath) {
+    guard let sourceName = source.lastComponent, let destName = dest.lastComponent else { return }
+    let entry = directories[source.removingLastComponent()]?.removeValue(forKey: sourceName)
+    if let entry {
+      insert(entry, name: destName, in: dest.removingLastComponent())
+    } else {
+      directories[dest.removingLastComponent()]?[destName] = nil
+    }
+    // A renamed directory moves its whole subtree. Forget it and look it up
+    // again at its new place.
+    for root in [source, dest] where directories[root] != nil || descendants[root] != nil {
+      for directory in directories.keys where directory.starts(with: root) {
+        removeDirectory(directory)
+      }
+    }
+  }
+
+  private func insert(_ entry: Entry, name: FilePath.Component, in directory: FilePath) {
+    if directories[directory] == nil {
+      if directories.count >= SymlinkCache.maxDirectories {
+        directories.removeAll()
+        descendants.removeAll()
+      }
+      var ancestor = directory
+      while ancestor.removeLastComponent() {
+        descendants[ancestor, default: 0] += 1
+      }
+    }
+    directories[directory, default: [:]][name] = entry
+  }
+
+  private func removeDirectory(_ directory: FilePath) {
+    guard directories.removeValue(forKey: directory) != nil else { return }
+    var ancestor = directory
+    while ancestor.removeLastComponent() {
+      let count = (descendants[ancestor] ?? 1) - 1
+      descendants[ancestor] = count > 0 ? count : nil
+    }
+  }
+
+  private static func readLink(_ path: FilePath) -> FilePath? {
+    var buffer = [CChar](repeating: 0, count: Int(PATH_MAX) + 1)
+    let capacity = buffer.count - 1
+    let length = path.withPlatformString { readlink($0, &buffer, capacity) }
+    guard length >= 0 else { return nil }
+    buffer[length] = 0
+    return FilePath(platformString: buffer)
+  }
+}
@@ -0,0 +1,115 @@
+import ArgumentParser
+import Foundation
+
+extension Mkcheck2 {
+  struct Top: ParsableCommand {
+    static let configuration = CommandConfiguration(
+      abstract: "Rank the processes and images of a trace by their resource usage")
+
+    enum SortKey: String, ExpressibleByArgument, CaseIterable {
+      case cpu
+      case memory
+    }
+
+    @Argument(help: "The trace file in JSON or binary format")
+    var trace: String
+
+    @Option(help: "The resource to rank by")
+    var by: SortKey = .cpu
+
+    @Option(help: "The number of processes and images to list")
+    var limit: Int = 20
+
+    func run() throws {
+      let format = try DumpFormat.load(from: trace)
+      let report = UsageReport(format, by: by)
+      guard !report.processes.isEmpty else {
+        throw Mkcheck2Error("No process in the trace has resource usage")
+      }
+      print(report.render(limit: limit), terminator: "")
+    }
+  }
+}
+
+/// The resource usage of a trace, per process and per image
+///
+/// The usage of a process does not include the one of its children, so make
+/// or a shell are ranked by the work they did themselves.
+struct UsageReport {
+  struct Entry {
+    let image: String
+    /// The process instance id, or the number of processes for an image
+    var key: UInt64
+    var usage: ResourceUsage
+  }
+
+  /// Processes that exited, most expensive first
+  private(set) var processes: [Entry] = []
+  /// The usage summed up by image, except for `maxRSS` which is the max over
+  /// the processes, most expensive first
+  private(set) var images: [Entry] = []
+
+  init(_ trace: DumpFormat, by key: Mkcheck2.Top.SortKey) {
+    let names = Dictionary(uniqueKeysWithValues: trace.files.map { ($0.id, $0.name.string) })
+    var byImage: [String: Entry] = [:]
+    for proc in trace.procs {
+      guard let usage = proc.usage else { continue }
+      let image = names[proc.image] ?? "unknown"
+      processes.append(Entry(image: image, key: proc.uid, usage: usage))
+      if byImage[image] != nil {
+        byImage[image]!.key += 1
+        byImage[image]!.usage.add(usage)
+      } else {
+        byImage[image] = Entry(image: image, key: 1, usage: usage)
+      }
+    }
+
+    let rank: (Entry) -> UInt64 = key == .cpu ? { $0.usage.cpuTime } : { $0.usage.maxRSS }
+    let order = { (lhs: Entry, rhs: Entry) in
+      (rank(lhs), rhs.image, rhs.key) > (rank(rhs), lhs.image, lhs.key)
+    }
+    processes.sort(by: order)
+    images = byImage.values.sorted(by: order)
+  }
+
+  func render(limit: Int) -> String {
+    func seconds(_ nanoseconds: UInt64) -> String {
+      String(format: "%.3f", Double(nanoseconds) / 1e9)
+    }
+    func mebibytes(_ bytes: UInt64) -> String {
+      String(format: "%.1f", Double(bytes) / Double(1 << 20))
+    }
+    func cells(_ usage: ResourceUsage) -> [String] {
+      [
+        seconds(usage.cpuTime), seconds(usage.userTime), seconds(usage.systemTime),
+        mebibytes(usage.maxRSS),
+        "\(usage.voluntaryContextSwitches)", "\(usage.involuntaryContextSwitches)",
+        mebibytes(usage.readBytes), mebibytes(usage.writeBytes),
+      ]
+    }
+    let columns = ["cpu s", "user s", "sys s", "rss MiB", "vcsw", "ivcsw", "read MiB", "write MiB"]
+
+    var output = "processes:\n"
+    output += renderTable(
+      [["image", "uid"] + columns]
+        + processes.prefix(limit).map { [$0.image, "\($0.key)"] + cells($0.usage) })
+    output += "\nimages:\n"
+    output += renderTable(
+      [["image", "procs"] + columns]
+        + images.prefix(limit).map { [$0.image, "\($0.key)"] + cells($0.usage) })
+    return output
+  }
+}
+
+extension ResourceUsage {
+  /// Accumulate the usage of another process
+  fileprivate mutating func add(_ other: ResourceUsage) {
+    userTime += other.userTime
+    systemTime += other.systemTime
+    maxRSS = max(maxRSS, other.maxRSS)
+    voluntaryContextSwitches += other.voluntaryContextSwitches
+    involuntaryContextSwitches += other.involuntaryContextSwitches
+    readBytes += other.readBytes
+    writeBytes += other.writeBytes
+  }
+}
@@ -0,0 +1,194 @@
+import Foundation
+
+/// A buffered text stream to a file descriptor
+///
+/// Traces are written while they are walked, so that the whole output never
+/// sits in memory. `TextOutputStream.write` cannot throw, so the first error
+/// is kept and thrown by `close()`.
+final class FileOutputStream: TextOutputStream {
+  private let fd: Int32
+  private var buffer: [UInt8] = []
+  private var error: Error?
+  private var closed = false
+  /// The size the buffer is flushed at
+  private let capacity: Int
+  /// The number of bytes written so far, including the buffered ones
+  private(set) var position = 0
+
+  /// Create or truncate the file at the given path
+  init(path: String, bufferSize: Int = 1 << 16) throws {
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0o644)
+    guard fd >= 0 else {
+      throw Mkcheck2Error("Failed to open \(path): \(String(cString: strerror(errno)))")
+    }
+    capacity = bufferSize
+    buffer.reserveCapacity(bufferSize)
+  }
+
+  func write(_ string: String) {
+    write(bytes: string.utf8)
+  }
+
+  func write(bytes: some Sequence<UInt8>) {
+    let count = buffer.count
+    buffer.append(contentsOf: bytes)
+    position += buffer.count - count
+    if buffer.count >= capacity {
+      flush()
+    }
+  }
+
+  func write<Value: FixedWidthInteger>(littleEndian value: Value) {
+    withUnsafeBytes(of: value.littleEndian) { write(bytes: $0) }
+  }
+
+  private func flush() {
+    guard error == nil else {
+      buffer.removeAll(keepingCapacity: true)
+      return
+    }
+    var offset = 0
+    while offset < buffer.count {
+      let written = buffer[offset...].withUnsafeBytes {
+        Glibc.write(fd, $0.baseAddress, $0.count)
+      }
+      if written < 0 {
+        if errno == EINTR { continue }
+        error = Mkcheck2Error("Failed to write the trace: \(String(cString: strerror(errno)))")
+        break
+      }
+      offset += written
+    }
+    buffer.removeAll(keepingCapacity: true)
+  }
+
+  /// Write out what is buffered and close the file
+  func close() throws {
+    flush()
+    Glibc.close(fd)
+    closed = true
+    if let error {
+      throw error
+    }
+  }
+
+  deinit {
+    if !closed {
+      try? close()
+    }
+  }
+}
+
+/// Writes JSON values one by one, in the layout of `JSONEncoder` with sorted
+/// keys and unescaped slashes, or on a single line if not pretty
+struct JSONStreamWriter<Output: TextOutputStream> {
+  private(set) var output: Output
+  let pretty: Bool
+  /// Whether each open container has an element already, innermost last
+  private var hasElements: [Bool] = []
+  /// Whether a key was just written, so that the next value is its value
+  private var afterKey = false
+
+  init(output: Output, pretty: Bool) {
+    self.output = output
+    self.pretty = pretty
+  }
+
+  mutating func beginObject() { begin("{") }
+  mutating func endObject() { end("}") }
+  mutating func beginArray() { begin("[") }
+  mutating func endArray() { end("]") }
+
+  /// Start a member of the current object. Keys must be given in sorted order.
+  mutating func key(_ key: String) {
+    separate()
+    writeString(key)
+    output.write(pretty ? " : " : ":")
+    afterKey = true
+  }
+
+  mutating func value(_ value: String) {
+    separateValue()
+    writeString(value)
+  }
+
+  mutating func value(_ value: some BinaryInteger) {
+    separateValue()
+    output.write(String(value))
+  }
+
+  mutating func value(_ value: Bool) {
+    separateValue()
+    output.write(value ? "true" : "false")
+  }
+
+  /// Write the given integers as an array
+  mutating func value<Values: Sequence>(_ values: Values) where Values.Element: BinaryInteger {
+    beginArray()
+    for value in values {
+      self.value(value)
+    }
+    endArray()
+  }
+
+  /// End the document and return the output
+  mutating func finish() -> Output {
+    output.write("\n")
+    return output
+  }
+
+  private mutating func begin(_ bracket: String) {
+    separateValue()
+    output.write(bracket)
+    hasElements.append(false)
+  }
+
+  private mutating func end(_ bracket: String) {
+    if hasElements.removeLast() && pretty {
+      newline()
+    }
+    output.write(bracket)
+  }
+
+  private mutating func separateValue() {
+    if afterKey {
+      afterKey = false
+    } else {
+      separate()
+    }
+  }
+
+  /// Write the separator before an element of the current container
+  private mutating func separate() {
+    guard let last = hasElements.indices.last else { return }
+    if hasElements[last] {
+      output.write(",")
+    }
+    hasElements[last] = true
+    if pretty {
+      newline()
+    }
+  }
+
+  private mutating func newline() {
+    output.write("\n" + String(repeating: "  ", count: hasElements.count))
+  }
+
+  private mutating func writeString(_ string: String) {
+    var escaped = "\""
+    for scalar in string.unicodeScalars {
+      switch scalar {
+      case "\"": escaped += "\\\""
+      case "\\": escaped += "\\\\"
+      case "\n": escaped += "\\n"
+      case "\r": escaped += "\\r"
+      case "\t": escaped += "\\t"
+      case _ where scalar.value < 0x20:
+        escaped += String(format: "\\u%04x", scalar.value)
+      default: escaped.unicodeScalars.append(scalar)
+      }
+    }
+    escaped += "\""
+    output.write(escaped)
+  }
+}
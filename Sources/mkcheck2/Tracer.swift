@@ -5,40 +5,140 @@ import mkcheck2abi
 import mkcheck2bpf_skelton
 import mkcheck2syslinux
 
+/// Consumes the records of a loaded BPF object and hands them to the trace of
+/// the session they belong to
+///
+/// ## Discussion
+/// The BPF program tags each record with the session of its process, so that
+/// a single loaded object can trace several commands at once. The standalone
+/// commands run a single session, while the daemon runs one per client.
+///
+/// Records go through three stages. The shard threads of `ShardedConsumer`
+/// copy them out of the ring buffers, the records released in order are
+/// decoded in parallel, and the tracing thread applies them to their traces
+/// one by one.
 class Tracer {
-  let rb: OpaquePointer
+  /// The consumer of the ring buffer shards
+  let shards: ShardedConsumer
   /// struct bpf_map* for fatal errors
   let fatalErrors: OpaquePointer
+  /// struct bpf_map* for per-CPU counts of non-fatal errors
+  let errorCounts: OpaquePointer
+  let counters: OpaquePointer
   let obj: UnsafeMutablePointer<mkcheck2_bpf>
-  let trace: Trace
+  /// Whether the BPF object is destroyed together with the tracer. The daemon
+  /// keeps it loaded across sessions.
+  let ownsObject: Bool
+  /// Statistics of the consumer, or nil if not collected
+  let stats: ConsumerStats?
+  /// Applied by the traces of the sessions to the paths read from user space
+  let pathFilter: PathFilter?
+  /// The `next_event_seq` variable of the BPF program
+  private let nextSeq: UnsafeMutablePointer<UInt64>
+  /// Every record below this sequence number has been handed to its session
+  private var releasedSeq: UInt64 = 0
+  private let poller: Poller
+  private let sink: RecordSink
+
+  /// The sessions being traced, keyed by session id. Protected by `lock`.
+  private var sessions: [UInt32: TraceSession] = [:]
+  /// The epoch of each session id. Protected by `lock`.
+  private var sessionEpochs = [UInt32](repeating: 0, count: Int(MKCHECK2_SESSIONS_MAX))
+  /// The session id to try first, so that ids are reused as late as possible.
+  /// Protected by `lock`.
+  private var nextSessionID: UInt32 = 1
+  private let lock = NSLock()
+
+  /// Hands records to the trace of their session, timing them if statistics
+  /// are collected
+  private final class RecordSink {
+    let stats: ConsumerStats?
+    /// Looks up the session of a record
+    var session: (UInt32) -> TraceSession? = { _ in nil }
+
+    init(stats: ConsumerStats?) {
+      self.stats = stats
+    }
 
-  init(root: pid_t, obj: UnsafeMutablePointer<mkcheck2_bpf>) throws {
-    self.obj = obj
-    let trace = Trace(root: root)
-    let context = Unmanaged.passRetained(trace)
-    self.trace = trace
+    func handle(_ event: DecodedEvent, size: Int) {
+      // Records of processes that outlived their session, which may have been
+      // reused by another session since
+      guard let session = session(event.header.session), session.epoch == event.header.epoch
+      else { return }
+      var event = event
+      event.clearSession()
+      guard let stats else {
+        Tracer.handleEvent(session.trace, event)
+        return
+      }
+      let start = DispatchTime.now().uptimeNanoseconds
+      Tracer.handleEvent(session.trace, event)
+      stats.record(size: size, nanoseconds: DispatchTime.now().uptimeNanoseconds - start)
+    }
 
-    guard
-      let rb = ring_buffer__new(
-        bpf_map__fd(obj.pointee.maps.events),
-        { (ctx, data, size) in
-          let event = data!.bindMemory(to: mkcheck2_event_header.self, capacity: 1)
-          let context = Unmanaged<Trace>.fromOpaque(ctx!)
-          do {
-            try context.takeUnretainedValue().handleEvent(event)
-          } catch {
-            logger.error("Error: \(error)")
-            exit(1)
-          }
-          return 0
-        },
-        context.toOpaque(), nil
-      )
-    else {
-      throw Mkcheck2Error("Failed to create ring buffer")
+    /// Append the record to the recording of its session, if the session
+    /// records its events
+    /// - Returns: false if the record is to be decoded and handled instead
+    func record(_ record: ShardedConsumer.Record) -> Bool {
+      let bytes = record.bytes
+      guard bytes.count >= MemoryLayout<mkcheck2_event_header>.size else { return false }
+      let header = bytes.withUnsafeBytes { $0.loadUnaligned(as: mkcheck2_event_header.self) }
+      guard let session = session(header.session), session.epoch == header.epoch,
+        let recorder = session.recorder
+      else {
+        return false
+      }
+      let start = stats == nil ? 0 : DispatchTime.now().uptimeNanoseconds
+      recorder.append(bytes)
+      // The session ends with its root, so its exit is the one event looked at
+      if header._type == mkcheck2_event_type.eventTypeExit.rawValue
+        && header.pid == session.trace.root
+        && bytes.count >= MemoryLayout<mkcheck2_exit_event>.size
+      {
+        let offset = MemoryLayout<mkcheck2_exit_event>.offset(of: \.payload)!
+        let exitCode = bytes.withUnsafeBytes {
+          $0.loadUnaligned(fromByteOffset: offset, as: Int32.self)
+        }
+        session.trace.rootExited(exitCode: exitCode)
+      }
+      stats?.record(size: bytes.count, nanoseconds: DispatchTime.now().uptimeNanoseconds - start)
+      return true
     }
+  }
+
+  init(
+    obj: UnsafeMutablePointer<mkcheck2_bpf>, ringShards: Int, ringSize: UInt32, stats: Bool,
+    pathFilter: PathFilter? = nil, ownsObject: Bool = true
+  ) throws {
+    self.obj = obj
+    self.ownsObject = ownsObject
+    self.pathFilter = pathFilter
+    self.stats = stats ? ConsumerStats() : nil
+    let sink = RecordSink(stats: self.stats)
+    self.sink = sink
+    let seqOffset = MemoryLayout<mkcheck2_bpf__bss>.offset(of: \.next_event_seq)!
+    self.nextSeq = UnsafeMutableRawPointer(obj.pointee.bss).advanced(by: seqOffset)
+      .assumingMemoryBound(to: UInt64.self)
+
+    self.shards = try ShardedConsumer(obj: obj, count: ringShards, ringSize: ringSize)
+    self.poller = try Poller(readyFD: shards.readyFD)
     self.fatalErrors = obj.pointee.maps.fatal_errors
-    self.rb = rb
+    self.errorCounts = obj.pointee.maps.error_counts
+    self.counters = obj.pointee.maps.counters
+    sink.session = { [unowned self] id in
+      lock.lock()
+      defer { lock.unlock() }
+      return sessions[id]
+    }
+  }
+
+  static func handleEvent(_ trace: Trace, _ event: DecodedEvent) {
+    do {
+      try trace.handleEvent(event)
+    } catch {
+      logger.error("Error: \(error)")
+      exit(1)
+    }
   }
 
   private func checkFatalErrors() throws {
@@ -52,61 +152,421 @@ class Tracer {
     }
   }
 
-  func run(options: Mkcheck2.TraceOptions) throws {
+  /// Sum up the per-CPU values of the given BPF_MAP_TYPE_PERCPU_ARRAY map of u64 counters
+  static func readPerCPUCounters(_ map: OpaquePointer, count: Int) -> [UInt64] {
+    let fd = bpf_map__fd(map)
+    var values = [UInt64](repeating: 0, count: Int(libbpf_num_possible_cpus()))
+    return (0..<count).map { index in
+      var key = UInt32(index)
+      guard bpf_map_lookup_elem(fd, &key, &values) == 0 else { return 0 }
+      return values.reduce(0, +)
+    }
+  }
+
+  /// The total number of events dropped by non-fatal errors so far
+  private func droppedEventCount() -> UInt64 {
+    Tracer.readPerCPUCounters(errorCounts, count: Int(MKCHECK2_ERROR_TYPE_MAX)).reduce(0, +)
+  }
+
+  /// Log the non-fatal errors reported by the BPF program
+  private func reportErrorCounts() {
+    let counts = Tracer.readPerCPUCounters(errorCounts, count: Int(MKCHECK2_ERROR_TYPE_MAX))
+    for (type, count) in counts.enumerated() where count > 0 {
+      let description = mkcheck2_error_type(rawValue: Int32(type))?.description ?? "Unknown error"
+      logger.warning("\(description): \(count) events dropped")
+    }
+  }
+
+  private func reportCounters() {
+    let counts = Tracer.readPerCPUCounters(counters, count: Int(MKCHECK2_COUNTER_TYPE_MAX))
+    let hits = counts[Int(mkcheck2_counter_type.counterDedupeHit.rawValue)]
+    let misses = counts[Int(mkcheck2_counter_type.counterDedupeMiss.rawValue)]
+    logger.info("Dedupe: \(hits) hits, \(misses) misses")
+  }
+
+  /// Print the statistics of the probes and of the consumer to stderr
+  func reportStats(format: Mkcheck2.StatsFormat) throws {
+    guard let stats else { return }
+    stats.finish()
+    let report = StatsReport(
+      probes: Tracer.readProbeStats(obj.pointee.maps.probe_stats), consumer: stats)
+    FileHandle.standardError.write(Data(try report.render(format: format).utf8))
+  }
+
+  /// Waits for drained records and for the exit of the root processes at once
+  private struct Poller {
+    let epollFD: Int32
+
+    init(readyFD: Int32) throws {
+      epollFD = epoll_create1(Int32(EPOLL_CLOEXEC))
+      guard epollFD >= 0 else {
+        throw Mkcheck2Error("Failed to create epoll: \(String(cString: strerror(errno)))")
+      }
+      do {
+        try add(readyFD)
+      } catch {
+        close()
+        throw error
+      }
+    }
+
+    func add(_ fd: Int32) throws {
+      var event = epoll_event(events: EPOLLIN.rawValue, data: epoll_data_t(fd: fd))
+      guard epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &event) == 0 else {
+        throw Mkcheck2Error("Failed to add fd to epoll: \(String(cString: strerror(errno)))")
+      }
+    }
+
+    func remove(_ fd: Int32) {
+      epoll_ctl(epollFD, EPOLL_CTL_DEL, fd, nil)
+    }
+
+    func wait(timeout: Int32) throws {
+      var events = [epoll_event](repeating: epoll_event(), count: 2)
+      let count = epoll_wait(epollFD, &events, Int32(events.count), timeout)
+      guard count >= 0 || errno == EINTR else {
+        throw Mkcheck2Error("Failed to wait for events: \(String(cString: strerror(errno)))")
+      }
+    }
+
+    func close() {
+      Glibc.close(epollFD)
+    }
+  }
+
+  /// Start tracing the given root process and its descendants in a new session
+  /// - Parameters:
+  ///   - selfPid: The real parent of the root, which is not part of the trace
+  ///   - cgroup: The cgroup the root was moved into, in cgroup mode
+  func begin(
+    root: pid_t, selfPid: pid_t = getpid(), cgroup: TracingCgroup? = nil
+  ) throws -> TraceSession {
+    lock.lock()
+    defer { lock.unlock() }
+    // Session ids are 1..<MKCHECK2_SESSIONS_MAX
+    let count = UInt32(MKCHECK2_SESSIONS_MAX) - 1
+    let candidates = (0..<count).map { ($0 + nextSessionID - 1) % count + 1 }
+    guard let id = candidates.first(where: { sessions[$0] == nil }) else {
+      throw Mkcheck2Error("Too many concurrent trace sessions")
+    }
+    nextSessionID = id % count + 1
+    sessionEpochs[Int(id)] &+= 1
+
+    let session = try TraceSession(
+      id: id, epoch: sessionEpochs[Int(id)], trace: Trace(root: root, selfPid: selfPid),
+      droppedAtStart: droppedEventCount())
+    session.trace.pathFilter = pathFilter
+    session.cgroup = cgroup
+    var key = id
+    var info = mkcheck2_session(root: root, epoch: sessionEpochs[Int(id)], next_file_id: 1)
+    let sessionsFD = bpf_map__fd(obj.pointee.maps.sessions)
+    guard bpf_map_update_elem(sessionsFD, &key, &info, UInt64(BPF_ANY)) == 0 else {
+      throw Mkcheck2Error("Failed to register session: \(String(cString: strerror(errno)))")
+    }
+    if let cgroup {
+      var cgroupID = cgroup.id
+      let fd = bpf_map__fd(obj.pointee.maps.session_cgroups)
+      guard bpf_map_update_elem(fd, &cgroupID, &key, UInt64(BPF_ANY)) == 0 else {
+        throw Mkcheck2Error("Failed to register cgroup: \(String(cString: strerror(errno)))")
+      }
+    }
+    try poller.add(session.pidFD)
+    sessions[id] = session
+    // The exec of the root starts the trace
+    var rootKey = root
+    let rootsFD = bpf_map__fd(obj.pointee.maps.session_roots)
+    guard bpf_map_update_elem(rootsFD, &rootKey, &key, UInt64(BPF_ANY)) == 0 else {
+      sessions[id] = nil
+      poller.remove(session.pidFD)
+      throw Mkcheck2Error("Failed to register root: \(String(cString: strerror(errno)))")
+    }
+    return session
+  }
+
+  /// Stop tracing the processes of the given session and hand it back to its owner
+  private func complete(_ session: TraceSession) {
+    lock.lock()
+    sessions[session.id] = nil
+    lock.unlock()
+    poller.remove(session.pidFD)
+
+    var rootKey = session.trace.root
+    bpf_map_delete_elem(bpf_map__fd(obj.pointee.maps.session_roots), &rootKey)
+    if let cgroup = session.cgroup {
+      var cgroupID = cgroup.id
+      bpf_map_delete_elem(bpf_map__fd(obj.pointee.maps.session_cgroups), &cgroupID)
+    }
+    forgetProcesses(of: session.id)
+
+    let trace = session.trace
+    // Counted across all sessions running in the meantime
+    trace.droppedEvents = droppedEventCount() - session.droppedAtStart
+    if trace.droppedEvents > 0 {
+      logger.warning("The trace is incomplete: \(trace.droppedEvents) events dropped")
+    }
+    if trace.rootExitCode == nil {
+      // The exit event was dropped. Fall back to the wait status if the root is our child.
+      var status: Int32 = 0
+      if waitpid(trace.root, &status, WNOHANG) == trace.root && swift_WIFEXITED(status) {
+        trace.rootExited(exitCode: swift_WEXITSTATUS(status))
+      } else {
+        // Left unknown rather than taken for a success
+        logger.error("Exit status of the root process is unknown")
+      }
+    }
+    session.isComplete = true
+    session.completion.signal()
+  }
+
+  /// Remove the processes of the given session that outlived its root from
+  /// the process table, so that they are not traced into a later session
+  /// reusing the id
+  private func forgetProcesses(of session: UInt32) {
+    let fd = bpf_map__fd(obj.pointee.maps.tracing_pinfo)
+    var pids: [pid_t] = []
+    var key: pid_t = 0
+    var hasKey = bpf_map_get_next_key(fd, nil, &key) == 0
+    while hasKey {
+      var info = mkcheck2_process_info()
+      if bpf_map_lookup_elem(fd, &key, &info) == 0 && info.session == session {
+        pids.append(key)
+      }
+      var current = key
+      hasKey = bpf_map_get_next_key(fd, &current, &key) == 0
+    }
+    for var pid in pids {
+      bpf_map_delete_elem(fd, &pid)
+    }
+  }
+
+  /// Hand the events drained so far to their sessions
+  private func consume() throws {
+    let records = try shards.merge(final: false)
+    // Records of recording sessions are written out as they are
+    let handled = records.filter { !sink.record($0) }
+    for (record, event) in zip(handled, DecodedEvent.decode(handled)) {
+      switch event {
+      case .success(let event):
+        sink.handle(event, size: record.bytes.count)
+      case .failure(let error):
+        logger.error("Error: \(error)")
+        exit(1)
+      }
+    }
+    releasedSeq = shards.releasedSeq
+    stats?.sample(batch: records.count, reorderDepth: shards.reorderDepth)
+  }
+
+  /// Complete the sessions whose records have all been handed to them
+  /// - Returns: true if a session is waiting for its last records
+  private func checkSessions() -> Bool {
+    lock.lock()
+    let active = Array(sessions.values)
+    lock.unlock()
+
+    var ending = false
+    for session in active {
+      if session.endSeq == nil && (session.trace.rootExitCode != nil || session.rootExited) {
+        // The records of the root's exit were submitted before the pidfd
+        // became readable, so they are below the next sequence number
+        session.endSeq = nextSeq.pointee
+        poller.remove(session.pidFD)
+      }
+      guard let endSeq = session.endSeq else { continue }
+      if releasedSeq >= endSeq {
+        complete(session)
+      } else {
+        ending = true
+      }
+    }
+    return ending
+  }
+
+  /// Consume events and complete sessions until `done` returns true
+  func pump(until done: () -> Bool) throws {
     logger.info("STATE PID FNAME")
     logger.info("Tracing...")
-    while trace.rootExitCode == nil {
-      logger.info("Polling...")
-      guard ring_buffer__poll(rb, 100 /* ms */) >= 0 else {
-        if errno == EINTR {
-          continue
-        }
-        let message = "Failed to poll ring buffer: \(String(cString: strerror(errno)))"
-        throw Mkcheck2Error(message)
-      }
+    shards.start()
+    defer { shards.stop() }
+    var ending = false
+    while !done() {
+      // The shard threads wake us up after each drain, which happens at least
+      // every 100 ms, so the timeout only bounds how late fatal errors are seen
+      let timeout: Int32 = ending ? 10 : 1000
+      try poller.wait(timeout: timeout /* ms */)
+      try consume()
       try checkFatalErrors()
+      ending = checkSessions()
+    }
+  }
+
+  /// Consume events until the given session completes
+  /// - Returns: The exit code of the root process, or nil if it is unknown
+  func collect(_ session: TraceSession, statsFormat: Mkcheck2.StatsFormat) throws -> Int32? {
+    try pump { session.isComplete }
+    reportErrorCounts()
+    reportCounters()
+    try reportStats(format: statsFormat)
+    return session.trace.rootExitCode
+  }
+
+  func run(_ session: TraceSession, options: Mkcheck2.TraceOptions) throws {
+    let rootExitCode = try collect(session, statsFormat: options.statsFormat)
+    // A recording is kept even if the command failed, so that it can be analyzed
+    if let recorder = session.recorder {
+      try recorder.finish(
+        exitCode: rootExitCode, droppedEvents: session.trace.droppedEvents)
+      print("Events recorded to \(recorder.path)")
+    }
+    guard let rootExitCode else {
+      throw Mkcheck2Error("The exit status of the traced command is unknown")
     }
-    try checkFatalErrors()
-    let consumed = ring_buffer__consume(rb)
-    logger.info("Done consuming \(consumed) events")
-    let rootExitCode = trace.rootExitCode!
     guard rootExitCode == 0 else { throw ExitCode(rootExitCode) }
 
-    if let outputPath = options.output {
-      var output = ""
-      switch options.format {
-      case .json:
-        trace.dump(output: &output)
-      case .dot:
-        trace.dumpDot(output: &output)
-      case .ascii:
-        trace.dumpAscii(output: &output)
-      case .none: return
-      }
-      try output.write(toFile: outputPath, atomically: false, encoding: .utf8)
+    if let outputPath = options.output,
+      try session.trace.write(format: options.format, compact: options.compact, toFile: outputPath)
+    {
       print("Trace written to \(outputPath)")
     }
   }
 
   deinit {
-    ring_buffer__free(rb)
-    // FIXME: Destroying BPF links is slow (takes 1-2 seconds)
-    mkcheck2_bpf__destroy(obj)
+    poller.close()
+    if ownsObject {
+      // FIXME: Destroying BPF links is slow (takes 1-2 seconds)
+      mkcheck2_bpf__destroy(obj)
+    }
+  }
+}
+
+/// A root process traced by a `Tracer`, and the trace of its descendants
+final class TraceSession {
+  let id: UInt32
+  /// The epoch of the session id when the session began, which records of the session carry
+  let epoch: UInt32
+  let trace: Trace
+  /// The cgroup the processes of the session run in, removed together with the session
+  var cgroup: TracingCgroup?
+  /// Where the raw records of the session are appended, instead of handling
+  /// them, in record mode
+  var recorder: EventRecorder?
+  /// A pidfd of the root process
+  let pidFD: Int32
+  /// The number of events dropped across all sessions when the session began
+  let droppedAtStart: UInt64
+  /// The next sequence number to be assigned once the root exited. The
+  /// session completes once every record below it has been handled.
+  var endSeq: UInt64?
+  /// Signaled by the tracer once the session completes
+  let completion = DispatchSemaphore(value: 0)
+  /// Set by the tracer once the session completes
+  fileprivate(set) var isComplete = false
+
+  init(id: UInt32, epoch: UInt32, trace: Trace, droppedAtStart: UInt64) throws {
+    self.id = id
+    self.epoch = epoch
+    self.trace = trace
+    self.droppedAtStart = droppedAtStart
+    pidFD = swift_pidfd_open(trace.root, 0)
+    guard pidFD >= 0 else {
+      throw Mkcheck2Error("Failed to open pidfd: \(String(cString: strerror(errno)))")
+    }
+  }
+
+  /// Whether the pidfd of the root reports its exit
+  var rootExited: Bool {
+    var fd = pollfd(fd: pidFD, events: Int16(POLLIN), revents: 0)
+    return poll(&fd, 1, 0) > 0
+  }
+
+  deinit {
+    close(pidFD)
+  }
+}
+
+extension Trace {
+  /// Write the trace in the given format while walking it
+  /// - Parameter compact: Write JSON on a single line
+  func write(
+    format: Mkcheck2.OutputFormat, compact: Bool = false, to output: inout some TextOutputStream
+  ) {
+    switch format {
+    case .json:
+      dump(output: &output, pretty: !compact)
+    case .dot:
+      dumpDot(output: &output)
+    case .ascii:
+      dumpAscii(output: &output)
+    case .none: break
+    }
+  }
+
+  /// Write the trace in the given format to a file
+  /// - Returns: false if the format is `.none` and nothing was written
+  func write(format: Mkcheck2.OutputFormat, compact: Bool = false, toFile path: String) throws
+    -> Bool
+  {
+    guard format != .none else { return false }
+    var output = try FileOutputStream(path: path)
+    write(format: format, compact: compact, to: &output)
+    try output.close()
+    return true
+  }
+
+  /// Render the trace in the given format
+  /// - Returns: The rendered trace, or nil if the format is `.none`
+  func render(format: Mkcheck2.OutputFormat, compact: Bool = false) -> String? {
+    guard format != .none else { return nil }
+    var output = ""
+    write(format: format, compact: compact, to: &output)
+    return output
   }
 }
 
 typealias UID = UInt64
 typealias FileID = UInt64
 
+/// Resource usage of a process over its whole lifetime, as reported at exit
+struct ResourceUsage: Codable {
+  /// CPU time spent in user and kernel mode in nanoseconds
+  var userTime: UInt64
+  var systemTime: UInt64
+  /// Max resident set size in bytes
+  var maxRSS: UInt64
+  var voluntaryContextSwitches: UInt64
+  var involuntaryContextSwitches: UInt64
+  /// Bytes read from and written to storage, not counting the page cache hits
+  var readBytes: UInt64
+  var writeBytes: UInt64
+
+  var cpuTime: UInt64 { userTime + systemTime }
+}
+
+extension ResourceUsage {
+  private static let pageSize = UInt64(sysconf(Int32(_SC_PAGESIZE)))
+
+  init(_ usage: mkcheck2_rusage) {
+    userTime = usage.utime
+    systemTime = usage.stime
+    maxRSS = usage.maxrss * ResourceUsage.pageSize
+    voluntaryContextSwitches = usage.nvcsw
+    involuntaryContextSwitches = usage.nivcsw
+    readBytes = usage.read_bytes
+    writeBytes = usage.write_bytes
+  }
+}
+
 class Trace {
   let root: pid_t
   let selfPid: pid_t
   private(set) var rootExitCode: Int32?
+  /// The number of events lost while tracing
+  var droppedEvents: UInt64 = 0
+  /// Drops the inputs and outputs whose path read from user space is outside
+  /// the traced prefixes. The BPF program filters the paths of open files.
+  var pathFilter: PathFilter?
 
-  /// The next file ID to assign
-  private var nextFileID: FileID = 1
-
-  class Process: Codable {
+  class Process {
     /// The process ID
     let pid: pid_t
     /// The parent process UID
@@ -123,35 +583,70 @@ class Trace {
     var pipeCount: Int = 0
     /// The current working directory
     var cwd: FilePath
-
-    init(pid: pid_t, parent: UID, uid: UID, image: FileID, cwd: FilePath) {
+    /// CLOCK_MONOTONIC times in nanoseconds. The process starts when it is
+    /// cloned, or when it executes the image if the clone was not traced, and
+    /// ends when it exits or executes another image.
+    var start: UInt64?
+    var end: UInt64?
+    /// When the process first read any file
+    var firstInput: UInt64?
+    /// When the process last wrote any file
+    var lastOutput: UInt64?
+    /// Nil until the process exits
+    var usage: ResourceUsage?
+    /// Shared by the processes of the trace
+    private let symlinks: SymlinkCache
+
+    init(
+      pid: pid_t, parent: UID, uid: UID, image: FileID, cwd: FilePath, symlinks: SymlinkCache
+    ) {
       self.pid = pid
       self.parent = parent
       self.uid = uid
       self.image = image
       self.cwd = cwd
+      self.symlinks = symlinks
+    }
+
+    /// Record the time of an input or output event
+    func touch(output: Bool, at timestamp: UInt64) {
+      if output {
+        lastOutput = max(lastOutput ?? 0, timestamp)
+      } else if firstInput == nil {
+        firstInput = timestamp
+      }
     }
 
     func addInput(_ path: FilePath, trace: Trace) {
       inputs.insert(trace.find(path: normalize(path: path)))
     }
 
+    func addInput(_ id: FileID) {
+      inputs.insert(id)
+    }
+
     func addOutput(_ path: FilePath, trace: Trace) {
       let path = normalize(path: path)
-      outputs.insert(trace.find(path: path))
+      addOutput(trace.find(path: path), trace: trace)
+    }
+
+    func addOutput(_ id: FileID, trace: Trace) {
+      outputs.insert(id)
       // XXX: Is this correct?
-      let parent = trace.find(path: path.removingLastComponent())
+      let parent = trace.fileInfos.parent(of: id)
       if !outputs.contains(parent) {
         inputs.insert(parent)
       }
     }
 
     func link(target: FilePath, linkPath: FilePath, trace: Trace) {
+      symlinks.invalidate(linkPath)
       trace.addDependency(source: target, dest: linkPath)
       addOutput(linkPath, trace: trace)
     }
 
     func rename(source: FilePath, dest: FilePath, trace: Trace) {
+      symlinks.renamed(from: source, to: dest)
       trace.unlink(path: source)
       trace.addDependency(source: source, dest: dest)
       addOutput(dest, trace: trace)
@@ -167,21 +662,20 @@ class Trace {
     }
 
     func normalize(base: FilePath, path: FilePath) -> FilePath {
-      let fullPath = base.pushing(path).lexicallyNormalized()
-      guard
-        let resolved = try? FileManager.default.destinationOfSymbolicLink(atPath: fullPath.string)
-      else {
-        return fullPath
-      }
-      let fullParent = fullPath.removingLastComponent()
-      return fullParent.pushing(FilePath(resolved)).lexicallyNormalized()
+      return symlinks.resolve(base.pushing(path).lexicallyNormalized())
     }
   }
 
   private(set) var procs: [pid_t: Process] = [:]
-  /// A map from file paths to file IDs
-  private var fileIDs: [FilePath: FileID] = [:]
-
+  private let symlinks = SymlinkCache()
+  /// Clone times of the processes that have not executed an image yet
+  private var cloneTimes: [pid_t: UInt64] = [:]
+  /// A map from ids assigned by the kernel (kEventTypeFileName) to file IDs.
+  /// Kernel ids are dense and start from 1, so this is indexed directly and
+  /// 0 marks an id that was never announced.
+  private var kernelFiles: [FileID] = [0]
+
+  /// A snapshot of a file of `fileInfos`
   struct FileInfo: Codable {
     /// The file path
     let name: FilePath
@@ -219,21 +713,25 @@ class Trace {
     /// as much as possible.
     var deps: [FileID]
   }
-  private(set) var fileInfos: [FileID: FileInfo] = [:]
-
-  init(root: pid_t, selfPid: pid_t = getpid()) {
+  /// The files of the trace, indexed by file ID
+  private(set) var fileInfos = FileTable()
+
+  /// - Parameter cwd: The working directory the root process starts in
+  init(
+    root: pid_t, selfPid: pid_t = getpid(),
+    cwd: FilePath = FilePath(FileManager.default.currentDirectoryPath)
+  ) {
     self.root = root
     self.selfPid = selfPid
 
     // Add the root process
     let rootProc = Process(
-      pid: root, parent: 0, uid: 0, image: find(path: "/__root__"),
-      cwd: FilePath(FileManager.default.currentDirectoryPath))
+      pid: root, parent: 0, uid: 0, image: find(path: "/__root__"), cwd: cwd, symlinks: symlinks)
     procs[root] = rootProc
 
     let selfProc = Process(
-      pid: selfPid, parent: 0, uid: 0, image: find(path: "/__self__"),
-      cwd: FilePath(FileManager.default.currentDirectoryPath))
+      pid: selfPid, parent: 0, uid: 0, image: find(path: "/__self__"), cwd: cwd,
+      symlinks: symlinks)
     procs[selfPid] = selfProc
   }
 
@@ -244,249 +742,268 @@ class Trace {
 
   /// Finds a file and returns file ID
   func find(path: FilePath) -> FileID {
-    if let id = fileIDs[path] {
-      return id
+    fileInfos.find(path)
+  }
+
+  /// Records the path announced by the kernel for the given kernel file id
+  func registerKernelFile(id kernelID: UInt64, path: FilePath) {
+    let index = Int(kernelID)
+    if kernelFiles.count <= index {
+      // Ids whose announcement was dropped leave holes
+      kernelFiles.append(contentsOf: repeatElement(0, count: index + 1 - kernelFiles.count))
+    }
+    // Resolved like the inline paths of the events that failed to announce
+    kernelFiles[index] = find(path: symlinks.resolve(path.lexicallyNormalized()))
+  }
+
+  /// Returns the file ID referred to by the kernel file id carried by the
+  /// event, or nil if the event carries an inline path instead
+  func announcedFile(of event: DecodedEvent) throws -> FileID? {
+    let kernelID = event.fileID
+    guard kernelID != 0 else { return nil }
+    guard kernelID < kernelFiles.count, kernelFiles[Int(kernelID)] != 0 else {
+      throw Mkcheck2Error("Event refers to unknown file id \(kernelID)")
+    }
+    return kernelFiles[Int(kernelID)]
+  }
+
+  /// Records the exit of the root process if its exit event was lost
+  func rootExited(exitCode: Int32) {
+    if rootExitCode == nil {
+      rootExitCode = exitCode
     }
-    let id = nextFileID
-    nextFileID += 1
-    fileIDs[path] = id
-    // FIXME: Check if the file exists
-    fileInfos[id] = FileInfo(name: path, deleted: false, exists: true, deps: [])
-    return id
   }
 
   func unlink(path: FilePath) {
-    let id = find(path: path)
-    fileInfos[id]!.deleted = true
-    fileInfos[id]!.exists = false
+    symlinks.invalidate(path)
+    fileInfos.markDeleted(find(path: path))
   }
 
   func addDependency(source: FilePath, dest: FilePath) {
-    let sourceID = find(path: source)
-    let destID = find(path: dest)
-    fileInfos[sourceID]!.deps.append(destID)
+    fileInfos.addDependency(from: find(path: source), to: find(path: dest))
   }
 
-  func withProcess(
-    _ event: UnsafeMutablePointer<mkcheck2_event_header>, _ body: (inout Process) throws -> Void
-  ) rethrows {
-    let pid = event.pointee.pid
-    if procs[pid] == nil {
-      logger.warning("Process \(pid) not found!?")
-      return
-    }
-    try body(&procs[pid]!)
+  /// Record a symlink created by a traced process
+  /// - Parameters:
+  ///   - parent: The normalized directory of the link
+  ///   - name: The path of the link, of which only the last component is used
+  private func symlinkCreated(in parent: FilePath, name: FilePath, destination: FilePath) {
+    guard let name = name.lastComponent else { return }
+    symlinks.symlinkCreated(at: parent.appending(name), destination: destination)
   }
 
-  func withEvent(
-    _ eventHeader: UnsafeMutablePointer<mkcheck2_event_header>,
-    _ body: (UnsafeMutablePointer<mkcheck2_event>) throws -> Void
-  ) throws {
-    try eventHeader.withMemoryRebound(to: mkcheck2_event.self, capacity: 1) {
-      #if DEBUG
-        let path = (try? $0.pathOrInode) ?? "bad string"
-        logger.trace(
-          "\(eventHeader.pointee.type) \(eventHeader.pointee.pid) \(eventHeader.pointee.uid) LINE=\(eventHeader.pointee.source_line) \(path)"
-        )
-      #endif
-      try body($0)
-    }
+  /// Record the start of the image just executed by the process of the event
+  private func started(_ event: DecodedEvent) {
+    let pid = event.header.pid
+    let timestamp = event.header.timestamp
+    procs[pid]?.start = cloneTimes.removeValue(forKey: pid) ?? timestamp
   }
 
-  func withFatEvent(
-    _ eventHeader: UnsafeMutablePointer<mkcheck2_event_header>,
-    _ body: (UnsafeMutablePointer<mkcheck2_fat_event>) throws -> Void
-  ) rethrows {
-    try eventHeader.withMemoryRebound(to: mkcheck2_fat_event.self, capacity: 1) {
-      #if DEBUG
-        let path1 = (try? ($0.paths.0 ?? "")) ?? "bad string"
-        let path2 = (try? ($0.paths.1 ?? "")) ?? "bad string"
-        logger.trace(
-          "\(eventHeader.pointee.type) \(eventHeader.pointee.pid) \(eventHeader.pointee.uid) LINE=\(eventHeader.pointee.source_line) \(path1) \(path2)"
-        )
-      #endif
-      try body($0)
+  /// Whether inputs and outputs of the given normalized path are reported
+  private func isReported(_ path: FilePath) -> Bool {
+    pathFilter?.allows(path) ?? true
+  }
+
+  /// Returns the file of an input or output event, or nil if its path is
+  /// filtered out
+  private func ioFile(of event: DecodedEvent, process: Process) throws -> FileID? {
+    if let id = try announcedFile(of: event) {
+      return id
     }
+    let path = process.normalize(path: event.pathOrInode)
+    // Pipes have no path to filter by
+    guard event.path == nil || isReported(path) else { return nil }
+    return find(path: path)
   }
 
-  func withFat2Event(
-    _ eventHeader: UnsafeMutablePointer<mkcheck2_event_header>,
-    _ body: (UnsafeMutablePointer<mkcheck2_fat2_event>) throws -> Void
-  ) rethrows {
-    try eventHeader.withMemoryRebound(to: mkcheck2_fat2_event.self, capacity: 1) {
-      #if DEBUG
-        let path1 = (try? ($0.paths.0 ?? "")) ?? "bad string"
-        let path2 = (try? ($0.paths.1 ?? "")) ?? "bad string"
-        logger.trace(
-          "\(eventHeader.pointee.type) \(eventHeader.pointee.pid) \(eventHeader.pointee.uid) LINE=\(eventHeader.pointee.source_line) \(path1) \(path2)"
-        )
-      #endif
-      try body($0)
+  func withProcess(_ event: DecodedEvent, _ body: (inout Process) throws -> Void) rethrows {
+    let pid = event.header.pid
+    if procs[pid] == nil {
+      logger.warning("Process \(pid) not found!?")
+      return
     }
+    try body(&procs[pid]!)
+  }
+
+  /// The error of an event without a path its type always has
+  private func missingPath(_ event: DecodedEvent) -> Mkcheck2Error {
+    Mkcheck2Error("\(event.header.type) event of process \(event.header.pid) is missing a path")
   }
 
-  func handleEvent(_ eventHeader: UnsafeMutablePointer<mkcheck2_event_header>) throws {
-    switch eventHeader.pointee.type {
+  func handleEvent(_ event: DecodedEvent) throws {
+    #if DEBUG
+      let paths = event.paths.map { $0?.string ?? "" }.joined(separator: " ")
+      logger.trace(
+        "\(event.header.type) \(event.header.pid) \(event.header.uid) LINE=\(event.header.source_line) \(paths)"
+      )
+    #endif
+    let timestamp = event.header.timestamp
+    switch event.header.type {
     case .eventTypeExec:
-      try withEvent(eventHeader) { event in
-        let ppid = event.pointee.payload
-        guard let parent = procs[ppid] else {
-          logger.warning("Parent process \(ppid) not found!?")
-          return
-        }
-        self.procs[eventHeader.pointee.pid] = try Process(
-          pid: eventHeader.pointee.pid,
-          parent: parent.uid,
-          uid: eventHeader.pointee.uid,
-          image: find(path: parent.normalize(path: event.path ?? "")),
-          cwd: parent.cwd
-        )
+      let ppid = event.payload
+      guard let parent = procs[ppid] else {
+        logger.warning("Parent process \(ppid) not found!?")
+        return
       }
+      self.procs[event.header.pid] = Process(
+        pid: event.header.pid,
+        parent: parent.uid,
+        uid: event.header.uid,
+        image: find(path: parent.normalize(path: event.path ?? "")),
+        cwd: parent.cwd,
+        symlinks: symlinks
+      )
+      started(event)
     case .eventTypeExecAt:
-      try withFatEvent(eventHeader) { event in
-        let ppid = event.pointee.payload
-        guard let parent = procs[ppid] else {
-          logger.warning("Parent process \(ppid) not found!?")
-          return
-        }
-        self.procs[eventHeader.pointee.pid] = try Process(
-          pid: eventHeader.pointee.pid,
-          parent: parent.uid,
-          uid: eventHeader.pointee.uid,
-          image: find(path: parent.normalize(base: event.paths.0 ?? "", path: event.paths.1 ?? "")),
-          cwd: parent.cwd
-        )
+      let ppid = event.payload
+      guard let parent = procs[ppid] else {
+        logger.warning("Parent process \(ppid) not found!?")
+        return
       }
+      self.procs[event.header.pid] = Process(
+        pid: event.header.pid,
+        parent: parent.uid,
+        uid: event.header.uid,
+        image: find(path: parent.normalize(base: event.paths[0] ?? "", path: event.paths[1] ?? "")),
+        cwd: parent.cwd,
+        symlinks: symlinks
+      )
+      started(event)
     case .eventTypeExit:
-      try withEvent(eventHeader) { event in
-        if eventHeader.pointee.pid == root {
-          rootExitCode = event.pointee.payload
-        }
+      if event.header.pid == root {
+        rootExitCode = event.payload
       }
+      procs[event.header.pid]?.end = timestamp
+      procs[event.header.pid]?.usage = event.usage.map { ResourceUsage($0) }
+      cloneTimes[event.header.pid] = nil
     case .eventTypeClone:
-      break
-    // try withEvent(eventHeader) { event in
-    //     let ppid = event.pointee.payload
-    //     guard let parent = procs[ppid] else {
-    //         // Check ppid in user land
-    //         logger.warning("Parent process \(ppid) not found!?")
-    //         return
-    //     }
-    //     self.procs[eventHeader.pointee.pid] = parent
+      cloneTimes[event.header.pid] = timestamp
+    // let ppid = event.payload
+    // guard let parent = procs[ppid] else {
+    //     // Check ppid in user land
+    //     logger.warning("Parent process \(ppid) not found!?")
+    //     return
     // }
+    // self.procs[event.header.pid] = parent
+    case .eventTypeFileName:
+      guard let path = event.path else {
+        throw Mkcheck2Error("File id \(event.fileID) is announced without a path")
+      }
+      registerKernelFile(id: event.fileID, path: path)
     case .eventTypeChdir:
-      try withEvent(eventHeader) { event in
-        try withProcess(eventHeader) { process in
-          try process.setCurrentWorkingDirectory(event.path!)
+      try withProcess(event) { process in
+        if let id = try announcedFile(of: event) {
+          process.setCurrentWorkingDirectory(fileInfos.name(of: id))
+        } else {
+          process.setCurrentWorkingDirectory(event.path!)
         }
       }
     case .eventTypeInput:
-      try withEvent(eventHeader) { event in
-        try withProcess(eventHeader) { try $0.addInput(event.pathOrInode, trace: self) }
+      try withProcess(event) {
+        guard let id = try ioFile(of: event, process: $0) else { return }
+        $0.touch(output: false, at: timestamp)
+        $0.addInput(id)
       }
     case .eventTypeOutput:
-      try withEvent(eventHeader) { event in
-        try withProcess(eventHeader) { try $0.addOutput(event.pathOrInode, trace: self) }
+      try withProcess(event) {
+        guard let id = try ioFile(of: event, process: $0) else { return }
+        $0.touch(output: true, at: timestamp)
+        $0.addOutput(id, trace: self)
       }
     case .eventTypeInputAt:
-      try withFatEvent(eventHeader) { event in
-        try withProcess(eventHeader) {
-          let path = try $0.normalize(base: event.paths.0 ?? "", path: event.paths.1 ?? "")
-          $0.addInput(path, trace: self)
-        }
+      withProcess(event) {
+        let path = $0.normalize(base: event.paths[0] ?? "", path: event.paths[1] ?? "")
+        guard isReported(path) else { return }
+        $0.touch(output: false, at: timestamp)
+        $0.addInput(path, trace: self)
       }
     case .eventTypeOutputAt:
-      try withFatEvent(eventHeader) { event in
-        try withProcess(eventHeader) {
-          let path = try $0.normalize(base: event.paths.0 ?? "", path: event.paths.1 ?? "")
-          $0.addOutput(path, trace: self)
-        }
+      withProcess(event) {
+        let path = $0.normalize(base: event.paths[0] ?? "", path: event.paths[1] ?? "")
+        guard isReported(path) else { return }
+        $0.touch(output: true, at: timestamp)
+        $0.addOutput(path, trace: self)
       }
     case .eventTypeRemove:
-      try withEvent(eventHeader) { event in
-        try withProcess(eventHeader) { process in
-          let path = try process.normalize(path: event.path!)
-          unlink(path: path)
-        }
+      withProcess(event) { process in
+        let path = process.normalize(path: event.path!)
+        unlink(path: path)
       }
     case .eventTypeRemoveAt:
-      try withFatEvent(eventHeader) { event in
-        try withProcess(eventHeader) { process in
-          let path = try process.normalize(base: event.paths.0 ?? "", path: event.paths.1 ?? "")
-          unlink(path: path)
-        }
+      withProcess(event) { process in
+        let path = process.normalize(base: event.paths[0] ?? "", path: event.paths[1] ?? "")
+        unlink(path: path)
       }
     case .eventTypeRename:
-      try withFatEvent(eventHeader) { event in
-        try withProcess(eventHeader) { process in
-          guard case (let source?, let dest?) = try event.paths else { fatalError() }
-          process.rename(
-            source: process.normalize(path: source), dest: process.normalize(path: dest),
-            trace: self)
+      withProcess(event) { process in
+        guard let source = event.paths[0], let dest = event.paths[1] else {
+          throw missingPath(event)
         }
+        process.rename(
+          source: process.normalize(path: source), dest: process.normalize(path: dest),
+          trace: self)
       }
     case .eventTypeRenameAt:
-      try withFat2Event(eventHeader) { event in
-        try withProcess(eventHeader) { process in
-          guard
-            case (let sourceBasePath?, let destBasePath?, let source?, let dest?) = try event.paths
-          else { fatalError() }
-          let sourceBase = process.normalize(path: sourceBasePath)
-          let destBase = process.normalize(path: destBasePath)
-          process.rename(
-            source: process.normalize(base: sourceBase, path: source),
-            dest: process.normalize(base: destBase, path: dest),
-            trace: self
-          )
-        }
+      withProcess(event) { process in
+        guard
+          let sourceBasePath = event.paths[0], let destBasePath = event.paths[1],
+          let source = event.paths[2], let dest = event.paths[3]
+        else { throw missingPath(event) }
+        let sourceBase = process.normalize(path: sourceBasePath)
+        let destBase = process.normalize(path: destBasePath)
+        process.rename(
+          source: process.normalize(base: sourceBase, path: source),
+          dest: process.normalize(base: destBase, path: dest),
+          trace: self
+        )
       }
     case .eventTypeLink:
-      try withFatEvent(eventHeader) { event in
-        try withProcess(eventHeader) { process in
-          guard case (let source?, let dest?) = try event.paths else { fatalError() }
-          process.link(
-            target: process.normalize(path: source), linkPath: process.normalize(path: dest),
-            trace: self)
+      withProcess(event) { process in
+        guard let source = event.paths[0], let dest = event.paths[1] else {
+          throw missingPath(event)
         }
+        process.link(
+          target: process.normalize(path: source), linkPath: process.normalize(path: dest),
+          trace: self)
       }
     case .eventTypeLinkAt:
-      try withFat2Event(eventHeader) { event in
-        try withProcess(eventHeader) { process in
-          guard
-            case (let sourceBasePath?, let destBasePath?, let sourceLink?, let destLink?) =
-              try event.paths
-          else { fatalError() }
-          let sourceBase = process.normalize(path: sourceBasePath)
-          let destBase = process.normalize(path: destBasePath)
-          process.link(
-            target: process.normalize(base: sourceBase, path: sourceLink),
-            linkPath: process.normalize(base: destBase, path: destLink),
-            trace: self
-          )
-        }
+      withProcess(event) { process in
+        guard
+          let sourceBasePath = event.paths[0], let destBasePath = event.paths[1],
+          let sourceLink = event.paths[2], let destLink = event.paths[3]
+        else { throw missingPath(event) }
+        let sourceBase = process.normalize(path: sourceBasePath)
+        let destBase = process.normalize(path: destBasePath)
+        process.link(
+          target: process.normalize(base: sourceBase, path: sourceLink),
+          linkPath: process.normalize(base: destBase, path: destLink),
+          trace: self
+        )
       }
     case .eventTypeSymlink:
-      try withFatEvent(eventHeader) { event in
-        try withProcess(eventHeader) { process in
-          guard case (let sourceLink?, let destRelative?) = try event.paths else { fatalError() }
-          let parent = process.normalize(path: destRelative.removingLastComponent())
-          let source = process.normalize(base: parent, path: sourceLink)
-          let dest = process.normalize(path: destRelative)
-          addDependency(source: source, dest: dest)
-          process.addOutput(dest, trace: self)
+      withProcess(event) { process in
+        guard let sourceLink = event.paths[0], let destRelative = event.paths[1] else {
+          throw missingPath(event)
         }
+        let parent = process.normalize(path: destRelative.removingLastComponent())
+        let source = process.normalize(base: parent, path: sourceLink)
+        let dest = process.normalize(path: destRelative)
+        symlinkCreated(in: parent, name: destRelative, destination: sourceLink)
+        addDependency(source: source, dest: dest)
+        process.addOutput(dest, trace: self)
       }
     case .eventTypeSymlinkAt:
-      try withFat2Event(eventHeader) { event in
-        try withProcess(eventHeader) { process in
-          guard case (let base?, let sourceLink?, let destRelative?, _) = try event.paths else {
-            fatalError()
-          }
-          let parent = process.normalize(base: base, path: destRelative.removingLastComponent())
-          let source = process.normalize(base: parent, path: sourceLink)
-          let dest = process.normalize(base: base, path: destRelative)
-          process.link(target: source, linkPath: dest, trace: self)
+      withProcess(event) { process in
+        guard let base = event.paths[0], let sourceLink = event.paths[1],
+          let destRelative = event.paths[2]
+        else {
+          throw missingPath(event)
         }
+        let parent = process.normalize(base: base, path: destRelative.removingLastComponent())
+        let source = process.normalize(base: parent, path: sourceLink)
+        let dest = process.normalize(base: base, path: destRelative)
+        process.link(target: source, linkPath: dest, trace: self)
+        symlinkCreated(in: parent, name: destRelative, destination: sourceLink)
       }
     }
   }
@@ -11,12 +11,46 @@ let logger = Logger(label: "mkcheck2")
 @main
 struct Mkcheck2: ParsableCommand {
 
-  enum OutputFormat: String, ExpressibleByArgument {
+  enum OutputFormat: String, ExpressibleByArgument, Codable {
     case json
     case dot
     case ascii
     case none
   }
+  enum Backend: String, ExpressibleByArgument {
+    /// Syscall tracepoints
+    case tracepoint
+    /// fexit probes on VFS/LSM hooks for file I/O, tracepoints for the rest
+    case vfs
+    /// vfs if the kernel supports it, tracepoint otherwise
+    case auto
+  }
+
+  enum StatsFormat: String, ExpressibleByArgument {
+    case text
+    case json
+  }
+
+  /// The set of probes loaded into the kernel
+  enum Profile: String, ExpressibleByArgument {
+    /// Every probe
+    case full
+    /// Every probe but those observing metadata only (stat, access, xattr)
+    case deps
+    /// Reads and writes of file contents, and the renames, links and removals
+    /// moving them
+    case io
+    /// The process tree only
+    case execOnly = "exec-only"
+  }
+
+  enum IOMode: String, ExpressibleByArgument {
+    /// Report files when they are read or written
+    case access
+    /// Report files when they are opened, classified by the open flags
+    case open
+  }
+
   struct LogLevel: ExpressibleByArgument {
     let underlying: Logger.Level
     init(_ level: Logger.Level) {
@@ -36,16 +70,84 @@ struct Mkcheck2: ParsableCommand {
     @Option(name: .shortAndLong, help: "The output format")
     var format: OutputFormat = .json
 
+    @Flag(name: .long, help: "Write the JSON output on a single line instead of indenting it")
+    var compact: Bool = false
+
+    @Option(
+      name: .long,
+      help: "Append the raw events to the given file instead of analyzing them, see `analyze`")
+    var record: String?
+
     @Option(name: .long, help: "The log level")
     var logLevel: LogLevel = LogLevel(.warning)
 
-    func bootstrapLogger() {
-      LoggingSystem.bootstrap { label in
-        var handler = StreamLogHandler.standardOutput(label: label)
-        handler.logLevel = self.logLevel.underlying
-        return handler
+    @Option(name: .long, help: "The max number of concurrently live processes to trace")
+    var maxProcesses: UInt32 = 8192
+
+    @Option(name: .long, help: "Only report inputs and outputs under the given path prefix")
+    var includePrefix: [String] = []
+
+    @Option(name: .long, help: "Do not report inputs and outputs under the given path prefix")
+    var excludePrefix: [String] = []
+
+    @Option(name: .long, help: "The probes to trace file I/O with (tracepoint, vfs or auto)")
+    var backend: Backend = .tracepoint
+
+    @Option(name: .long, help: "When to report inputs and outputs (access or open)")
+    var ioMode: IOMode = .access
+
+    @Option(name: .long, help: "The probes to load (full, deps, io or exec-only)")
+    var profile: Profile = .full
+
+    @Option(name: .long, help: "The size of the event ring buffer in bytes (a power of 2)")
+    var ringSize: UInt32 = 16 * 1024 * 1024
+
+    @Option(name: .long, help: "The number of ring buffers to spread events over by CPU")
+    var ringShards: UInt32 = 1
+
+    @Flag(
+      name: .long,
+      help: "Keep tracing when the ring buffer is full and mark the trace as incomplete")
+    var tolerateDrops: Bool = false
+
+    @Flag(
+      name: .long,
+      help: "Trace the tasks in a fresh cgroup v2 instead of following the process ancestry")
+    var cgroup: Bool = false
+
+    @Flag(name: .long, help: "Print per-probe and consumer statistics to stderr after tracing")
+    var stats: Bool = false
+
+    @Option(name: .long, help: "The format of the statistics (text or json)")
+    var statsFormat: StatsFormat = .text
+
+    func validate() throws {
+      guard ringSize.nonzeroBitCount == 1, ringSize >= getpagesize() else {
+        throw ValidationError("--ring-size must be a power of 2 and at least the page size")
+      }
+      guard ringShards >= 1 && ringShards <= MKCHECK2_RING_SHARDS_MAX else {
+        throw ValidationError("--ring-shards must be between 1 and \(MKCHECK2_RING_SHARDS_MAX)")
+      }
+      guard record == nil || output == nil else {
+        throw ValidationError("--record writes no trace, run `analyze` on the recording instead")
       }
     }
+
+    func bootstrapLogger() {
+      Mkcheck2.bootstrapLogger(level: logLevel)
+    }
+
+    func pathFilter() throws -> PathFilter {
+      try PathFilter(includes: includePrefix, excludes: excludePrefix)
+    }
+  }
+
+  static func bootstrapLogger(level: LogLevel) {
+    LoggingSystem.bootstrap { label in
+      var handler = StreamLogHandler.standardOutput(label: label)
+      handler.logLevel = level.underlying
+      return handler
+    }
   }
 
   struct Pid: ParsableCommand {
@@ -55,7 +157,12 @@ struct Mkcheck2: ParsableCommand {
     var pid: Int
 
     func run() throws {
-      try Mkcheck2.trace(pid: pid_t(pid)).run(options: traceOptions)
+      guard !traceOptions.cgroup else {
+        // Only the future children of a process follow it into a cgroup
+        throw ValidationError("--cgroup is not supported for an existing process")
+      }
+      let (tracer, session) = try Mkcheck2.trace(pid: pid_t(pid), options: traceOptions)
+      try tracer.run(session, options: traceOptions)
     }
   }
 
@@ -74,45 +181,24 @@ struct Mkcheck2: ParsableCommand {
         throw Mkcheck2Error("No command specified")
       }
 
-      switch fork() {
-      case -1:
-        throw Mkcheck2Error("Failed to fork")
-      case 0:
-        try Mkcheck2.dropPrivileges()
-        raise(SIGSTOP)  // Wait for the parent to attach the BPF program
-        var argv = args.map { strdup($0) }
-        argv.append(nil)
-        execvp(argv[0]!, argv)
-        let error = String(cString: strerror(errno))
-        for arg in argv.dropLast() {
-          free(arg)
-        }
-        throw Mkcheck2Error("Failed to execvp \(args): \(error)")
-      case let pid:
-        var status: Int32 = 0
-        // Wait for the child until the process is ready to exec
-        logger.info("Waiting for PID \(pid)")
-        let readyPID = waitpid(pid, &status, WUNTRACED)
-        assert(pid == readyPID, "waitpid returned unexpected PID")
-        logger.info("Child stopped with status \(status)")
-        guard swift_WSTOPSIG(status) == SIGSTOP else {
-          throw Mkcheck2Error("Child did not stop!?")
-        }
-        // Attach the BPF program to the child
-        logger.info("Tracing PID \(pid)")
-        do {
-          let tracer = try Mkcheck2.trace(pid: pid)
-          // Resume the child so it can exec
-          logger.info("Resuming PID \(pid)")
-          kill(pid, SIGCONT)
-          try tracer.run(options: traceOptions)
-        } catch {
-          if !(error is ExitCode) {
-            logger.warning("Error: \(error)")
-          }
-          kill(pid, SIGKILL)
-          throw error
+      let pid = try Mkcheck2.spawnStopped(args)
+      // Attach the BPF program to the child
+      logger.info("Tracing PID \(pid)")
+      var cgroup: TracingCgroup?
+      do {
+        cgroup = try traceOptions.cgroup ? TracingCgroup.create(for: pid) : nil
+        let (tracer, session) = try Mkcheck2.trace(pid: pid, options: traceOptions, cgroup: cgroup)
+        // Resume the child so it can exec
+        logger.info("Resuming PID \(pid)")
+        kill(pid, SIGCONT)
+        try tracer.run(session, options: traceOptions)
+      } catch {
+        if !(error is ExitCode) {
+          logger.warning("Error: \(error)")
         }
+        kill(pid, SIGKILL)
+        cgroup?.remove()
+        throw error
       }
     }
   }
@@ -125,18 +211,18 @@ struct Mkcheck2: ParsableCommand {
     var second: String
 
     func run() throws {
-      let trace1 = try loadTrace(first)
-      let trace2 = try loadTrace(second)
+      let files1 = try DumpFormat.loadFiles(from: first)
+      let files2 = try DumpFormat.loadFiles(from: second)
 
       var fileIDByPath1: [FilePath: FileID] = [:]
       var fileIDByPath2: [FilePath: FileID] = [:]
       var fileInfoByID1: [FileID: Serialization.FileInfo] = [:]
       var fileInfoByID2: [FileID: Serialization.FileInfo] = [:]
-      for fileInfo in trace1.files {
+      for fileInfo in files1 {
         fileInfoByID1[fileInfo.id] = fileInfo
         fileIDByPath1[fileInfo.name] = fileInfo.id
       }
-      for fileInfo in trace2.files {
+      for fileInfo in files2 {
         fileInfoByID2[fileInfo.id] = fileInfo
         fileIDByPath2[fileInfo.name] = fileInfo.id
       }
@@ -184,37 +270,243 @@ struct Mkcheck2: ParsableCommand {
       return path.starts(with: "/tmp/") || path.starts(with: "/proc/") || path.starts(with: "/dev/")
         || info.deleted == true
     }
-
-    private func loadTrace(_ path: String) throws -> DumpFormat {
-      let data = try Data(contentsOf: URL(fileURLWithPath: path))
-      let decoder = JSONDecoder()
-      var format = try decoder.decode(DumpFormat.self, from: data)
-      format.normalize()
-      return format
-    }
   }
 
   static let configuration = CommandConfiguration(
     commandName: "mkcheck2",
-    subcommands: [Command.self, Pid.self, Diff.self],
+    subcommands: [
+      Command.self, Pid.self, Analyze.self, Diff.self, CriticalPath.self, Top.self, Convert.self,
+      Daemon.self, Client.self, Bench.self,
+    ],
     defaultSubcommand: Command.self
   )
 
-  static func trace(pid: pid_t) throws -> Tracer {
-    guard let obj = mkcheck2_bpf__open() else {
-      throw Mkcheck2Error("Failed to open BPF object")
+  /// Fork a child that stops itself right before executing the given command
+  /// - Returns: The pid of the stopped child. Send SIGCONT to let it execute the command.
+  static func spawnStopped(_ args: [String]) throws -> pid_t {
+    switch fork() {
+    case -1:
+      throw Mkcheck2Error("Failed to fork")
+    case 0:
+      try Mkcheck2.dropPrivileges()
+      raise(SIGSTOP)  // Wait for the parent to attach the BPF program
+      var argv = args.map { strdup($0) }
+      argv.append(nil)
+      execvp(argv[0]!, argv)
+      let error = String(cString: strerror(errno))
+      for arg in argv.dropLast() {
+        free(arg)
+      }
+      throw Mkcheck2Error("Failed to execvp \(args): \(error)")
+    case let pid:
+      var status: Int32 = 0
+      // Wait for the child until the process is ready to exec
+      logger.info("Waiting for PID \(pid)")
+      let readyPID = waitpid(pid, &status, WUNTRACED)
+      assert(pid == readyPID, "waitpid returned unexpected PID")
+      logger.info("Child stopped with status \(status)")
+      guard swift_WSTOPSIG(status) == SIGSTOP else {
+        throw Mkcheck2Error("Child did not stop!?")
+      }
+      return pid
     }
+  }
+
+  static func trace(
+    pid: pid_t, options: TraceOptions, cgroup: TracingCgroup? = nil
+  ) throws -> (Tracer, TraceSession) {
     logger.info("Tracing PID \(pid)")
-    obj.pointee.rodata.pointee.root_ppid = pid
-    guard mkcheck2_bpf__load(obj) == 0 else {
-      throw Mkcheck2Error("Failed to load BPF object: \(String(cString: strerror(errno)))")
+    let obj = try load(options: options)
+    do {
+      try cgroup?.install(obj)
+    } catch {
+      mkcheck2_bpf__destroy(obj)
+      throw error
     }
 
     guard mkcheck2_bpf__attach(obj) == 0 else {
-      throw Mkcheck2Error("Failed to attach BPF object: \(String(cString: strerror(errno)))")
+      let message = "Failed to attach BPF object: \(String(cString: strerror(errno)))"
+      mkcheck2_bpf__destroy(obj)
+      throw Mkcheck2Error(message)
     }
 
-    return try Tracer(root: pid, obj: obj)
+    let tracer: Tracer
+    do {
+      tracer = try Tracer(
+        obj: obj, ringShards: Int(options.ringShards), ringSize: options.ringSize,
+        stats: options.stats, pathFilter: options.pathFilter())
+    } catch {
+      mkcheck2_bpf__destroy(obj)
+      throw error
+    }
+    let session = try tracer.begin(root: pid, cgroup: cgroup)
+    if let path = options.record {
+      // Nothing is consumed before the tracer runs
+      session.recorder = try EventRecorder(
+        path: path, root: pid, selfPid: session.trace.selfPid,
+        cwd: FileManager.default.currentDirectoryPath)
+    }
+    return (tracer, session)
+  }
+
+  /// Syscalls whose tracepoints are replaced by the fexit probes of the VFS backend
+  static let vfsReplacedSyscalls = [
+    "read", "readv", "pread64", "preadv", "write", "writev", "pwrite64", "pwritev", "fallocate",
+    "getdents", "getdents64", "mmap",
+  ]
+  /// Programs only loaded by the VFS backend
+  static let vfsPrograms = ["fexit__security_file_permission", "fexit__security_mmap_file"]
+  /// Syscalls only traced in the open I/O mode
+  static let openSyscalls = ["open", "openat", "openat2"]
+  /// Syscalls whose accesses are covered by the open in the open I/O mode
+  static let openReplacedSyscalls = [
+    "read", "readv", "pread64", "preadv", "write", "writev", "pwrite64", "pwritev", "getdents",
+    "getdents64",
+  ]
+
+  /// Syscalls only observing the metadata of files
+  static let metadataSyscalls = [
+    "access", "faccessat", "faccessat2", "newstat", "newfstat", "newfstatat", "statx",
+    "getxattr", "lgetxattr", "llistxattr",
+  ]
+  /// Syscalls neither reading nor writing contents, nor moving them
+  static let nonIOSyscalls =
+    metadataSyscalls + [
+      "getdents", "getdents64", "readlink", "readlinkat", "utime", "utimensat", "fsetxattr",
+      "mkdir", "mkdirat", "rmdir",
+    ]
+  /// Syscalls traced for anything but the process tree. The working directory
+  /// changes are part of the tree, as the paths of execs are relative to it.
+  static let fileSyscalls =
+    nonIOSyscalls + [
+      "read", "readv", "pread64", "preadv", "write", "writev", "pwrite64", "pwritev", "fallocate",
+      "ftruncate", "mmap", "open", "openat", "openat2", "link", "linkat", "symlink", "symlinkat",
+      "unlink", "unlinkat", "rename", "renameat",
+    ]
+
+  /// Open and load the BPF object, choosing the backend if it is `.auto`
+  /// - Parameter sessionCgroupLevel: The depth of the cgroups of the sessions in cgroup mode
+  static func load(
+    options: TraceOptions, sessionCgroupLevel: Int32 = 1
+  ) throws -> UnsafeMutablePointer<mkcheck2_bpf> {
+    switch options.backend {
+    case .tracepoint, .vfs:
+      return try load(
+        options: options, backend: options.backend, sessionCgroupLevel: sessionCgroupLevel)
+    case .auto:
+      do {
+        return try load(options: options, backend: .vfs, sessionCgroupLevel: sessionCgroupLevel)
+      } catch {
+        logger.info("VFS backend is not available, falling back to tracepoints: \(error)")
+        return try load(
+          options: options, backend: .tracepoint, sessionCgroupLevel: sessionCgroupLevel)
+      }
+    }
+  }
+
+  /// Open and load the BPF object with the programs of the given backend
+  static func load(
+    options: TraceOptions, backend: Backend, sessionCgroupLevel: Int32
+  ) throws -> UnsafeMutablePointer<mkcheck2_bpf> {
+    guard let obj = mkcheck2_bpf__open() else {
+      throw Mkcheck2Error("Failed to open BPF object")
+    }
+    do {
+      let pathFilter = try options.pathFilter()
+      pathFilter.configure(obj)
+      guard bpf_map__set_max_entries(obj.pointee.maps.tracing_pinfo, options.maxProcesses) == 0
+      else {
+        throw Mkcheck2Error("Failed to resize process table: \(String(cString: strerror(errno)))")
+      }
+      guard bpf_map__set_max_entries(obj.pointee.maps.events, options.ringSize) == 0 else {
+        throw Mkcheck2Error("Failed to resize ring buffer: \(String(cString: strerror(errno)))")
+      }
+      // Wake up userland in batches of an eighth of the ring buffer
+      obj.pointee.rodata.pointee.ring_wakeup_threshold = UInt64(options.ringSize / 8)
+      obj.pointee.rodata.pointee.tolerate_drops = options.tolerateDrops
+      // All shards have the same capacity as `events`, which is the template of the others
+      let shardTemplate = bpf_map__inner_map(obj.pointee.maps.event_shards)
+      guard bpf_map__set_max_entries(shardTemplate, options.ringSize) == 0 else {
+        throw Mkcheck2Error("Failed to resize ring buffer: \(String(cString: strerror(errno)))")
+      }
+      obj.pointee.rodata.pointee.ring_shards = options.ringShards
+      obj.pointee.rodata.pointee.stats_enabled = options.stats
+      obj.pointee.rodata.pointee.cgroup_mode = options.cgroup
+      obj.pointee.rodata.pointee.session_cgroup_level = sessionCgroupLevel
+
+      let useVFS = backend == .vfs
+      let useOpen = options.ioMode == .open
+      for name in vfsPrograms {
+        try setAutoload(obj, program: name, useVFS)
+      }
+      if useOpen {
+        // Every read and write goes through this hook
+        try setAutoload(obj, program: "fexit__security_file_permission", false)
+      }
+      for syscall in vfsReplacedSyscalls {
+        try setSyscallAutoload(obj, syscall: syscall, !useVFS)
+      }
+      for syscall in openSyscalls {
+        try setSyscallAutoload(obj, syscall: syscall, useOpen)
+      }
+      if useOpen {
+        for syscall in openReplacedSyscalls {
+          try setSyscallAutoload(obj, syscall: syscall, false)
+        }
+      }
+      try applyProfile(obj, options.profile)
+
+      guard mkcheck2_bpf__load(obj) == 0 else {
+        throw Mkcheck2Error("Failed to load BPF object: \(String(cString: strerror(errno)))")
+      }
+      pathFilter.install(obj)
+    } catch {
+      mkcheck2_bpf__destroy(obj)
+      throw error
+    }
+    return obj
+  }
+
+  /// Unload the probes the profile does not need. Programs that are not loaded
+  /// are never verified nor attached.
+  static func applyProfile(_ obj: UnsafeMutablePointer<mkcheck2_bpf>, _ profile: Profile) throws {
+    let disabledSyscalls: [String]
+    switch profile {
+    case .full:
+      return
+    case .deps:
+      disabledSyscalls = metadataSyscalls
+    case .io:
+      disabledSyscalls = nonIOSyscalls
+      // The VFS backend sees listings through the same hook as reads
+      obj.pointee.rodata.pointee.trace_dir_listings = false
+    case .execOnly:
+      disabledSyscalls = fileSyscalls
+      for name in vfsPrograms {
+        try setAutoload(obj, program: name, false)
+      }
+    }
+    for syscall in disabledSyscalls {
+      try setSyscallAutoload(obj, syscall: syscall, false)
+    }
+  }
+
+  static func setSyscallAutoload(
+    _ obj: UnsafeMutablePointer<mkcheck2_bpf>, syscall: String, _ autoload: Bool
+  ) throws {
+    try setAutoload(obj, program: "tracepoint__syscalls__sys_enter_\(syscall)", autoload)
+    try setAutoload(obj, program: "tracepoint__syscalls__sys_exit_\(syscall)", autoload)
+  }
+
+  static func setAutoload(
+    _ obj: UnsafeMutablePointer<mkcheck2_bpf>, program name: String, _ autoload: Bool
+  ) throws {
+    guard let program = bpf_object__find_program_by_name(obj.pointee.obj, name) else {
+      throw Mkcheck2Error("BPF program \(name) not found")
+    }
+    guard bpf_program__set_autoload(program, autoload) == 0 else {
+      throw Mkcheck2Error("Failed to set autoload of \(name): \(String(cString: strerror(errno)))")
+    }
   }
 
   static func dropPrivileges() throws {
@@ -245,14 +537,39 @@ struct Mkcheck2Error: Error, CustomStringConvertible {
   }
 }
 
+/// Decode the paths packed right after the fixed-size part of an event record
+///
+/// - Parameters:
+///   - event: The event record. Its `header.size` covers both the fixed-size part and the paths.
+///   - lengthsOffset: The byte offset of the `path_len` array in `Event`.
+///   - count: The number of elements of the `path_len` array.
+private func readPathStrings<Event>(
+  _ event: UnsafeMutablePointer<Event>, lengthsOffset: Int, count: Int
+) throws -> [String?] {
+  let base = UnsafeRawPointer(event)
+  let recordSize = Int(base.load(as: mkcheck2_event_header.self).size)
+  // The encoded paths start at `sizeof(Event)` in C, which is the stride in Swift.
+  var offset = MemoryLayout<Event>.stride
+  var paths: [String?] = []
+  paths.reserveCapacity(count)
+  for index in 0..<count {
+    let length = Int(
+      base.load(
+        fromByteOffset: lengthsOffset + index * MemoryLayout<UInt16>.stride, as: UInt16.self))
+    guard offset + length <= recordSize else {
+      throw Mkcheck2Error("Encoded path overruns the event record")
+    }
+    paths.append(try UnsafeRawBufferPointer(start: base + offset, count: length).readPathString())
+    offset += length
+  }
+  return paths
+}
+
 extension UnsafeMutablePointer where Pointee == mkcheck2_event {
   var pathString: String? {
     get throws {
-      return try UnsafeRawPointer(self).advanced(
-        by: MemoryLayout<mkcheck2_event>.offset(of: \.path)!
-      ).withMemoryRebound(to: mkcheck2_path_t.self, capacity: 1) { base -> String? in
-        return try base.readPathString()
-      }
+      let offset = MemoryLayout<mkcheck2_event>.offset(of: \.path_len)!
+      return try readPathStrings(self, lengthsOffset: offset, count: 1)[0]
     }
   }
   var path: FilePath? {
@@ -276,17 +593,9 @@ extension UnsafeMutablePointer where Pointee == mkcheck2_event {
 extension UnsafeMutablePointer where Pointee == mkcheck2_fat_event {
   var pathStrings: (String?, String?) {
     get throws {
-      let path0 = try UnsafeRawPointer(self).advanced(
-        by: MemoryLayout<mkcheck2_fat_event>.offset(of: \.path.0)!
-      ).withMemoryRebound(to: mkcheck2_path_t.self, capacity: 1) { base -> String? in
-        return try base.readPathString()
-      }
-      let path1 = try UnsafeRawPointer(self).advanced(
-        by: MemoryLayout<mkcheck2_fat_event>.offset(of: \.path.1)!
-      ).withMemoryRebound(to: mkcheck2_path_t.self, capacity: 1) { base -> String? in
-        return try base.readPathString()
-      }
-      return (path0, path1)
+      let offset = MemoryLayout<mkcheck2_fat_event>.offset(of: \.path_len)!
+      let paths = try readPathStrings(self, lengthsOffset: offset, count: 2)
+      return (paths[0], paths[1])
     }
   }
 
@@ -301,20 +610,9 @@ extension UnsafeMutablePointer where Pointee == mkcheck2_fat_event {
 extension UnsafeMutablePointer where Pointee == mkcheck2_fat2_event {
   var pathStrings: (String?, String?, String?, String?) {
     get throws {
-      func readPathString(at keyPath: KeyPath<mkcheck2_fat2_event, mkcheck2_path_t>) throws
-        -> String?
-      {
-        let offset = MemoryLayout<mkcheck2_fat2_event>.offset(of: keyPath)!
-        return try UnsafeRawPointer(self).advanced(by: offset).withMemoryRebound(
-          to: mkcheck2_path_t.self, capacity: 1
-        ) { base -> String? in
-          return try base.readPathString()
-        }
-      }
-      return try (
-        readPathString(at: \.path.0), readPathString(at: \.path.1),
-        readPathString(at: \.path.2), readPathString(at: \.path.3)
-      )
+      let offset = MemoryLayout<mkcheck2_fat2_event>.offset(of: \.path_len)!
+      let paths = try readPathStrings(self, lengthsOffset: offset, count: 4)
+      return (paths[0], paths[1], paths[2], paths[3])
     }
   }
 
@@ -329,26 +627,24 @@ extension UnsafeMutablePointer where Pointee == mkcheck2_fat2_event {
   }
 }
 
-extension UnsafePointer where Pointee == mkcheck2_path_t {
+extension UnsafeRawBufferPointer {
+  /// Decode a path encoded as a sequence of NUL-terminated components
   func readPathString() throws -> String? {
-    guard self.pointee.0.0 != 0 else {
+    guard let first = self.first, first != 0 else {
       return nil
     }
-    return try self.withMemoryRebound(
-      to: CChar.self, capacity: Int(DEFAULT_SUB_BUF_LEN * DEFAULT_SUB_BUF_SIZE)
-    ) { base -> String? in
-      var buffer: [String] = []
-      for chunkIndex in 0..<Int(DEFAULT_SUB_BUF_LEN) {
-        let chunkBase = base.advanced(by: chunkIndex * Int(DEFAULT_SUB_BUF_SIZE))
-        guard chunkBase.pointee != 0 else { break }
-        guard let chunk = String(utf8String: chunkBase) else {
-          throw Mkcheck2Error("mkcheck2_path_t contains ill-formed UTF-8 string")
-        }
-        buffer.append(chunk)
+    var buffer: [String] = []
+    var start = startIndex
+    while start < endIndex, self[start] != 0 {
+      let end = self[start...].firstIndex(of: 0) ?? endIndex
+      guard let chunk = String(bytes: self[start..<end], encoding: .utf8) else {
+        throw Mkcheck2Error("Encoded path contains ill-formed UTF-8 string")
       }
-      // drop the first chunk which is the "/" root
-      return buffer.last! + buffer.dropLast().reversed().joined(separator: "/")
+      buffer.append(chunk)
+      start = end + 1
     }
+    // The last chunk is the "/" root, or "/.../" if the kernel cut a deep path
+    return buffer.last! + buffer.dropLast().reversed().joined(separator: "/")
   }
 }
 
@@ -382,6 +678,7 @@ extension mkcheck2_event_type: @retroactive CustomStringConvertible {
     case .eventTypeRenameAt: return "RENAMEAT"
     case .eventTypeSymlinkAt: return "SYMLINKAT"
     case .eventTypeExecAt: return "EXECAT"
+    case .eventTypeFileName: return "FILENAME"
     }
   }
 }
@@ -390,11 +687,13 @@ extension mkcheck2_error_type: @retroactive CustomStringConvertible {
   public var description: String {
     switch self {
     case .errorRingBufferFull: return "Ring buffer is full"
-    case .errorStagingEventFull: return "Staging event is full"
+    case .errorStagingEventFull: return "Failed to allocate staging event"
     case .errorStagingEventNotAllocated: return "Staging event is not allocated"
     case .errorReadUserStr: return "Failed to read user string"
     case .errorReadDentryStr: return "Failed to read dentry strings"
-    case .errorStagingConflict: return "Failed to stage event due to conflict"
+    case .errorStagingConflict: return "Stale staging event was overwritten"
+    case .errorProcessTableFull: return "Process table is full"
+    case .errorOpenFlagsStorage: return "Failed to allocate storage for open flags"
     }
   }
 }
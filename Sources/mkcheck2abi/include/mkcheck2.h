@@ -20,6 +20,14 @@
 #  define S_IFIFO 0010000
 #endif
 
+#ifndef S_IFMT
+#  define S_IFMT 00170000
+#endif
+
+#ifndef S_IFDIR
+#  define S_IFDIR 0040000
+#endif
+
 #ifndef MAP_SHARED
 #  define MAP_SHARED 0x01
 #endif
@@ -49,63 +57,119 @@ enum mkcheck2_event_type : int {
   kEventTypeRenameAt = 16,
   kEventTypeSymlinkAt = 17,
   kEventTypeExecAt = 18,
+  /// Announces the path of a file id. Sent as a `mkcheck2_event` carrying both
+  /// the path and the id, before any event referring to the id.
+  kEventTypeFileName = 19,
 } __attribute__((enum_extensibility(closed)));
 
-typedef char mkcheck2_path_t[DEFAULT_SUB_BUF_LEN][DEFAULT_SUB_BUF_SIZE];
+/// Max size of a single encoded path in bytes
+#define MKCHECK2_PATH_MAX_SIZE (DEFAULT_SUB_BUF_LEN * DEFAULT_SUB_BUF_SIZE)
 
 struct mkcheck2_event_header {
   int _type;
   pid_t pid;
   uint64_t uid;
   int source_line;
+  /// Size of the whole record in bytes, including the encoded paths that
+  /// follow the fixed-size part of the event.
+  __u32 size;
+  /// Global submission order of the record across ring buffer shards
+  __u64 seq;
+  /// The trace session the process belongs to
+  __u32 session;
+  /// The epoch of the session when the event was built, so that records of
+  /// a previous session with the same id are told apart
+  /// \see mkcheck2_session.epoch
+  __u32 epoch;
+  /// CLOCK_MONOTONIC time in nanoseconds when the event was built
+  __u64 timestamp;
+};
+
+/// Max number of ring buffer shards
+#define MKCHECK2_RING_SHARDS_MAX 64
+
+/// Max number of concurrent trace sessions. Session ids start at 1.
+#define MKCHECK2_SESSIONS_MAX 64
+
+/// The session id is stored in the upper bits of the process instance ids, so
+/// that processes of different sessions never share an id
+#define MKCHECK2_UID_SESSION_SHIFT 48
+
+/// A traced process, as stored in the process table of the BPF program
+struct mkcheck2_process_info {
+  /// Process identifier
+  pid_t parent;
+  /// The session the process belongs to, inherited from its parent
+  __u32 session;
+  /// Unique instance identifier
+  __u64 uid;
+};
+
+/// A trace session registered by userland
+struct mkcheck2_session {
+  /// The process whose exec starts the session, and which processes of the
+  /// session that lost their traced ancestors are attributed to in cgroup mode
+  __s32 root;
+  /// Bumped by userland whenever the session id is reused, so that the file
+  /// ids announced to the previous session are not referred to anymore
+  __u32 epoch;
+  /// The next file id to assign in the session. 0 is reserved for "no file id".
+  __u64 next_file_id;
 };
 
+// Paths are not stored inline. The encoded paths of an event are packed
+// back-to-back right after the fixed-size part of the event (i.e. at
+// `sizeof(struct mkcheck2_*event)`), and `path_len[i]` is the byte length of
+// the i-th encoded path, or 0 if the path is absent.
+//
+// An encoded path is a sequence of NUL-terminated components. A path read from
+// user space is a single component, while a path read from a dentry is stored
+// leaf first and ends with the root "/" component.
+
 struct mkcheck2_event {
   struct mkcheck2_event_header header;
   int payload;
-  mkcheck2_path_t path;
+  __u16 path_len[1];
+  /// Non-zero if the file is referred to by an id announced by a prior
+  /// kEventTypeFileName event instead of an inline path.
+  __u64 file_id;
 };
 
 struct mkcheck2_fat_event {
   struct mkcheck2_event_header header;
   int payload;
-  mkcheck2_path_t path[2];
+  __u16 path_len[2];
 };
 
 struct mkcheck2_fat2_event {
   struct mkcheck2_event_header header;
-  mkcheck2_path_t path[4];
+  __u16 path_len[4];
 };
 
-static inline void mkcheck2_path_clone(mkcheck2_path_t dst, const mkcheck2_path_t src) {
-  for (int i = 0; i < DEFAULT_SUB_BUF_LEN; i++) {
-    // Bulk copy for each 8-byte word.
-    for (int j = 0; j < DEFAULT_SUB_BUF_SIZE; j += 8) {
-      *(uint64_t *)(dst[i] + j) = *(uint64_t *)(src[i] + j);
-    }
-  }
-}
-
-static inline void mkcheck2_event_clone(struct mkcheck2_event *dst, const struct mkcheck2_event *src) {
-  dst->header = src->header;
-  mkcheck2_path_clone(dst->path, src->path);
-  dst->payload = src->payload;
-}
-
-static inline void mkcheck2_fat_event_clone(struct mkcheck2_fat_event *dst, const struct mkcheck2_fat_event *src) {
-  dst->header = src->header;
-  dst->payload = src->payload;
-  mkcheck2_path_clone(dst->path[0], src->path[0]);
-  mkcheck2_path_clone(dst->path[1], src->path[1]);
-}
-
-static inline void mkcheck2_fat2_event_clone(struct mkcheck2_fat2_event *dst, const struct mkcheck2_fat2_event *src) {
-  dst->header = src->header;
-  mkcheck2_path_clone(dst->path[0], src->path[0]);
-  mkcheck2_path_clone(dst->path[1], src->path[1]);
-  mkcheck2_path_clone(dst->path[2], src->path[2]);
-  mkcheck2_path_clone(dst->path[3], src->path[3]);
-}
+/// Resource usage of a process, read from its task_struct when its last
+/// thread exits. Covers every image the process executed.
+struct mkcheck2_rusage {
+  /// CPU time spent in user and kernel mode in nanoseconds
+  __u64 utime;
+  __u64 stime;
+  /// Max resident set size in pages
+  __u64 maxrss;
+  /// Voluntary and involuntary context switches
+  __u64 nvcsw;
+  __u64 nivcsw;
+  /// Bytes read from and written to the storage layer
+  __u64 read_bytes;
+  __u64 write_bytes;
+};
+
+/// Sent for kEventTypeExit
+struct mkcheck2_exit_event {
+  struct mkcheck2_event_header header;
+  /// The exit status of the process
+  int payload;
+  __u32 _pad;
+  struct mkcheck2_rusage usage;
+};
 
 enum mkcheck2_error_type : int {
   kErrorRingBufferFull = 1,
@@ -114,8 +178,78 @@ enum mkcheck2_error_type : int {
   kErrorReadUserStr = 4,
   kErrorReadDentryStr = 5,
   kErrorStagingConflict = 6,
+  kErrorProcessTableFull = 7,
+  kErrorOpenFlagsStorage = 8,
+} __attribute__((enum_extensibility(closed)));
+
+/// Upper bound of `enum mkcheck2_error_type` values
+#define MKCHECK2_ERROR_TYPE_MAX 16
+
+/// Verdict of the path prefix filter
+enum mkcheck2_path_filter_verdict : __u8 {
+  kPathFilterInclude = 1,
+  kPathFilterExclude = 2,
+} __attribute__((enum_extensibility(closed)));
+
+/// Max number of prefixes accepted by the path prefix filter
+#define MKCHECK2_PATH_FILTER_MAX 256
+
+/// Key identifying a directory by its kernel device number and inode number
+struct mkcheck2_path_filter_dir_key {
+  __u64 ino;
+  /// The device number in the kernel-internal encoding (MAJOR << 20 | MINOR)
+  __u32 dev;
+  __u32 _pad;
+};
+
+/// Diagnostic counters kept per CPU by the BPF program
+enum mkcheck2_counter_type : int {
+  /// An I/O event was dropped because the process already reported the file
+  kCounterDedupeHit = 0,
+  /// An I/O event was reported for the first time by the process
+  kCounterDedupeMiss = 1,
+} __attribute__((enum_extensibility(closed)));
+
+/// Upper bound of `enum mkcheck2_counter_type` values
+#define MKCHECK2_COUNTER_TYPE_MAX 16
+
+/// Max size of the name of a probe, including the NUL terminator
+#define MKCHECK2_PROBE_NAME_SIZE 32
+
+/// Statistics of a probe kept per CPU by the BPF program, if enabled
+struct mkcheck2_probe_stats {
+  /// The number of times the probe was hit
+  __u64 invocations;
+  /// Events dropped by the path prefix filter
+  __u64 filtered;
+  /// Events dropped because the process already reported the file
+  __u64 deduped;
+  /// Records written to the ring buffer
+  __u64 submitted;
+  /// Bytes written to the ring buffer
+  __u64 bytes;
+  /// Records dropped because the ring buffer was full
+  __u64 reserve_failures;
+  /// Staged events overwritten because the exit probe of the thread was missed
+  __u64 staging_conflicts;
+  /// The syscall or kernel function the probe is attached to, written by the
+  /// probe on its first hit on each CPU
+  char name[MKCHECK2_PROBE_NAME_SIZE];
+};
+
+/// Ids of the probes that are not syscall tracepoints. Syscall tracepoints are
+/// identified by their syscall number, which is always below these.
+enum mkcheck2_probe_id : int {
+  kProbeIdSchedProcessExit = 500,
+  kProbeIdFilePermission = 501,
+  kProbeIdMmapFile = 502,
+  kProbeIdDMove = 503,
+  kProbeIdDExchange = 504,
 } __attribute__((enum_extensibility(closed)));
 
+/// Upper bound of probe ids
+#define MKCHECK2_PROBE_ID_MAX 512
+
 struct mkcheck2_error {
   // XXX: Use of 'enum mkcheck2_error_type' leads invalid BTF type encoding
   // for some reason, so we use 'int' instead.
@@ -3,6 +3,7 @@
 #include "vmlinux.h"
 #include <bpf/bpf_core_read.h>
 #include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
 #include <linux/magic.h>
 #include <linux/major.h>
 
@@ -24,17 +25,225 @@
     }                                                                                                                  \
   } while (0)
 
-const volatile pid_t root_ppid = 0;
+/// Trace sessions indexed by session id, registered by userland. Slot 0 is
+/// unused as 0 means "no session".
+struct {
+  __uint(type, BPF_MAP_TYPE_ARRAY);
+  __uint(max_entries, MKCHECK2_SESSIONS_MAX);
+  __type(key, u32);
+  __type(value, struct mkcheck2_session);
+} sessions SEC(".maps");
+
+/// Session ids keyed by the pid of their root process, whose exec starts the
+/// session
+struct {
+  __uint(type, BPF_MAP_TYPE_HASH);
+  __uint(max_entries, MKCHECK2_SESSIONS_MAX);
+  __type(key, pid_t);
+  __type(value, u32);
+} session_roots SEC(".maps");
+
+/// Session ids keyed by the id of their cgroup, in cgroup mode
+struct {
+  __uint(type, BPF_MAP_TYPE_HASH);
+  __uint(max_entries, MKCHECK2_SESSIONS_MAX);
+  __type(key, u64);
+  __type(value, u32);
+} session_cgroups SEC(".maps");
+
+/// Whether only the tasks in `traced_cgroup` are traced. Set by userland before
+/// loading.
+const volatile bool cgroup_mode = false;
+
+/// The cgroup v2 that contains the cgroups of all sessions, set by userland
+struct {
+  __uint(type, BPF_MAP_TYPE_CGROUP_ARRAY);
+  __uint(max_entries, 1);
+  __type(key, u32);
+  __type(value, u32);
+} traced_cgroup SEC(".maps");
+
+/// Whether the current task may be traced. Checked first by every probe, so
+/// that tasks outside the cgroup return without any hash lookup.
+static inline bool in_traced_cgroup(void) {
+  // Returns 1 if under the cgroup (or a descendant), 0 if not, or an error if unset
+  return !cgroup_mode || bpf_current_task_under_cgroup(&traced_cgroup, 0) == 1;
+}
+
+/// The depth of the cgroups of the sessions below the cgroup root. Set by
+/// userland before loading.
+const volatile int session_cgroup_level = 1;
+
+/// Get the session of the cgroup of the current task, in cgroup mode
+/// \return The session id, or 0 if none
+static inline u32 current_cgroup_session(void) {
+  // The traced command may create cgroups of its own below the session's
+  u64 cgroup_id = bpf_get_current_ancestor_cgroup_id(session_cgroup_level);
+  u32 *session = bpf_map_lookup_elem(&session_cgroups, &cgroup_id);
+  return session ? *session : 0;
+}
 
 static inline u64 get_and_inc_next_uid(void) {
   static volatile u64 next_uid = 0;
   return __sync_fetch_and_add(&next_uid, 1);
 }
 
+/// Assign a unique instance identifier to a process image of the given session
+static inline u64 make_uid(u32 session) {
+  return ((u64)session << MKCHECK2_UID_SESSION_SHIFT) | get_and_inc_next_uid();
+}
+
+/// Whether per-probe statistics are collected. Set by userland before loading,
+/// so the accounting below is dead code for the verifier when disabled.
+const volatile bool stats_enabled = false;
+
+/// Per-CPU statistics indexed by probe id
+/// \see enum mkcheck2_probe_id
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, MKCHECK2_PROBE_ID_MAX);
+  __type(key, u32);
+  __type(value, struct mkcheck2_probe_stats);
+} probe_stats SEC(".maps");
+
+/// The id of the probe running on each CPU, so that the helpers shared by all
+/// probes can account to the right one
 struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, 1);
+  __type(key, u32);
+  __type(value, u32);
+} current_probe SEC(".maps");
+
+/// Make the given probe the current one of this CPU
+/// \return Its statistics, or NULL if disabled
+static inline struct mkcheck2_probe_stats *probe_stats_resume(u32 id) {
+  if (!stats_enabled)
+    return NULL;
+  u32 zero = 0;
+  u32 *current = bpf_map_lookup_elem(&current_probe, &zero);
+  if (current)
+    *current = id;
+  return bpf_map_lookup_elem(&probe_stats, &id);
+}
+
+/// Record a hit of the given probe and make it the current one of this CPU
+/// \param probe_name A string literal naming the probe in the statistics, so
+///                   that userland needs no table of its own
+#define probe_stats_enter(id, probe_name)                                                                              \
+  do {                                                                                                                 \
+    struct mkcheck2_probe_stats *__stats = probe_stats_resume(id);                                                     \
+    if (__stats) {                                                                                                     \
+      __stats->invocations += 1;                                                                                       \
+      if (__stats->name[0] == '\0') {                                                                                  \
+        const char __name[] = probe_name;                                                                              \
+        _Static_assert(sizeof(__name) <= sizeof(__stats->name), "Probe name is too long");                             \
+        __builtin_memcpy(__stats->name, __name, sizeof(__name));                                                       \
+      }                                                                                                                \
+    }                                                                                                                  \
+  } while (0)
+
+/// Get the statistics of the current probe of this CPU
+/// \return The statistics, or NULL if disabled
+static inline struct mkcheck2_probe_stats *probe_stats_current(void) {
+  if (!stats_enabled)
+    return NULL;
+  u32 zero = 0;
+  u32 *current = bpf_map_lookup_elem(&current_probe, &zero);
+  if (!current)
+    return NULL;
+  return bpf_map_lookup_elem(&probe_stats, current);
+}
+
+/// Increment a field of the statistics of the current probe
+#define probe_stats_count(field)                                                                                       \
+  do {                                                                                                                 \
+    struct mkcheck2_probe_stats *__stats = probe_stats_current();                                                      \
+    if (__stats)                                                                                                       \
+      __stats->field += 1;                                                                                             \
+  } while (0)
+
+/// Account a record written to the ring buffer by the current probe
+static inline void probe_stats_submitted(u64 size) {
+  struct mkcheck2_probe_stats *stats = probe_stats_current();
+  if (stats) {
+    stats->submitted += 1;
+    stats->bytes += size;
+  }
+}
+
+struct events_ringbuf {
   __uint(type, BPF_MAP_TYPE_RINGBUF);
   __uint(max_entries, 16 * 1024 * 1024 /* 16 MiB */);
-} events SEC(".maps");
+};
+
+/// The first ring buffer shard. The capacity is resized by userland before
+/// loading the program.
+struct events_ringbuf events SEC(".maps");
+
+/// Ring buffer shards indexed by CPU modulo `ring_shards`. The first one is
+/// `events` and the others are created by userland with the same capacity.
+struct {
+  __uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+  __uint(max_entries, MKCHECK2_RING_SHARDS_MAX);
+  __type(key, u32);
+  __array(values, struct events_ringbuf);
+} event_shards SEC(".maps") = {
+    .values = {[0] = &events},
+};
+
+/// The number of ring buffer shards in use. Set by userland before loading.
+const volatile u32 ring_shards = 1;
+
+/// The sequence number of the next record. Read by userland to merge shards.
+volatile u64 next_event_seq = 0;
+
+static inline u64 get_and_inc_next_event_seq(void) { return __sync_fetch_and_add(&next_event_seq, 1); }
+
+/// Get the ring buffer shard of the current CPU
+static inline void *current_ring(void) {
+  u32 key = ring_shards > 1 ? bpf_get_smp_processor_id() % ring_shards : 0;
+  return bpf_map_lookup_elem(&event_shards, &key);
+}
+
+/// Bytes pending in a shard from which userland is woken up on submit. If 0,
+/// the ring buffer decides by itself (i.e. on every submit unless userland is
+/// behind). Set by userland before loading.
+const volatile u64 ring_wakeup_threshold = 0;
+
+/// Wakeup flags for a record to submit to the given shard
+static inline u64 ring_wakeup_flags(void *ring) {
+  if (ring_wakeup_threshold == 0)
+    return 0;
+  if (bpf_ringbuf_query(ring, BPF_RB_AVAIL_DATA) >= ring_wakeup_threshold)
+    return BPF_RB_FORCE_WAKEUP;
+  // Userland polls with a timeout, so records below the threshold are not stuck
+  return BPF_RB_NO_WAKEUP;
+}
+
+/// Copy a record to the ring buffer shard of the current CPU
+/// \return 0 on success, negative error otherwise
+static inline long events_output(void *data, u64 size) {
+  void *ring = current_ring();
+  if (!ring)
+    return -1;
+  struct bpf_dynptr ptr;
+  // The record is reserved before it is numbered, so that userland sees it
+  // pending in the shard once its number is taken (see ShardedConsumer)
+  long err = bpf_ringbuf_reserve_dynptr(ring, size, 0, &ptr);
+  if (err == 0) {
+    ((struct mkcheck2_event_header *)data)->seq = get_and_inc_next_event_seq();
+    err = bpf_dynptr_write(&ptr, 0, data, size, 0);
+  }
+  if (err != 0) {
+    // Required even if the reservation failed
+    bpf_ringbuf_discard_dynptr(&ptr, 0);
+    return err;
+  }
+  bpf_ringbuf_submit_dynptr(&ptr, ring_wakeup_flags(ring));
+  probe_stats_submitted(size);
+  return 0;
+}
 
 /// Map for error reporting to userspace
 struct {
@@ -54,73 +263,140 @@ __attribute__((noinline)) static void __report_fatal_error(int type, int line) {
 
 #define report_fatal_error(type) __report_fatal_error(type, __LINE__)
 
-struct tracing_event_fingerprint {
-  u32 ino;
-  /// The type of the event that generated the fingerpr
-  /// \see enum mkcheck2_event_type
-  int type;
-};
+/// Map for counting non-fatal errors to userspace, indexed by error type
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, MKCHECK2_ERROR_TYPE_MAX);
+  __type(key, u32);
+  __type(value, u64);
+} error_counts SEC(".maps");
 
-#define TRACING_PROCESS_INFO_FINGERPRINTS 5
+__attribute__((noinline)) static void __report_error(int type, int line) {
+  u32 key = type;
+  u64 *count = bpf_map_lookup_elem(&error_counts, &key);
+  if (count)
+    *count += 1;
+  mkcheck2_debug("Non-fatal error: type=%d, line=%d", type, line);
+}
 
-struct tracing_process_info {
-  /// Process identifier
-  pid_t parent;
-  /// Unique instance identifier
-  u64 uid;
-  /// The index of the next fingerprint to insert
-  u32 fingerprint_index;
-  /// The fingerprints of the events that have been seen recently
-  struct tracing_event_fingerprint fingerprints[TRACING_PROCESS_INFO_FINGERPRINTS];
-};
+/// Report an error that drops the current event but does not stop tracing
+#define report_error(type) __report_error(type, __LINE__)
 
-static inline void tracing_process_info_init(struct tracing_process_info *pinfo, pid_t parent, u64 uid) {
-  *pinfo = (struct tracing_process_info){0};
-  pinfo->parent = parent;
-  pinfo->uid = uid;
+/// Whether dropping events on a full ring buffer is tolerated, instead of
+/// stopping tracing. Set by userland before loading.
+const volatile bool tolerate_drops = false;
 
-  pinfo->fingerprint_index = 0;
-  for (int i = 0; i < TRACING_PROCESS_INFO_FINGERPRINTS; i++) {
-    pinfo->fingerprints[i].ino = 0;
-    pinfo->fingerprints[i].type = 0;
-  }
+__attribute__((noinline)) static void __report_ring_buffer_full(int line) {
+  probe_stats_count(reserve_failures);
+  if (tolerate_drops)
+    __report_error(kErrorRingBufferFull, line);
+  else
+    __report_fatal_error(kErrorRingBufferFull, line);
 }
 
-/// Insert a given fingerprint to the process info
-/// \return true if the fingerprint was inserted, false if the fingerprint was
-/// already present.
-///
-/// If the fingerprints array is full, the oldest fingerprint is removed.
-static inline bool tracing_process_info_insert_fingerprint(struct tracing_process_info *pinfo, u32 ino,
-                                                           enum mkcheck2_event_type type) {
-  for (int i = 0; i < TRACING_PROCESS_INFO_FINGERPRINTS; i++) {
-    if (pinfo->fingerprints[i].ino == ino && pinfo->fingerprints[i].type == type) {
-      // The fingerprint is already present
-      return false;
-    }
-  }
+#define report_ring_buffer_full() __report_ring_buffer_full(__LINE__)
 
-  if (pinfo->fingerprint_index >= TRACING_PROCESS_INFO_FINGERPRINTS) {
-    pinfo->fingerprint_index = 0;
-  }
+/// Per-CPU counters for diagnostics
+/// \see enum mkcheck2_counter_type
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, MKCHECK2_COUNTER_TYPE_MAX);
+  __type(key, u32);
+  __type(value, u64);
+} counters SEC(".maps");
+
+static inline void count_event(enum mkcheck2_counter_type type) {
+  u32 key = type;
+  u64 *count = bpf_map_lookup_elem(&counters, &key);
+  if (count)
+    *count += 1;
+}
+
+static inline void tracing_process_info_init(struct mkcheck2_process_info *pinfo, pid_t parent, u32 session) {
+  *pinfo = (struct mkcheck2_process_info){0};
+  pinfo->parent = parent;
+  pinfo->session = session;
+  pinfo->uid = make_uid(session);
+}
 
-  // Insert the new fingerprint
-  pinfo->fingerprints[pinfo->fingerprint_index].ino = ino;
-  pinfo->fingerprints[pinfo->fingerprint_index].type = type;
-  pinfo->fingerprint_index++;
+struct seen_file_key {
+  /// The unique instance identifier of the process
+  u64 uid;
+  u64 ino;
+  u32 dev;
+  /// Tells apart the files that get the inode number of a deleted one, which
+  /// ext4 and tmpfs hand out again right away
+  u32 generation;
+  /// \see enum mkcheck2_event_type
+  int type;
+  u32 _pad;
+};
+
+/// Files already reported per process and event type
+///
+/// Keyed by the process instance uid, so a new image after exec starts from an
+/// empty set. Entries of exited processes are never looked up again and are
+/// left for the LRU to evict.
+struct {
+  __uint(type, BPF_MAP_TYPE_LRU_HASH);
+  __uint(max_entries, 262144);
+  __type(key, struct seen_file_key);
+  __type(value, u8);
+} seen_files SEC(".maps");
+
+/// Check whether the process has already reported the given file with the
+/// given type
+/// \param key Filled to be passed to `mark_file_seen_on_submit`
+/// \return true if this is the first report, false if it was already reported
+///
+/// The file is only marked as seen once the event is submitted, so that a
+/// failing syscall or a dropped event does not hide the next access. Threads
+/// of a process racing on the same file may then both report it, which
+/// userland merges.
+static inline bool is_first_file_report(u64 uid, const struct inode *inode, int type, struct seen_file_key *key) {
+  *key = (struct seen_file_key){
+      .uid = uid,
+      .ino = BPF_CORE_READ(inode, i_ino),
+      .dev = BPF_CORE_READ(inode, i_sb, s_dev),
+      .generation = BPF_CORE_READ(inode, i_generation),
+      .type = type,
+  };
+  if (bpf_map_lookup_elem(&seen_files, key)) {
+    count_event(kCounterDedupeHit);
+    probe_stats_count(deduped);
+    return false;
+  }
   return true;
 }
 
-// TODO: Replace with libbpf's hashmap.h
+/// Remember that the process has reported the given file
+static inline void mark_file_seen(struct seen_file_key *key) {
+  u8 seen = 1;
+  bpf_map_update_elem(&seen_files, key, &seen, BPF_ANY);
+  count_event(kCounterDedupeMiss);
+}
+
+/// Live traced processes keyed by pid. Entries are removed when the process
+/// exits. The capacity is resized by userland before loading the program.
 struct {
   __uint(type, BPF_MAP_TYPE_HASH);
   __uint(max_entries, 8192);
   __type(key, pid_t);
-  __type(value, struct tracing_process_info);
+  __type(value, struct mkcheck2_process_info);
 } tracing_pinfo SEC(".maps");
 
+/// Start tracing the given process
+/// \return true if the process is registered, false if the table is full
+static inline bool tracing_pinfo_insert(pid_t pid, struct mkcheck2_process_info *pinfo) {
+  if (bpf_map_update_elem(&tracing_pinfo, &pid, pinfo, BPF_ANY) != 0) {
+    report_error(kErrorProcessTableFull);
+    return false;
+  }
+  return true;
+}
+
 static inline bool is_tracing_pid(pid_t pid, u64 *uid) {
-  struct tracing_process_info *pinfo = bpf_map_lookup_elem(&tracing_pinfo, &pid);
+  struct mkcheck2_process_info *pinfo = bpf_map_lookup_elem(&tracing_pinfo, &pid);
   if (pinfo) {
     *uid = pinfo->uid;
     return true;
@@ -128,144 +404,525 @@ static inline bool is_tracing_pid(pid_t pid, u64 *uid) {
   return false;
 }
 
+/// Find the traced process the exec of the given process descends from
+/// \param session Filled with the session of the exec
+/// \return The pid of that process, or 0 if the exec is not traced
+///
+/// In cgroup mode, the cgroup decides instead of the ancestry. A process whose
+/// parent exited or daemonized is reparented to a process that is not traced,
+/// so its exec is attributed to the image it replaces if that is traced, or
+/// to the root of the session of its cgroup otherwise.
+static inline pid_t traced_exec_parent(pid_t pid, pid_t ppid, u32 *session) {
+  struct mkcheck2_process_info *parent = bpf_map_lookup_elem(&tracing_pinfo, &ppid);
+  if (parent) {
+    *session = parent->session;
+    return ppid;
+  }
+  u32 *root_session = bpf_map_lookup_elem(&session_roots, &pid);
+  if (root_session) {
+    *session = *root_session;
+    return ppid;
+  }
+  if (!cgroup_mode)
+    return 0;
+  struct mkcheck2_process_info *self = bpf_map_lookup_elem(&tracing_pinfo, &pid);
+  if (self) {
+    *session = self->session;
+    return pid;
+  }
+  u32 key = current_cgroup_session();
+  struct mkcheck2_session *info = bpf_map_lookup_elem(&sessions, &key);
+  if (key == 0 || !info || info->root == 0)
+    return 0;
+  *session = key;
+  return info->root;
+}
+
+/// Find the session of a process created by the given parent
+/// \return The session id, or 0 if the process is not traced
+static inline u32 traced_clone_session(pid_t ppid) {
+  struct mkcheck2_process_info *parent = bpf_map_lookup_elem(&tracing_pinfo, &ppid);
+  if (parent)
+    return parent->session;
+  // The root may fork before its first exec
+  u32 *root_session = bpf_map_lookup_elem(&session_roots, &ppid);
+  if (root_session)
+    return *root_session;
+  return cgroup_mode ? current_cgroup_session() : 0;
+}
+
 __attribute__((always_inline)) static inline void __init_event_header(pid_t pid, u64 uid, enum mkcheck2_event_type type,
                                                                       int line, struct mkcheck2_event_header *header) {
+  u32 session = uid >> MKCHECK2_UID_SESSION_SHIFT;
+  // Read when the event is built, so that an event staged by a process of a
+  // completed session keeps its epoch if the id is reused before it is flushed
+  struct mkcheck2_session *info = bpf_map_lookup_elem(&sessions, &session);
   header->pid = pid;
   header->uid = uid;
+  header->session = session;
+  header->epoch = info ? info->epoch : 0;
   header->_type = type;
   header->source_line = line;
+  header->timestamp = bpf_ktime_get_ns();
 }
 
 #define init_event_header(pid, uid, type, header) __init_event_header(pid, uid, type, __LINE__, header)
 
+/// Any kind of fixed-size event part
+union mkcheck2_any_event {
+  struct mkcheck2_event event;
+  struct mkcheck2_fat_event fat_event;
+  struct mkcheck2_fat2_event fat2_event;
+};
+
+/// Max number of paths carried by an event
+#define MKCHECK2_EVENT_MAX_PATHS 4
+#define MKCHECK2_STAGING_DATA_SIZE                                                                                     \
+  (sizeof(union mkcheck2_any_event) + MKCHECK2_EVENT_MAX_PATHS * MKCHECK2_PATH_MAX_SIZE)
+
+struct file_id_entry {
+  /// The id assigned to the path of the dentry
+  u64 id;
+  /// The parent of the dentry when the id was assigned
+  u64 parent;
+  /// The name hash and length of the dentry when the id was assigned
+  u64 name_hash_len;
+  /// The value of `path_generation` when the id was assigned
+  u64 generation;
+};
+
 struct mkcheck2_staging_event {
-  /// 0: struct mkcheck2_event
-  /// 1: struct mkcheck2_fat_event
-  /// 2: struct mkcheck2_fat2_event
-  char type_kind;
-  union {
-    struct mkcheck2_event event;
-    struct mkcheck2_fat_event fat_event;
-    struct mkcheck2_fat2_event fat2_event;
-  } u;
+  /// The number of bytes of `data` occupied by the event and its encoded paths
+  u64 size;
+  /// The dentry whose path is in `data` and is announced under a new id when
+  /// the event is submitted, or 0 if none
+  u64 announce_dentry;
+  /// The state of `announce_dentry` when its path was read
+  struct file_id_entry announce;
+  /// The file marked as seen by the process when the event is submitted, if
+  /// `mark_seen` is set
+  struct seen_file_key seen;
+  bool mark_seen;
+  /// The fixed-size part of the event immediately followed by its encoded paths
+  char data[MKCHECK2_STAGING_DATA_SIZE];
 };
-#define MKCHECK2_STAGING_EVENT_TYPE_EVENT 0
-#define MKCHECK2_STAGING_EVENT_TYPE_FAT_EVENT 1
-#define MKCHECK2_STAGING_EVENT_TYPE_FAT2_EVENT 2
 
+/// Get the staging event that contains the given event
+#define staging_event_of(event)                                                                                        \
+  ((struct mkcheck2_staging_event *)((char *)(event) - __builtin_offsetof(struct mkcheck2_staging_event, data)))
+
+/// Per-thread storage for the event being built between syscall enter and exit
+///
+/// A thread has at most one syscall in flight, so each thread owns a single
+/// staging slot that is lazily allocated on its first traced syscall and freed
+/// together with the task. `size == 0` means that no event is staged.
 struct {
-  __uint(type, BPF_MAP_TYPE_HASH);
-  __uint(max_entries, 8192);
-  __type(key, u64);
+  __uint(type, BPF_MAP_TYPE_TASK_STORAGE);
+  __uint(map_flags, BPF_F_NO_PREALLOC);
+  __type(key, int);
   __type(value, struct mkcheck2_staging_event);
 } staging_events SEC(".maps");
 
-static struct mkcheck2_staging_event *__staging_event_allocate_generic(void *staging_events_map, void *empty_event,
-                                                                       u64 pid_tgid, int line) {
-  struct mkcheck2_staging_event *event = NULL;
-  int ret = bpf_map_update_elem(staging_events_map, &pid_tgid, empty_event, BPF_NOEXIST);
-  if (ret != 0) {
-    event = bpf_map_lookup_elem(staging_events_map, &pid_tgid);
-#if DEBUG_LOG
-    if (event) {
-      struct mkcheck2_event_header *header;
-      switch (event->type_kind) {
-      case MKCHECK2_STAGING_EVENT_TYPE_EVENT:
-        header = &event->u.event.header;
-        break;
-      case MKCHECK2_STAGING_EVENT_TYPE_FAT_EVENT:
-        header = &event->u.fat_event.header;
-        break;
-      case MKCHECK2_STAGING_EVENT_TYPE_FAT2_EVENT:
-        header = &event->u.fat2_event.header;
-        break;
-      default:
-        header = NULL;
-        break;
-      }
-      mkcheck2_debug("Staging event conflict for pid=%d, type=%d, line=%d", header->pid, header->_type,
-                     header->source_line);
-    }
-#endif
-    int error_type = event ? kErrorStagingConflict : kErrorStagingEventFull;
-    __report_fatal_error(error_type, line);
-    return NULL;
-  }
-  event = bpf_map_lookup_elem(staging_events_map, &pid_tgid);
+/// Get the staging slot of the current thread
+static inline struct mkcheck2_staging_event *staging_event_lookup(u64 flags) {
+  return bpf_task_storage_get(&staging_events, bpf_get_current_task_btf(), NULL, flags);
+}
+
+static struct mkcheck2_staging_event *__staging_event_allocate_generic(u64 fixed_size, int line) {
+  struct mkcheck2_staging_event *event = staging_event_lookup(BPF_LOCAL_STORAGE_GET_F_CREATE);
   if (!event) {
-    // This should never happen but just in case
-    __report_fatal_error(kErrorStagingEventNotAllocated, line);
+    __report_error(kErrorStagingEventFull, line);
     return NULL;
   }
+  if (event->size != 0) {
+    // The exit probe of the previous syscall of this thread was missed, so the
+    // stale event is overwritten.
+#if DEBUG_LOG
+    struct mkcheck2_event_header *header = (struct mkcheck2_event_header *)event->data;
+    mkcheck2_debug("Staging event conflict for pid=%d, type=%d, line=%d", header->pid, header->_type,
+                   header->source_line);
+#endif
+    __report_error(kErrorStagingConflict, line);
+    probe_stats_count(staging_conflicts);
+  }
+  __builtin_memset(event->data, 0, sizeof(union mkcheck2_any_event));
+  event->announce_dentry = 0;
+  event->mark_seen = false;
+  // Encoded paths start right after the fixed-size part
+  event->size = fixed_size;
   return event;
 }
 
-/// Deallocate the staged event for the given pid
-static inline void staging_event_deallocate(u64 pid_tgid) { bpf_map_delete_elem(&staging_events, &pid_tgid); }
+/// Deallocate the given staged event
+#define staging_event_deallocate(event) (staging_event_of(event)->size = 0)
 
-static struct mkcheck2_event *__staging_event_allocate(u64 pid_tgid, int line) {
-  static struct mkcheck2_staging_event empty_event = {0};
-  struct mkcheck2_staging_event *event =
-      __staging_event_allocate_generic(&staging_events, &empty_event, pid_tgid, line);
+static struct mkcheck2_event *__staging_event_allocate(int line) {
+  struct mkcheck2_staging_event *event = __staging_event_allocate_generic(sizeof(struct mkcheck2_event), line);
   if (!event)
     return NULL;
-  event->type_kind = MKCHECK2_STAGING_EVENT_TYPE_EVENT;
-  return &event->u.event;
+  return (struct mkcheck2_event *)event->data;
 }
-/// Allocate an event for the given pid and stage it to be submitted later
-#define staging_event_allocate(pid) __staging_event_allocate(pid, __LINE__)
+/// Allocate an event for the current thread and stage it to be submitted later
+#define staging_event_allocate() __staging_event_allocate(__LINE__)
 
-static struct mkcheck2_fat_event *__staging_fat_event_allocate(u64 pid_tgid, int line) {
-  static struct mkcheck2_staging_event empty_event = {0};
-  struct mkcheck2_staging_event *event =
-      __staging_event_allocate_generic(&staging_events, &empty_event, pid_tgid, line);
+static struct mkcheck2_fat_event *__staging_fat_event_allocate(int line) {
+  struct mkcheck2_staging_event *event = __staging_event_allocate_generic(sizeof(struct mkcheck2_fat_event), line);
   if (!event)
     return NULL;
-  event->type_kind = MKCHECK2_STAGING_EVENT_TYPE_FAT_EVENT;
-  return &event->u.fat_event;
+  return (struct mkcheck2_fat_event *)event->data;
 }
-/// Allocate an event for the given pid and stage it to be submitted later
-#define staging_fat_event_allocate(pid) __staging_fat_event_allocate(pid, __LINE__)
+/// Allocate an event for the current thread and stage it to be submitted later
+#define staging_fat_event_allocate() __staging_fat_event_allocate(__LINE__)
 
-static struct mkcheck2_fat2_event *__staging_fat2_event_allocate(u64 pid_tgid, int line) {
-  static struct mkcheck2_staging_event empty_event = {0};
-  struct mkcheck2_staging_event *event =
-      __staging_event_allocate_generic(&staging_events, &empty_event, pid_tgid, line);
+static struct mkcheck2_fat2_event *__staging_fat2_event_allocate(int line) {
+  struct mkcheck2_staging_event *event = __staging_event_allocate_generic(sizeof(struct mkcheck2_fat2_event), line);
   if (!event)
     return NULL;
-  event->type_kind = MKCHECK2_STAGING_EVENT_TYPE_FAT2_EVENT;
-  return &event->u.fat2_event;
+  return (struct mkcheck2_fat2_event *)event->data;
+}
+/// Allocate an event for the current thread and stage it to be submitted later
+#define staging_fat2_event_allocate() __staging_fat2_event_allocate(__LINE__)
+
+/// Read a user-space string and append it as the next path of the staged event
+/// \return 0 on success, 1 on error
+__attribute__((always_inline)) static inline int read_user_path_string(void *event, __u16 *path_len,
+                                                                       const void *path) {
+  struct mkcheck2_staging_event *staging = staging_event_of(event);
+  u64 off = staging->size;
+  if (off > sizeof(staging->data) - MKCHECK2_PATH_MAX_SIZE)
+    return 1;
+  long len = bpf_core_read_user_str(staging->data + off, MKCHECK2_PATH_MAX_SIZE, path);
+  if (len < 0 || len > MKCHECK2_PATH_MAX_SIZE)
+    return 1;
+  staging->size = off + len;
+  *path_len = len;
+  return 0;
+}
+
+/// Bumped whenever a directory is moved by any process, traced or not.
+/// Moving a directory changes the path of every dentry below it, which cannot
+/// be detected by looking at the dentry itself, so all cached paths and
+/// announced ids are invalidated. A moved file changes its own parent or name,
+/// which the caches check.
+/// \see kprobe__d_move
+volatile u64 path_generation = 0;
+
+static inline void invalidate_paths(void) { __sync_fetch_and_add(&path_generation, 1); }
+
+/// Max number of components read by a single dentry walk. Prefixes cached by
+/// earlier walks count as a single component, so deeper paths are resolved
+/// once their ancestors have been visited.
+#define DENTRY_WALK_MAX 128
+
+struct dentry_path_key {
+  u64 dentry;
+  /// The mount the dentry was reached through, or 0 if mounts are not crossed
+  u64 mnt;
+};
+
+/// The encoded path of a directory, as produced by `read_dentry_strings`
+struct dentry_path_entry {
+  /// The parent and the name hash and length of the dentry when cached, to
+  /// detect a freed dentry whose memory was reused by another one
+  u64 parent;
+  u64 name_hash_len;
+  /// The value of `path_generation` when cached
+  u64 generation;
+  u32 len;
+  u32 _pad;
+  char data[MKCHECK2_PATH_MAX_SIZE];
+};
+
+/// Encoded paths of recently walked directories, so that files in the same
+/// directory share the walk of their parent
+struct {
+  __uint(type, BPF_MAP_TYPE_LRU_HASH);
+  __uint(max_entries, 1024);
+  __type(key, struct dentry_path_key);
+  __type(value, struct dentry_path_entry);
+} dentry_paths SEC(".maps");
+
+/// Scratch space for a new `dentry_paths` entry, which is too large for the BPF stack
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, 1);
+  __type(key, u32);
+  __type(value, struct dentry_path_entry);
+} dentry_path_scratch SEC(".maps");
+
+/// Look up the cached path of the given directory
+/// \return The entry, or NULL if not cached or stale
+static inline struct dentry_path_entry *dentry_path_lookup(struct dentry_path_key *key, struct dentry *dentry) {
+  struct dentry_path_entry *entry = bpf_map_lookup_elem(&dentry_paths, key);
+  if (!entry || entry->generation != path_generation || entry->parent != (u64)BPF_CORE_READ(dentry, d_parent) ||
+      entry->name_hash_len != BPF_CORE_READ(dentry, d_name.hash_len))
+    return NULL;
+  return entry;
+}
+
+/// Cache the path of the given directory, encoded in the `len` bytes at `data`
+/// \param generation The value of `path_generation` before the path was read,
+///                   so that a directory moved during the walk makes the entry
+///                   stale right away
+static inline void dentry_path_insert(struct dentry_path_key *key, struct dentry *dentry, const char *data, u64 len,
+                                      u64 generation) {
+  u32 zero = 0;
+  struct dentry_path_entry *entry = bpf_map_lookup_elem(&dentry_path_scratch, &zero);
+  if (!entry || len == 0 || len > sizeof(entry->data))
+    return;
+  if (bpf_probe_read_kernel(entry->data, len, data) != 0)
+    return;
+  entry->parent = (u64)BPF_CORE_READ(dentry, d_parent);
+  entry->name_hash_len = BPF_CORE_READ(dentry, d_name.hash_len);
+  entry->generation = generation;
+  entry->len = len;
+  bpf_map_update_elem(&dentry_paths, key, entry, BPF_ANY);
 }
-/// Allocate an event for the given pid and stage it to be submitted later
-#define staging_fat2_event_allocate(pid) __staging_fat2_event_allocate(pid, __LINE__)
 
-/// Read the dentry strings and store them in the buffer
+#ifndef container_of
+#  define container_of(ptr, type, member) ((type *)((char *)(ptr) - __builtin_offsetof(type, member)))
+#endif
+
+/// Read the path of the dentry reached through the given mount and append it
+/// as the next path of the staged event. Only the name and the parent of each
+/// dentry are read.
+/// \param vfsmnt The mount the dentry was reached through. If NULL, the walk
+///               stops at the root of the file system instead of crossing mounts.
 /// \return 0 on success, 1 on error
-static inline int read_dentry_strings(struct dentry *dtryp, char buf[DEFAULT_SUB_BUF_LEN][DEFAULT_SUB_BUF_SIZE]) {
-  struct dentry dtry;
-  struct dentry *lastdtryp = dtryp;
-
-  int i = 0;
-  if (buf) {
-    if (bpf_probe_read(&dtry, sizeof(struct dentry), dtryp) < 0)
-      goto err;
-    if (bpf_probe_read_str(buf[i], DEFAULT_SUB_BUF_SIZE, dtry.d_name.name) < 0)
-      goto err;
-    for (i = 1; i < DEFAULT_SUB_BUF_LEN; i++) {
-      if (dtry.d_parent != lastdtryp) {
-        lastdtryp = dtry.d_parent;
-        if (bpf_probe_read(&dtry, sizeof(struct dentry), dtry.d_parent) < 0)
-          goto err;
-        if (bpf_probe_read_str(buf[i], DEFAULT_SUB_BUF_SIZE, dtry.d_name.name) < 0)
-          goto err;
-      } else
+///
+/// The walk stops early at a directory whose path is cached, and the path of
+/// the parent of the dentry is cached in turn. If the walk runs out of
+/// components, the path is cut there and ends with "/.../" instead of "/".
+static inline int read_dentry_strings(struct dentry *dentry, struct vfsmount *vfsmnt, void *event,
+                                      __u16 *path_len) {
+  struct mkcheck2_staging_event *staging = staging_event_of(event);
+  struct mount *mnt = vfsmnt ? container_of(vfsmnt, struct mount, mnt) : NULL;
+  // Read before the walk, like `file_id_lookup` does
+  u64 generation = path_generation;
+  u64 start = staging->size;
+  u64 off = start;
+  bool done = false;
+  // The parent of the dentry, whose path is cached once the walk is done
+  struct dentry_path_key parent_key = {0};
+  struct dentry *parent_dentry = NULL;
+  u64 parent_start = 0;
+
+  for (int i = 0; i < DENTRY_WALK_MAX; i++) {
+    struct dentry *parent = BPF_CORE_READ(dentry, d_parent);
+    if (mnt && dentry == BPF_CORE_READ(mnt, mnt.mnt_root)) {
+      struct mount *mnt_parent = BPF_CORE_READ(mnt, mnt_parent);
+      if (mnt_parent != mnt) {
+        // Continue from the mountpoint, without the "/" name of the mount root
+        dentry = BPF_CORE_READ(mnt, mnt_mountpoint);
+        mnt = mnt_parent;
+        continue;
+      }
+      // The root of the mount namespace ends the path like the root of a file system
+      parent = dentry;
+    }
+
+    struct dentry_path_key key = {.dentry = (u64)dentry, .mnt = (u64)mnt};
+    if (off > start) {
+      struct dentry_path_entry *cached = dentry_path_lookup(&key, dentry);
+      if (cached) {
+        u64 len = cached->len;
+        if (off > sizeof(staging->data) - MKCHECK2_PATH_MAX_SIZE || len > MKCHECK2_PATH_MAX_SIZE ||
+            off - start + len > MKCHECK2_PATH_MAX_SIZE)
+          return 1;
+        if (bpf_probe_read_kernel(staging->data + off, len, cached->data) != 0)
+          return 1;
+        off += len;
+        done = true;
         break;
+      }
+      if (!parent_dentry) {
+        parent_key = key;
+        parent_dentry = dentry;
+        parent_start = off;
+      }
+    }
+
+    if (off > sizeof(staging->data) - DEFAULT_SUB_BUF_SIZE ||
+        off - start > MKCHECK2_PATH_MAX_SIZE - DEFAULT_SUB_BUF_SIZE)
+      return 1;
+    const unsigned char *name = BPF_CORE_READ(dentry, d_name.name);
+    long len = bpf_probe_read_kernel_str(staging->data + off, DEFAULT_SUB_BUF_SIZE, name);
+    if (len < 0 || len > DEFAULT_SUB_BUF_SIZE)
+      return 1;
+    off += len;
+    if (parent == dentry) {
+      done = true;
+      break;
     }
+    dentry = parent;
+  }
+
+  if (!done) {
+    const char truncated_root[] = "/.../";
+    if (off > sizeof(staging->data) - sizeof(truncated_root) ||
+        off - start > MKCHECK2_PATH_MAX_SIZE - sizeof(truncated_root))
+      return 1;
+    __builtin_memcpy(staging->data + off, truncated_root, sizeof(truncated_root));
+    off += sizeof(truncated_root);
+  } else if (parent_dentry && parent_start < off && off <= sizeof(staging->data)) {
+    dentry_path_insert(&parent_key, parent_dentry, staging->data + parent_start, off - parent_start, generation);
   }
+  staging->size = off;
+  *path_len = off - start;
   return 0;
-err:
-  return 1;
 }
+
+struct file_id_key {
+  u64 dentry;
+  /// Ids are announced to a single session
+  u32 session;
+  /// \see mkcheck2_session.epoch
+  u32 epoch;
+};
+
+/// Paths already announced to userland, keyed by dentry pointer and session
+struct {
+  __uint(type, BPF_MAP_TYPE_LRU_HASH);
+  __uint(max_entries, 65536);
+  __type(key, struct file_id_key);
+  __type(value, struct file_id_entry);
+} file_ids SEC(".maps");
+
+/// Fill the key of the given dentry in the given session
+/// \return false if the session is unknown
+static inline bool file_id_key_init(struct file_id_key *key, struct dentry *dentry, u32 session) {
+  struct mkcheck2_session *info = bpf_map_lookup_elem(&sessions, &session);
+  if (!info)
+    return false;
+  *key = (struct file_id_key){.dentry = (u64)dentry, .session = session, .epoch = info->epoch};
+  return true;
+}
+
+/// Assign a new file id in the given session
+/// \return The id, or 0 if the session is unknown
+static inline u64 get_and_inc_next_file_id(u32 session) {
+  struct mkcheck2_session *info = bpf_map_lookup_elem(&sessions, &session);
+  if (!info)
+    return 0;
+  return __sync_fetch_and_add(&info->next_file_id, 1);
+}
+
+/// Look up the id announced for the path of the given dentry
+/// \param entry Filled with the current state of the dentry to be passed to
+///              `announce_file_id_on_submit` on miss
+/// \return the announced id, or 0 if the path has not been announced or the
+///         announced path might be stale
+static inline u64 file_id_lookup(struct dentry *dentry, u32 session, struct file_id_entry *entry) {
+  struct file_id_key key;
+  if (!file_id_key_init(&key, dentry, session))
+    return 0;
+  entry->parent = (u64)BPF_CORE_READ(dentry, d_parent);
+  entry->name_hash_len = BPF_CORE_READ(dentry, d_name.hash_len);
+  entry->generation = path_generation;
+
+  struct file_id_entry *found = bpf_map_lookup_elem(&file_ids, &key);
+  if (!found || found->parent != entry->parent || found->name_hash_len != entry->name_hash_len ||
+      found->generation != entry->generation)
+    return 0;
+  return found->id;
+}
+
+/// Announce the path read into the staged event under a new file id once the
+/// event is submitted, i.e. only if its syscall succeeds
+/// \param entry The state of the dentry filled by `file_id_lookup`
+static inline void announce_file_id_on_submit(struct mkcheck2_event *event, struct dentry *dentry,
+                                              struct file_id_entry *entry) {
+  struct mkcheck2_staging_event *staging = staging_event_of(event);
+  staging->announce = *entry;
+  staging->announce_dentry = (u64)dentry;
+}
+
+/// Announce the path read into the given staged event under a new file id,
+/// and then strip the path from the staged event so that it refers to the id.
+///
+/// The announcement is sent as a separate kEventTypeFileName record right away
+/// and the id is published only after that, so any event referring to the id
+/// is ordered after the announcement in the ring buffer.
+///
+/// The id is trusted as long as the dentry keeps its parent and name and no
+/// directory was moved since, by any process.
+static inline void announce_file_id(struct mkcheck2_staging_event *staging) {
+  struct mkcheck2_event *event = (struct mkcheck2_event *)staging->data;
+  struct file_id_entry *entry = &staging->announce;
+  u64 size = staging->size;
+  if (size > sizeof(staging->data))
+    return;
+
+  int type = event->header._type;
+  entry->id = get_and_inc_next_file_id(event->header.session);
+  if (entry->id == 0)
+    return;
+  event->header._type = kEventTypeFileName;
+  event->header.size = size;
+  event->file_id = entry->id;
+  if (events_output(staging->data, size) != 0) {
+    // Keep the path inline
+    event->header._type = type;
+    event->file_id = 0;
+    return;
+  }
+
+  struct file_id_key key;
+  if (file_id_key_init(&key, (struct dentry *)staging->announce_dentry, event->header.session))
+    bpf_map_update_elem(&file_ids, &key, entry, BPF_ANY);
+  event->header._type = type;
+  event->path_len[0] = 0;
+  staging->size = sizeof(struct mkcheck2_event);
+}
+
+/// Whether any path prefix is configured. Set by userland before loading.
+const volatile bool path_filter_enabled = false;
+/// The verdict for paths matching no prefix. Set by userland before loading.
+const volatile u8 path_filter_default = kPathFilterInclude;
+
+/// The directories named by the prefixes to their verdicts
+struct {
+  __uint(type, BPF_MAP_TYPE_HASH);
+  __uint(max_entries, MKCHECK2_PATH_FILTER_MAX);
+  __type(key, struct mkcheck2_path_filter_dir_key);
+  __type(value, u8);
+} path_filter_dirs SEC(".maps");
+
+/// Only plain inputs and outputs are filtered. Exec, chdir and namespace
+/// changes are always reported as they affect how other events are resolved.
+static inline bool is_path_filtered_type(int type) { return type == kEventTypeInput || type == kEventTypeOutput; }
+
+/// Check the ancestry of a dentry against the prefix filter
+/// \return The verdict, or 0 if the ancestry is too deep to be walked, in
+///         which case the path is sent inline for userland to filter
+///
+/// The dentry itself or its nearest ancestor directory named by a prefix
+/// decides. Unlike `read_dentry_strings`, the walk stops at the root of the
+/// file system.
+///
+/// Only paths walked from dentries are filtered here. Paths read from user
+/// space may be relative or contain "..", "." and repeated slashes, so they
+/// are filtered by userland once normalized (see `PathFilter.allows`).
+static inline u8 path_filter_dentry(struct dentry *dentry) {
+  if (!path_filter_enabled)
+    return kPathFilterInclude;
+  for (int i = 0; i < DENTRY_WALK_MAX; i++) {
+    const struct inode *inode = BPF_CORE_READ(dentry, d_inode);
+    struct mkcheck2_path_filter_dir_key key = {
+        .ino = BPF_CORE_READ(inode, i_ino),
+        .dev = BPF_CORE_READ(inode, i_sb, s_dev),
+    };
+    u8 *verdict = bpf_map_lookup_elem(&path_filter_dirs, &key);
+    if (verdict)
+      return *verdict;
+    struct dentry *parent = BPF_CORE_READ(dentry, d_parent);
+    if (parent == dentry)
+      return path_filter_default;
+    dentry = parent;
+  }
+  return 0;
+}
+
 static inline unsigned imajor(const struct inode *inode) {
 // From linux/kdev_t.h
 #define MINORBITS 20
@@ -277,13 +934,11 @@ static inline unsigned imajor(const struct inode *inode) {
 #undef MAJOR
 }
 
-static inline struct dentry *get_tracing_dentry(int fd, const struct inode **inode_out) {
-  struct file **files;
-  struct file *file;
+/// Get the dentry of the given file, or NULL if the file is not worth tracing
+/// \param mnt_out Filled with the mount the file was opened through, if not NULL
+static inline struct dentry *get_tracing_file_dentry(struct file *file, const struct inode **inode_out,
+                                                     struct vfsmount **mnt_out) {
   struct path f_path;
-  struct task_struct *task = (struct task_struct *)bpf_get_current_task();
-  files = BPF_CORE_READ(task, files, fdt, fd);
-  bpf_core_read(&file, sizeof(struct file *), &files[fd]);
   bpf_core_read(&f_path, sizeof(struct path), &file->f_path);
   // Check if the file is under proc
   __le16 s_magic = BPF_CORE_READ(f_path.mnt, mnt_sb, s_magic);
@@ -295,6 +950,9 @@ static inline struct dentry *get_tracing_dentry(int fd, const struct inode **ino
   if (inode_out) {
     *inode_out = inode;
   }
+  if (mnt_out) {
+    *mnt_out = f_path.mnt;
+  }
 
   unsigned dev_major = imajor(inode);
   // Skip PTY devices
@@ -303,64 +961,88 @@ static inline struct dentry *get_tracing_dentry(int fd, const struct inode **ino
   return f_path.dentry;
 }
 
-/// Read the path strings from the given fd and store them in the event
+static inline struct dentry *get_tracing_dentry(int fd, const struct inode **inode_out, struct vfsmount **mnt_out) {
+  struct file **files;
+  struct file *file;
+  struct task_struct *task = (struct task_struct *)bpf_get_current_task();
+  files = BPF_CORE_READ(task, files, fdt, fd);
+  bpf_core_read(&file, sizeof(struct file *), &files[fd]);
+  return get_tracing_file_dentry(file, inode_out, mnt_out);
+}
+
+/// Read the path strings from the given fd and append them to the staged event
 /// \return 0 on success, 1 on error
-static inline int read_fd_path_strings(int fd, mkcheck2_path_t path) {
-  struct dentry *dentry = get_tracing_dentry(fd, NULL);
+static inline int read_fd_path_strings(int fd, void *event, __u16 *path_len) {
+  struct vfsmount *mnt = NULL;
+  struct dentry *dentry = get_tracing_dentry(fd, NULL, &mnt);
   if (!dentry)
     return 1;
-  return read_dentry_strings(dentry, path);
+  return read_dentry_strings(dentry, mnt, event, path_len);
+}
+
+/// Copy the event in the given slot to the ring buffer and release the slot
+/// \return true if the event was submitted
+static inline bool __staging_event_flush(struct mkcheck2_staging_event *event, int line) {
+  // Copy only the bytes actually used by the event to the ring buffer
+  u64 size = event->size;
+  event->size = 0;
+  if (size < sizeof(struct mkcheck2_event_header) || size > sizeof(event->data)) {
+    mkcheck2_debug("staging_event_flush: Broken event size %d", size);
+    return false;
+  }
+  ((struct mkcheck2_event_header *)event->data)->size = size;
+  if (events_output(event->data, size) != 0) {
+    __report_ring_buffer_full(line);
+    return false;
+  }
+  return true;
+}
+
+#define staging_event_flush(event) __staging_event_flush(event, __LINE__)
+
+/// Submit the event in the given slot after its syscall succeeded, announcing
+/// its path first and marking its file as seen afterwards if requested
+/// \return true if the event was submitted
+static inline bool __staging_event_submit(struct mkcheck2_staging_event *event, int line) {
+  if (event->announce_dentry != 0) {
+    announce_file_id(event);
+    event->announce_dentry = 0;
+  }
+  bool mark_seen = event->mark_seen;
+  event->mark_seen = false;
+  if (!__staging_event_flush(event, line))
+    return false;
+  if (mark_seen)
+    mark_file_seen(&event->seen);
+  return true;
 }
 
+#define staging_event_submit(event) __staging_event_submit(event, __LINE__)
+
 /// Submit the staged event to the ring buffer
 /// @return true if the event was submitted, false if the event was ignored
 __attribute__((always_inline)) static inline bool __probe_return(struct trace_event_raw_sys_exit *ctx) {
   mkcheck2_debug("probe_return[id=%d]: %d", ctx->id, ctx->ret);
   u64 pid_tgid = bpf_get_current_pid_tgid();
-  struct mkcheck2_staging_event *event = bpf_map_lookup_elem(&staging_events, &pid_tgid);
-  if (!event) {
+  struct mkcheck2_staging_event *event = staging_event_lookup(0);
+  if (!event || event->size == 0) {
     mkcheck2_debug("probe_return[id=%d]: No event for pid=%d", ctx->id, pid_tgid);
     return false;
   }
 
   if (ctx->ret < 0) {
     // Ignore the event if the syscall failed
-    bpf_map_delete_elem(&staging_events, &pid_tgid);
+    event->size = 0;
     mkcheck2_debug("probe_return[id=%d]: Ignoring event for pid=%d", ctx->id, pid_tgid);
     return false;
   }
 
-  // Copy the event to the ring buffer
-  void *rb_event = NULL;
-  if (event->type_kind == MKCHECK2_STAGING_EVENT_TYPE_EVENT) {
-    rb_event = bpf_ringbuf_reserve(&events, sizeof(struct mkcheck2_event), 0);
-    if (!rb_event)
-      goto buffer_full;
-    mkcheck2_event_clone(rb_event, &event->u.event);
-  } else if (event->type_kind == MKCHECK2_STAGING_EVENT_TYPE_FAT_EVENT) {
-    rb_event = bpf_ringbuf_reserve(&events, sizeof(struct mkcheck2_fat_event), 0);
-    if (!rb_event)
-      goto buffer_full;
-    mkcheck2_fat_event_clone(rb_event, &event->u.fat_event);
-  } else if (event->type_kind == MKCHECK2_STAGING_EVENT_TYPE_FAT2_EVENT) {
-    rb_event = bpf_ringbuf_reserve(&events, sizeof(struct mkcheck2_fat2_event), 0);
-    if (!rb_event)
-      goto buffer_full;
-    mkcheck2_fat2_event_clone(rb_event, &event->u.fat2_event);
-  } else {
-    mkcheck2_debug("probe_return[id=%d]: Unknown event type for pid=%d", ctx->id, pid_tgid);
+  if (!staging_event_submit(event)) {
+    mkcheck2_debug("probe_return[id=%d]: Failed to submit event for pid=%d", ctx->id, pid_tgid);
     return false;
   }
-
-  // Submit the event
-  bpf_ringbuf_submit(rb_event, 0);
-  bpf_map_delete_elem(&staging_events, &pid_tgid);
   mkcheck2_debug("probe_return[id=%d]: Submitted event for pid=%d", ctx->id, pid_tgid);
   return true;
-buffer_full:
-  report_fatal_error(kErrorRingBufferFull);
-  mkcheck2_debug("probe_return[id=%d]: Ring buffer full", ctx->id);
-  return false;
 }
 static inline int probe_return(struct trace_event_raw_sys_exit *ctx) {
   __probe_return(ctx);
@@ -369,11 +1051,19 @@ static inline int probe_return(struct trace_event_raw_sys_exit *ctx) {
 
 #define __TRACE_SYSCALL_ENTER_EXIT_EVENT(name, probe)                                                                  \
   SEC("tracepoint/syscalls/sys_exit_" #name)                                                                           \
-  int tracepoint__syscalls__sys_exit_##name(struct trace_event_raw_sys_exit *ctx) { return probe(ctx); }               \
+  int tracepoint__syscalls__sys_exit_##name(struct trace_event_raw_sys_exit *ctx) {                                    \
+    if (!in_traced_cgroup())                                                                                           \
+      return 0;                                                                                                        \
+    probe_stats_resume(ctx->id);                                                                                       \
+    return probe(ctx);                                                                                                 \
+  }                                                                                                                    \
   static inline int __tracepoint__syscalls__sys_enter_##name(struct trace_event_raw_sys_enter *ctx);                   \
   SEC("tracepoint/syscalls/sys_enter_" #name)                                                                          \
   int tracepoint__syscalls__sys_enter_##name(struct trace_event_raw_sys_enter *ctx) {                                  \
+    if (!in_traced_cgroup())                                                                                           \
+      return 0;                                                                                                        \
     mkcheck2_debug("probe_enter[id=%d]: %d pid=%d", ctx->id, ctx->args[0], bpf_get_current_pid_tgid() >> 32);          \
+    probe_stats_enter(ctx->id, #name);                                                                                 \
     return __tracepoint__syscalls__sys_enter_##name(ctx);                                                              \
   }                                                                                                                    \
   static inline int __tracepoint__syscalls__sys_enter_##name(struct trace_event_raw_sys_enter *ctx)
@@ -383,29 +1073,29 @@ TRACE_SYSCALL_ENTER_EXIT_EVENT(execve) {
   struct mkcheck2_event *event = NULL;
   struct task_struct *task;
   pid_t pid;
-  struct tracing_process_info pinfo;
+  struct mkcheck2_process_info pinfo;
 
   u64 pid_tgid = bpf_get_current_pid_tgid();
   pid = pid_tgid >> 32;
   task = (struct task_struct *)bpf_get_current_task();
-  pid_t ppid = (pid_t)BPF_CORE_READ(task, real_parent, tgid);
-
-  if (bpf_map_lookup_elem(&tracing_pinfo, &ppid) == NULL && pid != root_ppid)
+  u32 session = 0;
+  pid_t ppid = traced_exec_parent(pid, (pid_t)BPF_CORE_READ(task, real_parent, tgid), &session);
+  if (ppid == 0)
     return 0;
 
   mkcheck2_debug("execve[%d] ppid=%d", bpf_get_current_pid_tgid(), ppid);
 
   // Insert the pid to the tracing_pids map
-  tracing_process_info_init(&pinfo, ppid, get_and_inc_next_uid());
-  bpf_map_update_elem(&tracing_pinfo, &pid, &pinfo, BPF_ANY);
+  tracing_process_info_init(&pinfo, ppid, session);
+  if (!tracing_pinfo_insert(pid, &pinfo))
+    return 0;
 
   // Create an event and fill it
-  event = staging_event_allocate(pid_tgid);
+  event = staging_event_allocate();
   if (!event) {
-    report_fatal_error(kErrorRingBufferFull);
     return 0;
   }
-  if (bpf_core_read_user_str(event->path, sizeof(event->path), (const char *)ctx->args[0]) < 0)
+  if (read_user_path_string(event, &event->path_len[0], (const char *)ctx->args[0]) != 0)
     goto err;
 
   init_event_header(pid, pinfo.uid, kEventTypeExec, &event->header);
@@ -414,47 +1104,48 @@ TRACE_SYSCALL_ENTER_EXIT_EVENT(execve) {
   return 0;
 
 err:
-  staging_event_deallocate(pid_tgid);
+  staging_event_deallocate(event);
   report_fatal_error(kErrorReadUserStr);
   return 0;
 }
 
 __attribute__((always_inline)) static void __execveat_at_fdcwd(struct trace_event_raw_sys_enter *ctx,
-                                                               struct tracing_process_info pinfo, u64 pid_tgid,
+                                                               struct mkcheck2_process_info pinfo, u64 pid_tgid,
                                                                pid_t pid, pid_t ppid) {
   struct mkcheck2_event *event = NULL;
   // Create an event and fill it
-  event = staging_event_allocate(pid_tgid);
+  event = staging_event_allocate();
   if (!event) {
     return;
   }
-  if (bpf_core_read_user_str(event->path, sizeof(event->path), (const char *)ctx->args[1]) < 0)
+  if (read_user_path_string(event, &event->path_len[0], (const char *)ctx->args[1]) != 0)
     goto err;
 
   init_event_header(pid, pinfo.uid, kEventTypeExec, &event->header);
   event->payload = ppid;
   return;
 err:
-  staging_event_deallocate(pid_tgid);
+  staging_event_deallocate(event);
   report_fatal_error(kErrorReadUserStr);
 }
 
 TRACE_SYSCALL_ENTER_EXIT_EVENT(execveat) {
   struct task_struct *task;
   pid_t pid;
-  struct tracing_process_info pinfo;
+  struct mkcheck2_process_info pinfo;
 
   u64 pid_tgid = bpf_get_current_pid_tgid();
   pid = pid_tgid >> 32;
   task = (struct task_struct *)bpf_get_current_task();
-  pid_t ppid = (pid_t)BPF_CORE_READ(task, real_parent, tgid);
-
-  if (bpf_map_lookup_elem(&tracing_pinfo, &ppid) == NULL && pid != root_ppid)
+  u32 session = 0;
+  pid_t ppid = traced_exec_parent(pid, (pid_t)BPF_CORE_READ(task, real_parent, tgid), &session);
+  if (ppid == 0)
     return 0;
 
   // Insert the pid to the tracing_pids map
-  tracing_process_info_init(&pinfo, ppid, get_and_inc_next_uid());
-  bpf_map_update_elem(&tracing_pinfo, &pid, &pinfo, BPF_ANY);
+  tracing_process_info_init(&pinfo, ppid, session);
+  if (!tracing_pinfo_insert(pid, &pinfo))
+    return 0;
 
   int dfd = ctx->args[0];
   const char *path = (const char *)ctx->args[1];
@@ -465,24 +1156,24 @@ TRACE_SYSCALL_ENTER_EXIT_EVENT(execveat) {
   }
 
   const struct inode *inode = NULL;
-  struct dentry *dentry = get_tracing_dentry(dfd, &inode);
+  struct vfsmount *mnt = NULL;
+  struct dentry *dentry = get_tracing_dentry(dfd, &inode, &mnt);
   if (!dentry)
     return 0;
 
   struct mkcheck2_fat_event *event = NULL;
-  event = staging_fat_event_allocate(pid_tgid);
+  event = staging_fat_event_allocate();
   if (!event) {
-    report_fatal_error(kErrorRingBufferFull);
     return 0;
   }
 
-  if (read_dentry_strings(dentry, event->path[0]) != 0) {
-    staging_event_deallocate(pid_tgid);
+  if (read_dentry_strings(dentry, mnt, event, &event->path_len[0]) != 0) {
+    staging_event_deallocate(event);
     goto err;
   }
 
-  if (bpf_core_read_user_str(event->path[1], sizeof(event->path[1]), path) < 0) {
-    staging_event_deallocate(pid_tgid);
+  if (read_user_path_string(event, &event->path_len[1], path) != 0) {
+    staging_event_deallocate(event);
     goto err;
   }
 
@@ -492,7 +1183,7 @@ TRACE_SYSCALL_ENTER_EXIT_EVENT(execveat) {
 
   return 0;
 err:
-  staging_event_deallocate(pid_tgid);
+  staging_event_deallocate(event);
   return 0;
 }
 
@@ -501,6 +1192,9 @@ int tracepoint__syscalls__sys_exit_clone3(struct trace_event_raw_sys_exit *ctx)
   // NOTE: We trace only the exit event of the clone3 syscall raised by the child process.
   // This is because the subsequent events like execve raised by the child process might
   // be handled **before** the exit event of the clone3 syscall of the parent process.
+  if (!in_traced_cgroup())
+    return 0;
+  probe_stats_enter(ctx->id, "clone3");
   pid_t ret = ctx->ret;
   if (ret < 0 || ret != 0) {
     mkcheck2_debug("clone3[%d] skipped: ret=%d", pid, ret);
@@ -528,25 +1222,33 @@ int tracepoint__syscalls__sys_exit_clone3(struct trace_event_raw_sys_exit *ctx)
   mkcheck2_debug("clone3[%d] ppid=%d, tid=%d", pid, ppid, tid);
   mkcheck2_debug("clone3[%d] pid_tgid=%ld", pid, pid_tgid);
 
-  if (bpf_map_lookup_elem(&tracing_pinfo, &ppid) == NULL && ppid != root_ppid)
+  u32 session = traced_clone_session(ppid);
+  if (session == 0)
     return 0;
 
-  struct tracing_process_info pinfo;
+  struct mkcheck2_process_info pinfo;
   // Insert the pid to the tracing_pids map
-  tracing_process_info_init(&pinfo, ppid, get_and_inc_next_uid());
-  bpf_map_update_elem(&tracing_pinfo, &pid, &pinfo, BPF_ANY);
+  tracing_process_info_init(&pinfo, ppid, session);
+  if (!tracing_pinfo_insert(pid, &pinfo))
+    return 0;
 
   // Create an event and fill it
-  struct mkcheck2_event *event = bpf_ringbuf_reserve(&events, sizeof(*event), 0);
+  void *ring = current_ring();
+  struct mkcheck2_event *event = ring ? bpf_ringbuf_reserve(ring, sizeof(*event), 0) : NULL;
   if (!event) {
-    report_fatal_error(kErrorRingBufferFull);
+    report_ring_buffer_full();
     return 0;
   }
+  event->header.seq = get_and_inc_next_event_seq();
 
   init_event_header(pid, pinfo.uid, kEventTypeClone, &event->header);
+  event->header.size = sizeof(*event);
   event->payload = ppid;
+  event->path_len[0] = 0;
+  event->file_id = 0;
 
-  bpf_ringbuf_submit(event, 0);
+  bpf_ringbuf_submit(event, ring_wakeup_flags(ring));
+  probe_stats_submitted(sizeof(*event));
 
   return 0;
 }
@@ -561,55 +1263,114 @@ TRACE_SYSCALL_ENTER_EXIT_EVENT(chdir) {
   const void *path = (const void *)ctx->args[0];
   struct mkcheck2_event *event = NULL;
 
-  event = staging_event_allocate(pid_tgid);
+  event = staging_event_allocate();
   if (!event) {
-    report_fatal_error(kErrorRingBufferFull);
     return 0;
   }
-  if (bpf_core_read_user_str(event->path, sizeof(event->path), path) < 0)
+  if (read_user_path_string(event, &event->path_len[0], path) != 0)
     goto err;
 
   init_event_header(pid, uid, kEventTypeChdir, &event->header);
   return 0;
 err:
-  staging_event_deallocate(pid_tgid);
+  staging_event_deallocate(event);
   report_fatal_error(kErrorReadUserStr);
   return 0;
 }
 
-__attribute__((always_inline)) static inline void __submit_fd_event_with_dentry(struct tracing_process_info *pinfo,
+/// Check whether an event on the given file should be reported at all
+/// \param seen Filled to be passed to `mark_file_seen_on_submit`
+/// \param inline_path Set if the path has to be sent inline instead of by id,
+///                    for userland to filter it
+static inline bool should_submit_fd_event(struct mkcheck2_process_info *pinfo, struct dentry *dentry,
+                                          const struct inode *inode, int type, struct seen_file_key *seen,
+                                          bool *inline_path) {
+  *inline_path = false;
+  // A chdir changes the state of the process each time, e.g. fts walkers
+  // fchdir back into the directories they visited, so only inputs and outputs
+  // are deduped
+  if (!is_path_filtered_type(type)) {
+    seen->type = type;
+    return true;
+  }
+  if (!is_first_file_report(pinfo->uid, inode, type, seen))
+    return false;
+  umode_t mode = BPF_CORE_READ(inode, i_mode);
+  // Checked after dedupe so that the ancestry is walked once per process and
+  // file. Pipes have no path to filter by.
+  if (mode & S_IFIFO)
+    return true;
+  u8 verdict = path_filter_dentry(dentry);
+  if (verdict == 0)
+    *inline_path = true;
+  if (verdict != kPathFilterExclude)
+    return true;
+  probe_stats_count(filtered);
+  // The verdict does not depend on the syscall, so it is remembered right away
+  mark_file_seen(seen);
+  return false;
+}
+
+/// Mark the file of the staged event as seen by its process once the event is
+/// submitted
+static inline void mark_file_seen_on_submit(void *event, struct seen_file_key *seen) {
+  struct mkcheck2_staging_event *staging = staging_event_of(event);
+  staging->seen = *seen;
+  staging->mark_seen = is_path_filtered_type(seen->type);
+}
+
+/// Fill the fixed part of an event on the given file
+/// \param file_id Filled to be passed to `announce_file_id_on_submit`, or NULL
+///                to send the path inline without announcing it
+/// \return true if the path of the file is not announced yet and has to be
+///         appended to the event
+__attribute__((always_inline)) static inline bool __init_fd_event(struct mkcheck2_event *event, pid_t pid, u64 uid,
+                                                                  struct dentry *dentry, const struct inode *inode,
+                                                                  int type, int line,
+                                                                  struct file_id_entry *file_id) {
+  __init_event_header(pid, uid, type, line, &event->header);
+
+  // If it's fifo, use the inode number as the path
+  umode_t mode = BPF_CORE_READ(inode, i_mode);
+  if (mode & S_IFIFO) {
+    event->payload = BPF_CORE_READ(inode, i_ino);
+    return false;
+  }
+
+  // Refer to the file by id if its path has already been sent
+  event->file_id = file_id ? file_id_lookup(dentry, event->header.session, file_id) : 0;
+  return event->file_id == 0;
+}
+
+__attribute__((always_inline)) static inline void __submit_fd_event_with_dentry(struct mkcheck2_process_info *pinfo,
                                                                                 u64 pid_tgid, struct dentry *dentry,
+                                                                                struct vfsmount *mnt,
                                                                                 const struct inode *inode, int type,
                                                                                 int line) {
-  u32 ino = BPF_CORE_READ(inode, i_ino);
-  if (!tracing_process_info_insert_fingerprint(pinfo, ino, type)) {
-    // The fingerprint is already present
+  struct seen_file_key seen;
+  bool inline_path;
+  if (!should_submit_fd_event(pinfo, dentry, inode, type, &seen, &inline_path))
     return;
-  }
   pid_t pid = pid_tgid >> 32;
-  // Update the process info
-  bpf_map_update_elem(&tracing_pinfo, &pid, pinfo, BPF_ANY);
 
-  struct mkcheck2_event *event = __staging_event_allocate(pid_tgid, line);
+  struct mkcheck2_event *event = __staging_event_allocate(line);
   if (!event) {
     // __staging_event_allocate() already reported the error
     return;
   }
+  mark_file_seen_on_submit(event, &seen);
 
-  __init_event_header(pid, pinfo->uid, type, line, &event->header);
-
-  // If it's fifo, use the inode number as the path
-  umode_t mode = BPF_CORE_READ(inode, i_mode);
-  if (mode & S_IFIFO) {
-    event->payload = ino;
+  struct file_id_entry file_id;
+  if (!__init_fd_event(event, pid, pinfo->uid, dentry, inode, type, line, inline_path ? NULL : &file_id))
     return;
-  }
 
-  if (read_dentry_strings(dentry, event->path) != 0) {
-    staging_event_deallocate(pid_tgid);
+  if (read_dentry_strings(dentry, mnt, event, &event->path_len[0]) != 0) {
+    staging_event_deallocate(event);
     __report_fatal_error(kErrorReadDentryStr, line);
     return;
   }
+  if (!inline_path)
+    announce_file_id_on_submit(event, dentry, &file_id);
 
 #ifdef DEBUG
   if (type == kEventTypeOutput) {
@@ -618,13 +1379,14 @@ __attribute__((always_inline)) static inline void __submit_fd_event_with_dentry(
 #endif
 }
 
-static inline void __submit_fd_event_without_pid_check(struct tracing_process_info *pinfo, u64 pid_tgid, int fd,
+static inline void __submit_fd_event_without_pid_check(struct mkcheck2_process_info *pinfo, u64 pid_tgid, int fd,
                                                        int type, int line) {
   const struct inode *inode = NULL;
-  struct dentry *dentry = get_tracing_dentry(fd, &inode);
+  struct vfsmount *mnt = NULL;
+  struct dentry *dentry = get_tracing_dentry(fd, &inode, &mnt);
   if (!dentry)
     return;
-  return __submit_fd_event_with_dentry(pinfo, pid_tgid, dentry, inode, type, line);
+  return __submit_fd_event_with_dentry(pinfo, pid_tgid, dentry, mnt, inode, type, line);
 }
 
 static inline void __submit_fd_event(int fd, int type, int line) {
@@ -632,7 +1394,7 @@ static inline void __submit_fd_event(int fd, int type, int line) {
   pid_t pid = pid_tgid >> 32;
 
   // Check if the pid is in the tracing_pids map
-  struct tracing_process_info *pinfo = bpf_map_lookup_elem(&tracing_pinfo, &pid);
+  struct mkcheck2_process_info *pinfo = bpf_map_lookup_elem(&tracing_pinfo, &pid);
   if (!pinfo)
     return;
   return __submit_fd_event_without_pid_check(pinfo, pid_tgid, fd, type, line);
@@ -681,18 +1443,17 @@ static inline void __submit_path_event_without_pid_check(u64 pid_tgid, u64 uid,
                                                          enum mkcheck2_event_type type, int line) {
   pid_t pid = pid_tgid >> 32;
   struct mkcheck2_event *event = NULL;
-  event = staging_event_allocate(pid_tgid);
+  event = staging_event_allocate();
   if (!event) {
-    __report_fatal_error(kErrorRingBufferFull, line);
     return;
   }
-  if (bpf_core_read_user_str(event->path, sizeof(event->path), path) < 0)
+  if (read_user_path_string(event, &event->path_len[0], path) != 0)
     goto err;
 
   __init_event_header(pid, uid, type, line, &event->header);
   return;
 err:
-  staging_event_deallocate(pid_tgid);
+  staging_event_deallocate(event);
   __report_fatal_error(kErrorReadUserStr, line);
 }
 static inline void __submit_path_event(const void *path, enum mkcheck2_event_type type, int line) {
@@ -713,7 +1474,7 @@ static inline bool is_empty_string(const void *str) {
   return c == '\0';
 }
 
-static void __submit_path_at_event_without_pid_check(struct tracing_process_info *pinfo, u64 pid_tgid, int dfd,
+static void __submit_path_at_event_without_pid_check(struct mkcheck2_process_info *pinfo, u64 pid_tgid, int dfd,
                                                      const void *path, int type, int line) {
   if (dfd == AT_FDCWD) { // fast-path: no need to allocate buffer for base dirname
     __submit_path_event_without_pid_check(pid_tgid, pinfo->uid, path, kEventTypeInput,
@@ -722,28 +1483,28 @@ static void __submit_path_at_event_without_pid_check(struct tracing_process_info
   }
 
   const struct inode *inode = NULL;
-  struct dentry *dentry = get_tracing_dentry(dfd, &inode);
+  struct vfsmount *mnt = NULL;
+  struct dentry *dentry = get_tracing_dentry(dfd, &inode, &mnt);
   if (!dentry)
     return;
 
   if (is_empty_string(path)) { // fast-path: empty path is the same as dfd
-    return __submit_fd_event_with_dentry(pinfo, pid_tgid, dentry, inode, kEventTypeInput,
+    return __submit_fd_event_with_dentry(pinfo, pid_tgid, dentry, mnt, inode, kEventTypeInput,
                                          line); // TODO: type can be Output or other
   }
 
   struct mkcheck2_fat_event *event = NULL;
-  event = __staging_fat_event_allocate(pid_tgid, line);
+  event = __staging_fat_event_allocate(line);
   if (!event) {
-    __report_fatal_error(kErrorRingBufferFull, line);
     return;
   }
 
-  if (read_dentry_strings(dentry, event->path[0]) != 0) {
+  if (read_dentry_strings(dentry, mnt, event, &event->path_len[0]) != 0) {
     __report_fatal_error(kErrorReadDentryStr, line);
     goto err;
   }
 
-  if (bpf_core_read_user_str(event->path[1], sizeof(event->path[1]), path) < 0) {
+  if (read_user_path_string(event, &event->path_len[1], path) != 0) {
     __report_fatal_error(kErrorReadUserStr, line);
     goto err;
   }
@@ -752,7 +1513,7 @@ static void __submit_path_at_event_without_pid_check(struct tracing_process_info
   __init_event_header(pid, pinfo->uid, type, line, &event->header);
   return;
 err:
-  staging_event_deallocate(pid_tgid);
+  staging_event_deallocate(event);
 }
 
 static void __submit_path_at_event(struct trace_event_raw_sys_enter *ctx, int dfd, const void *path, int type,
@@ -761,7 +1522,7 @@ static void __submit_path_at_event(struct trace_event_raw_sys_enter *ctx, int df
   pid_t pid = pid_tgid >> 32;
   mkcheck2_debug("submit_path_at_event[id=%d]: pid=%d, path=%s", ctx->id, pid, (const char *)path);
 
-  struct tracing_process_info *pinfo = bpf_map_lookup_elem(&tracing_pinfo, &pid);
+  struct mkcheck2_process_info *pinfo = bpf_map_lookup_elem(&tracing_pinfo, &pid);
   if (!pinfo)
     return;
 
@@ -775,21 +1536,20 @@ static inline void __submit_fat_path_event_without_pid_check(u64 pid_tgid, u64 u
                                                              int line) {
   struct mkcheck2_fat_event *event = NULL;
   pid_t pid = pid_tgid >> 32;
-  event = __staging_fat_event_allocate(pid_tgid, line);
+  event = __staging_fat_event_allocate(line);
   if (!event) {
-    __report_fatal_error(kErrorRingBufferFull, line);
     return;
   }
-  if (bpf_core_read_user_str(event->path[0], sizeof(event->path[0]), path1) < 0)
+  if (read_user_path_string(event, &event->path_len[0], path1) != 0)
     goto err;
-  if (bpf_core_read_user_str(event->path[1], sizeof(event->path[1]), path2) < 0)
+  if (read_user_path_string(event, &event->path_len[1], path2) != 0)
     goto err;
 
   __init_event_header(pid, uid, type, line, &event->header);
   return;
 
 err:
-  staging_event_deallocate(pid_tgid);
+  staging_event_deallocate(event);
   __report_fatal_error(kErrorReadUserStr, line);
   return;
 }
@@ -816,26 +1576,25 @@ __attribute__((always_inline)) static inline void __submit_fd2_path2_at_event(st
     return;
 
   struct mkcheck2_fat2_event *event = NULL;
-  event = staging_fat2_event_allocate(pid_tgid);
+  event = staging_fat2_event_allocate();
   if (!event) {
-    __report_fatal_error(kErrorRingBufferFull, line);
     return;
   }
 
-  if (read_fd_path_strings(dfd1, event->path[0]) != 0) {
+  if (read_fd_path_strings(dfd1, event, &event->path_len[0]) != 0) {
     __report_fatal_error(kErrorReadDentryStr, line);
     goto err;
   }
-  if (read_fd_path_strings(dfd2, event->path[1]) != 0) {
+  if (read_fd_path_strings(dfd2, event, &event->path_len[1]) != 0) {
     __report_fatal_error(kErrorReadDentryStr, line);
     goto err;
   }
 
-  if (bpf_core_read_user_str(event->path[2], sizeof(event->path[2]), path1) < 0) {
+  if (read_user_path_string(event, &event->path_len[2], path1) != 0) {
     __report_fatal_error(kErrorReadUserStr, line);
     goto err;
   }
-  if (bpf_core_read_user_str(event->path[3], sizeof(event->path[3]), path2) < 0) {
+  if (read_user_path_string(event, &event->path_len[3], path2) != 0) {
     __report_fatal_error(kErrorReadUserStr, line);
     goto err;
   }
@@ -843,7 +1602,7 @@ __attribute__((always_inline)) static inline void __submit_fd2_path2_at_event(st
   __init_event_header(pid, uid, type, line, &event->header);
   return;
 err:
-  staging_event_deallocate(pid_tgid);
+  staging_event_deallocate(event);
 }
 
 #define submit_fd2_path2_at_event(dfd1, dfd2, path1, path2, type)                                                      \
@@ -859,22 +1618,21 @@ __attribute__((always_inline)) static inline void __submit_fd1_path2_at_event(st
     return;
 
   struct mkcheck2_fat2_event *event = NULL;
-  event = staging_fat2_event_allocate(pid_tgid);
+  event = staging_fat2_event_allocate();
   if (!event) {
-    __report_fatal_error(kErrorRingBufferFull, line);
     return;
   }
 
-  if (read_fd_path_strings(dfd, event->path[0]) != 0) {
+  if (read_fd_path_strings(dfd, event, &event->path_len[0]) != 0) {
     __report_fatal_error(kErrorReadDentryStr, line);
     goto err;
   }
 
-  if (bpf_core_read_user_str(event->path[1], sizeof(event->path[2]), path1) < 0) {
+  if (read_user_path_string(event, &event->path_len[1], path1) != 0) {
     __report_fatal_error(kErrorReadUserStr, line);
     goto err;
   }
-  if (bpf_core_read_user_str(event->path[2], sizeof(event->path[3]), path2) < 0) {
+  if (read_user_path_string(event, &event->path_len[2], path2) != 0) {
     __report_fatal_error(kErrorReadUserStr, line);
     goto err;
   }
@@ -882,7 +1640,7 @@ __attribute__((always_inline)) static inline void __submit_fd1_path2_at_event(st
   __init_event_header(pid, uid, type, line, &event->header);
   return;
 err:
-  staging_event_deallocate(pid_tgid);
+  staging_event_deallocate(event);
 }
 
 #define submit_fd1_path2_at_event(dfd, path1, path2, type)                                                             \
@@ -1030,12 +1788,312 @@ TRACE_SYSCALL_ENTER_EXIT_EVENT(symlinkat) {
   submit_fd1_path2_at_event(dfd, (const void *)ctx->args[0], (const void *)ctx->args[2], kEventTypeSymlinkAt);
   return 0;
 }
+// Open-time classification
+//
+// In this mode userland leaves the read and write families unattached and
+// files are reported when they are opened instead, classified by the open
+// flags. The file is resolved from the new fd at exit, so the reported path
+// is the one the kernel opened, and the per-process dedupe set is seeded as
+// with any fd event.
+
+#ifndef O_ACCMODE
+#  define O_ACCMODE 00000003
+#endif
+
+#ifndef O_RDONLY
+#  define O_RDONLY 00000000
+#endif
+
+#ifndef O_RDWR
+#  define O_RDWR 00000002
+#endif
+
+#ifndef O_CREAT
+#  define O_CREAT 00000100
+#endif
+
+#ifndef O_TRUNC
+#  define O_TRUNC 00001000
+#endif
+
+#ifndef O_PATH
+#  define O_PATH 010000000
+#endif
+
+struct pending_open {
+  /// Whether `flags` belongs to the open syscall in flight
+  bool valid;
+  u64 flags;
+};
+
+/// Per-thread flags of the open syscall in flight, kept from enter to exit
+struct {
+  __uint(type, BPF_MAP_TYPE_TASK_STORAGE);
+  __uint(map_flags, BPF_F_NO_PREALLOC);
+  __type(key, int);
+  __type(value, struct pending_open);
+} pending_opens SEC(".maps");
+
+static inline void stash_open_flags(u64 flags) {
+  u64 uid;
+  if (!is_tracing_pid(bpf_get_current_pid_tgid() >> 32, &uid))
+    return;
+  struct pending_open *pending =
+      bpf_task_storage_get(&pending_opens, bpf_get_current_task_btf(), NULL, BPF_LOCAL_STORAGE_GET_F_CREATE);
+  if (!pending) {
+    report_error(kErrorOpenFlagsStorage);
+    return;
+  }
+  pending->valid = true;
+  pending->flags = flags;
+}
+
+/// Classify an open by its flags
+/// \param input Set if the open may read the content of an existing file
+/// \param output Set if the open may write the content of the file
+static inline void open_event_types(u64 flags, bool *input, bool *output) {
+  *input = false;
+  *output = false;
+  if (flags & O_PATH)
+    return;
+  u64 mode = flags & O_ACCMODE;
+  if (mode == O_RDWR && !(flags & O_TRUNC)) {
+    // Updated in place, so the file is both read and written. O_CREAT keeps
+    // the content of an existing file.
+    *input = true;
+    *output = true;
+  } else if (mode != O_RDONLY || (flags & (O_CREAT | O_TRUNC))) {
+    *output = true;
+  } else {
+    *input = true;
+  }
+}
+
+/// Submit an event of the given type on the file just opened
+static inline void __submit_open_event(int fd, int type, int line) {
+  __submit_fd_event(fd, type, line);
+  struct mkcheck2_staging_event *event = staging_event_lookup(0);
+  if (event && event->size != 0)
+    __staging_event_submit(event, line);
+}
+
+#define submit_open_event(fd, type) __submit_open_event(fd, type, __LINE__)
+
+static inline int probe_open_return(struct trace_event_raw_sys_exit *ctx) {
+  struct pending_open *pending = bpf_task_storage_get(&pending_opens, bpf_get_current_task_btf(), NULL, 0);
+  if (!pending || !pending->valid)
+    return 0;
+  pending->valid = false;
+  if (ctx->ret < 0)
+    return 0;
+  bool input, output;
+  open_event_types(pending->flags, &input, &output);
+
+  // The syscall is already done, so submit the events right away
+  if (input)
+    submit_open_event(ctx->ret, kEventTypeInput);
+  if (output)
+    submit_open_event(ctx->ret, kEventTypeOutput);
+  return 0;
+}
+
+__TRACE_SYSCALL_ENTER_EXIT_EVENT(open, probe_open_return) {
+  stash_open_flags(ctx->args[1]);
+  return 0;
+}
+__TRACE_SYSCALL_ENTER_EXIT_EVENT(openat, probe_open_return) {
+  stash_open_flags(ctx->args[2]);
+  return 0;
+}
+__TRACE_SYSCALL_ENTER_EXIT_EVENT(openat2, probe_open_return) {
+  struct open_how *how = (struct open_how *)ctx->args[2];
+  u64 flags;
+  if (bpf_core_read_user(&flags, sizeof(flags), &how->flags) != 0)
+    return 0;
+  stash_open_flags(flags);
+  return 0;
+}
+
+// VFS backend
+//
+// fexit probes on the LSM hooks that every read, write and mmap of a file goes
+// through, whichever syscall started it. Unlike the syscall tracepoints they
+// also see io_uring, splice, sendfile and copy_file_range, and get the
+// `struct file` directly instead of looking up the fd table. Userland loads
+// them in place of the tracepoints of the fd-based I/O syscalls when this
+// backend is selected, and not at all otherwise.
+
+#ifndef FMODE_EXEC
+#  define FMODE_EXEC 0x20
+#endif
+
+#ifndef MAY_WRITE
+#  define MAY_WRITE 0x2
+#endif
+
+#ifndef MAY_READ
+#  define MAY_READ 0x4
+#endif
+
+/// Events of the fexit probes are built here and submitted right away. The
+/// staging slot of the thread cannot be used since the probes fire in the
+/// middle of syscalls whose own event may be staged there.
+struct {
+  __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+  __uint(max_entries, 1);
+  __type(key, u32);
+  __type(value, struct mkcheck2_staging_event);
+} scratch_events SEC(".maps");
+
+static inline struct mkcheck2_event *scratch_event_allocate(void) {
+  u32 zero = 0;
+  struct mkcheck2_staging_event *event = bpf_map_lookup_elem(&scratch_events, &zero);
+  if (!event)
+    return NULL;
+  __builtin_memset(event->data, 0, sizeof(struct mkcheck2_event));
+  event->announce_dentry = 0;
+  event->mark_seen = false;
+  event->size = sizeof(struct mkcheck2_event);
+  return (struct mkcheck2_event *)event->data;
+}
+
+static inline void __submit_file_event(struct file *file, int type, int line) {
+  u64 pid_tgid = bpf_get_current_pid_tgid();
+  pid_t pid = pid_tgid >> 32;
+  struct mkcheck2_process_info *pinfo = bpf_map_lookup_elem(&tracing_pinfo, &pid);
+  if (!pinfo)
+    return;
+
+  // The kernel reads and maps the executable and the interpreter during
+  // execve. They are already reported by the exec event.
+  if (BPF_CORE_READ(file, f_mode) & FMODE_EXEC)
+    return;
+
+  const struct inode *inode = NULL;
+  struct vfsmount *mnt = NULL;
+  struct dentry *dentry = get_tracing_file_dentry(file, &inode, &mnt);
+  if (!dentry)
+    return;
+  struct seen_file_key seen;
+  bool inline_path;
+  if (!should_submit_fd_event(pinfo, dentry, inode, type, &seen, &inline_path))
+    return;
+
+  struct mkcheck2_event *event = scratch_event_allocate();
+  if (!event)
+    return;
+  mark_file_seen_on_submit(event, &seen);
+
+  struct file_id_entry file_id;
+  if (__init_fd_event(event, pid, pinfo->uid, dentry, inode, type, line, inline_path ? NULL : &file_id)) {
+    // bpf_d_path is not allowed in every hook, e.g. security_mmap_file
+    if (read_dentry_strings(dentry, mnt, event, &event->path_len[0]) != 0) {
+      // Only this access is lost, and the next one is retried
+      __report_error(kErrorReadDentryStr, line);
+      return;
+    }
+    if (!inline_path)
+      announce_file_id_on_submit(event, dentry, &file_id);
+  }
+  __staging_event_submit(staging_event_of(event), line);
+}
+
+#define submit_file_event(file, type) __submit_file_event(file, type, __LINE__)
+
+/// Whether directory listings are reported as inputs. Set by userland before
+/// loading, so that the check is removed by the verifier when they are.
+const volatile bool trace_dir_listings = true;
+
+/// Called by rw_verify_area (read/write families, splice, sendfile,
+/// copy_file_range, io_uring), iterate_dir and vfs_fallocate
+SEC("fexit/security_file_permission")
+int BPF_PROG(fexit__security_file_permission, struct file *file, int mask, int ret) {
+  if (!in_traced_cgroup())
+    return 0;
+  probe_stats_enter(kProbeIdFilePermission, "security_file_permission");
+  if (ret != 0)
+    return 0;
+  // Directories cannot be read() from, so this is iterate_dir
+  if (!trace_dir_listings && (BPF_CORE_READ(file, f_inode, i_mode) & S_IFMT) == S_IFDIR)
+    return 0;
+  if (mask & MAY_WRITE)
+    submit_file_event(file, kEventTypeOutput);
+  else if (mask & MAY_READ)
+    submit_file_event(file, kEventTypeInput);
+  return 0;
+}
+
+SEC("fexit/security_mmap_file")
+int BPF_PROG(fexit__security_mmap_file, struct file *file, unsigned long prot, unsigned long flags, int ret) {
+  if (!in_traced_cgroup())
+    return 0;
+  probe_stats_enter(kProbeIdMmapFile, "security_mmap_file");
+  if (ret != 0 || !file)
+    return 0;
+  enum mkcheck2_event_type type = (flags & MAP_SHARED) && (prot & PROT_WRITE) ? kEventTypeOutput : kEventTypeInput;
+  submit_file_event(file, type);
+  return 0;
+}
+
+/// Whether the given dentry is a directory
+static inline bool is_dir_dentry(struct dentry *dentry) {
+  return (BPF_CORE_READ(dentry, d_inode, i_mode) & S_IFMT) == S_IFDIR;
+}
+
+/// Called by every rename, so that directories moved by processes that are not
+/// traced, or by a traced process before its syscall returns, invalidate the
+/// cached paths too
+SEC("kprobe/d_move")
+int BPF_KPROBE(kprobe__d_move, struct dentry *dentry, struct dentry *target) {
+  probe_stats_enter(kProbeIdDMove, "d_move");
+  if (is_dir_dentry(dentry))
+    invalidate_paths();
+  return 0;
+}
+
+/// Called by renames with RENAME_EXCHANGE, which move both dentries
+SEC("kprobe/d_exchange")
+int BPF_KPROBE(kprobe__d_exchange, struct dentry *dentry1, struct dentry *dentry2) {
+  probe_stats_enter(kProbeIdDExchange, "d_exchange");
+  if (is_dir_dentry(dentry1) || is_dir_dentry(dentry2))
+    invalidate_paths();
+  return 0;
+}
+
+/// Read the resource usage of the process of the exiting task. The counters of
+/// the threads that exited before are already summed up in `signal`, while the
+/// ones of the task itself are added only after the tracepoint.
+static void read_rusage(struct task_struct *task, struct mkcheck2_rusage *usage) {
+  struct signal_struct *signal = BPF_CORE_READ(task, signal);
+
+  usage->utime = BPF_CORE_READ(signal, utime) + BPF_CORE_READ(task, utime);
+  usage->stime = BPF_CORE_READ(signal, stime) + BPF_CORE_READ(task, stime);
+  // Updated from the mm right before the tracepoint when the last thread exits
+  usage->maxrss = BPF_CORE_READ(signal, maxrss);
+  usage->nvcsw = BPF_CORE_READ(signal, nvcsw) + BPF_CORE_READ(task, nvcsw);
+  usage->nivcsw = BPF_CORE_READ(signal, nivcsw) + BPF_CORE_READ(task, nivcsw);
+  // `ioac` comes with CONFIG_TASK_XACCT, but its storage counters only with
+  // CONFIG_TASK_IO_ACCOUNTING, so each field is checked on its own
+  if (bpf_core_field_exists(task->ioac.read_bytes))
+    usage->read_bytes = BPF_CORE_READ(signal, ioac.read_bytes) + BPF_CORE_READ(task, ioac.read_bytes);
+  else
+    usage->read_bytes = 0;
+  if (bpf_core_field_exists(task->ioac.write_bytes))
+    usage->write_bytes = BPF_CORE_READ(signal, ioac.write_bytes) + BPF_CORE_READ(task, ioac.write_bytes);
+  else
+    usage->write_bytes = 0;
+}
+
 SEC("tracepoint/sched/sched_process_exit")
 int sched_process_exit(struct trace_event_raw_sched_process_template *ctx) {
   pid_t pid;
-  struct mkcheck2_event *event = NULL;
+  struct mkcheck2_exit_event *event = NULL;
   struct task_struct *task;
 
+  if (!in_traced_cgroup())
+    return 0;
+  probe_stats_enter(kProbeIdSchedProcessExit, "sched_process_exit");
+
   pid = bpf_get_current_pid_tgid() >> 32;
   u64 uid;
 
@@ -1045,17 +2103,32 @@ int sched_process_exit(struct trace_event_raw_sched_process_template *ctx) {
 
   task = (struct task_struct *)bpf_get_current_task();
 
-  event = bpf_ringbuf_reserve(&events, sizeof(*event), 0);
+  // Ignore thread exits until the last thread of the process exits
+  if (BPF_CORE_READ(task, signal, live.counter) != 0)
+    return 0;
+
+  // Stop tracing the process so that the entry is not matched by a recycled
+  // pid. Sibling threads exiting concurrently can all see no live thread, so
+  // only the one that deletes the entry emits the exit.
+  if (bpf_map_delete_elem(&tracing_pinfo, &pid) != 0)
+    return 0;
+
+  void *ring = current_ring();
+  event = ring ? bpf_ringbuf_reserve(ring, sizeof(*event), 0) : NULL;
   if (!event) {
-    report_fatal_error(kErrorRingBufferFull);
+    report_ring_buffer_full();
     return 0;
   }
+  event->header.seq = get_and_inc_next_event_seq();
 
   init_event_header(pid, uid, kEventTypeExit, &event->header);
+  event->header.size = sizeof(*event);
   event->payload = BPF_CORE_READ(task, exit_code) >> 8;
-  event->path[0][0] = '\0';
+  event->_pad = 0;
+  read_rusage(task, &event->usage);
 
-  bpf_ringbuf_submit(event, 0);
+  bpf_ringbuf_submit(event, ring_wakeup_flags(ring));
+  probe_stats_submitted(sizeof(*event));
 
   return 0;
 }
@@ -4,10 +4,46 @@
 #  define _GNU_SOURCE // for execveat
 #endif
 
+#include <malloc.h>
 #include <unistd.h>
 
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
 static inline int swift_WSTOPSIG(int status) { return WSTOPSIG(status); }
 static inline int swift_WIFEXITED(int status) { return WIFEXITED(status); }
 static inline int swift_WEXITSTATUS(int status) { return WEXITSTATUS(status); }
+static inline int swift_pidfd_open(pid_t pid, unsigned int flags) { return (int)syscall(SYS_pidfd_open, pid, flags); }
+
+/// Get the number of bytes allocated with malloc and not freed yet
+static inline size_t swift_heap_in_use(void) {
+#if __GLIBC_PREREQ(2, 33)
+  struct mallinfo2 info = mallinfo2();
+#else
+  struct mallinfo info = mallinfo();
+#endif
+  return (size_t)info.uordblks + (size_t)info.hblkhd;
+}
+
+/// Get the peak resident set size of this process in bytes
+static inline long swift_peak_rss(void) {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+  return usage.ru_maxrss * 1024;
+}
+
+/// Get the process id and user id of the peer of a connected unix socket
+/// \return 0 on success, -1 with errno otherwise
+static inline int swift_peer_cred(int fd, pid_t *pid, uid_t *uid) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+    return -1;
+  *pid = cred.pid;
+  *uid = cred.uid;
+  return 0;
+}
@@ -0,0 +1,110 @@
+import Foundation
+import SystemPackage
+import Testing
+
+@testable import mkcheck2
+
+private let sample = DumpFormat(
+  files: [
+    Serialization.FileInfo(id: 1, name: "/usr/bin/cc", deleted: false, exists: true, deps: []),
+    Serialization.FileInfo(id: 2, name: "/src/main.c", deleted: false, exists: true, deps: []),
+    Serialization.FileInfo(id: 3, name: "/src/main.o", deleted: true, exists: false, deps: [4]),
+    Serialization.FileInfo(id: 4, name: "main.d", deleted: false, exists: true, deps: []),
+  ],
+  procs: [
+    Serialization.Process(uid: 1, parent: 0, image: 1, output: [], input: [], start: 10),
+    Serialization.Process(
+      uid: 2, parent: 1, image: 1, output: [3, 4], input: [2, 1], start: 20, end: 30,
+      firstInput: 21, lastOutput: 29,
+      usage: ResourceUsage(
+        userTime: 1, systemTime: 2, maxRSS: 3, voluntaryContextSwitches: 4,
+        involuntaryContextSwitches: 5, readBytes: 6, writeBytes: 7)),
+  ],
+  droppedEvents: 8)
+
+private func json(_ trace: DumpFormat) -> String {
+  var output = ""
+  trace.dump(output: &output)
+  return output
+}
+
+private func bytes(_ value: UInt64) -> [UInt8] {
+  withUnsafeBytes(of: value.littleEndian) { Array($0) }
+}
+
+/// Runs the body with the path of a file that is removed afterwards
+private func withTemporaryFile<T>(_ body: (String) throws -> T) rethrows -> T {
+  let path = FileManager.default.temporaryDirectory
+    .appendingPathComponent("mkcheck2-test-\(UUID().uuidString)").path
+  defer { try? FileManager.default.removeItem(atPath: path) }
+  return try body(path)
+}
+
+@Test func binaryTraceRoundTrips() throws {
+  try withTemporaryFile { path in
+    try BinaryTraceWriter.write(
+      files: sample.files, procs: sample.procs, droppedEvents: sample.droppedEvents, toFile: path)
+    let reader = try #require(try BinaryTraceReader(path: path))
+    #expect(reader.fileCount == 4)
+    #expect(reader.processCount == 2)
+    #expect(reader.droppedEvents == 8)
+    #expect(json(try reader.dumpFormat()) == json(sample))
+  }
+}
+
+@Test func binaryTraceWithoutDroppedEvents() throws {
+  try withTemporaryFile { path in
+    try BinaryTraceWriter.write(files: [], procs: [], droppedEvents: nil, toFile: path)
+    let trace = try DumpFormat.load(from: path)
+    #expect(trace.droppedEvents == nil)
+    #expect(trace.files.isEmpty)
+    #expect(trace.procs.isEmpty)
+  }
+}
+
+@Test func jsonTraceRoundTripsThroughBinary() throws {
+  try withTemporaryFile { jsonPath in
+    try withTemporaryFile { binaryPath in
+      var stream = try FileOutputStream(path: jsonPath)
+      sample.dump(output: &stream)
+      try stream.close()
+      #expect(try BinaryTraceReader(path: jsonPath) == nil)
+      let loaded = try DumpFormat.load(from: jsonPath)
+      #expect(json(loaded) == json(sample))
+
+      try BinaryTraceWriter.write(
+        files: loaded.files, procs: loaded.procs, droppedEvents: loaded.droppedEvents,
+        toFile: binaryPath)
+      #expect(json(try DumpFormat.load(from: binaryPath)) == json(sample))
+    }
+  }
+}
+
+@Test func binaryTraceRejectsMalformedFooter() throws {
+  try withTemporaryFile { path in
+    try BinaryTraceWriter.write(
+      files: sample.files, procs: sample.procs, droppedEvents: sample.droppedEvents, toFile: path)
+    let valid = try Data(contentsOf: URL(fileURLWithPath: path))
+    let trailer = valid.count - BinaryTrace.trailerSize
+
+    // The footer offset points past the end of the file
+    var corrupted = valid
+    corrupted.replaceSubrange(trailer..<trailer + 8, with: bytes(UInt64(valid.count)))
+    try corrupted.write(to: URL(fileURLWithPath: path))
+    #expect(throws: Mkcheck2Error.self) { _ = try BinaryTraceReader(path: path) }
+
+    // A section extends into the footer
+    let footer = valid.withUnsafeBytes {
+      Int(UInt64(littleEndian: $0.loadUnaligned(fromByteOffset: trailer, as: UInt64.self)))
+    }
+    corrupted = valid
+    // The length of the first section
+    corrupted.replaceSubrange(footer + 32..<footer + 40, with: bytes(UInt64.max))
+    try corrupted.write(to: URL(fileURLWithPath: path))
+    #expect(throws: Mkcheck2Error.self) { _ = try BinaryTraceReader(path: path) }
+
+    // The trailer is cut off
+    try valid.prefix(trailer + 4).write(to: URL(fileURLWithPath: path))
+    #expect(throws: Mkcheck2Error.self) { _ = try BinaryTraceReader(path: path) }
+  }
+}
@@ -0,0 +1,68 @@
+import Testing
+
+@testable import mkcheck2
+
+private let second: UInt64 = 1_000_000_000
+
+/// A trace of steps spawned by a single make process, which is not a step
+private func trace(_ steps: [Serialization.Process]) -> DumpFormat {
+  let make = Serialization.Process(uid: 1, parent: 0, image: 1, start: 0, end: 100 * second)
+  return DumpFormat(
+    files: [Serialization.FileInfo(id: 1, name: "/usr/bin/make")],
+    procs: [make] + steps)
+}
+
+private func step(
+  _ uid: UID, start: UInt64, end: UInt64, input: Set<FileID> = [], output: Set<FileID> = [],
+  firstInput: UInt64? = nil, lastOutput: UInt64? = nil
+) -> Serialization.Process {
+  Serialization.Process(
+    uid: uid, parent: 1, image: 1, output: output, input: input, start: start * second,
+    end: end * second, firstInput: firstInput.map { $0 * second },
+    lastOutput: lastOutput.map { $0 * second })
+}
+
+@Test func predecessorFinishedWritingBeforeTheRead() {
+  let schedule = BuildSchedule(
+    trace([
+      step(2, start: 0, end: 6, output: [10], lastOutput: 5),
+      // Started later, but wrote the file after the consumer read it
+      step(3, start: 1, end: 9, output: [10], lastOutput: 8),
+      step(4, start: 2, end: 10, input: [10], firstInput: 7),
+    ]))
+  #expect(schedule.steps.map(\.uid) == [2, 3, 4])
+  #expect(schedule.steps[2].predecessors == [0])
+}
+
+@Test func predecessorFallsBackToStartOrder() {
+  let schedule = BuildSchedule(
+    trace([
+      step(2, start: 0, end: 6, output: [10]),
+      step(3, start: 1, end: 9, output: [10]),
+      step(4, start: 2, end: 10, input: [10]),
+    ]))
+  #expect(schedule.steps[2].predecessors == [1])
+}
+
+@Test func predecessorNeverStartsAfterTheConsumer() {
+  let schedule = BuildSchedule(
+    trace([
+      step(2, start: 0, end: 10, input: [10], firstInput: 9),
+      step(3, start: 1, end: 5, output: [10], lastOutput: 4),
+    ]))
+  #expect(schedule.steps[0].predecessors.isEmpty)
+}
+
+@Test func criticalPathAndSlack() {
+  let schedule = BuildSchedule(
+    trace([
+      step(2, start: 0, end: 10, output: [10], lastOutput: 9),
+      step(3, start: 0, end: 5),
+      step(4, start: 10, end: 20, input: [10], firstInput: 11),
+    ]))
+  #expect(schedule.steps.map(\.uid) == [2, 3, 4])
+  #expect(schedule.criticalPath == [0, 2])
+  #expect(schedule.criticalPathLength == 20 * second)
+  #expect(schedule.steps.map(\.slack) == [0, 15 * second, 0])
+  #expect(schedule.wallTime == 100 * second)
+}
@@ -0,0 +1,140 @@
+import Foundation
+import SystemPackage
+import Testing
+import mkcheck2abi
+
+@testable import mkcheck2
+
+private let snapshot = """
+  PROCESS (image: /usr/bin/cc)
+    INPUT src/main.c
+    OUTPUT src/main.o
+  PROCESS (image: /usr/bin/ld)
+    INPUT src/main.o
+    OUTPUT main
+
+  """
+
+/// Runs the body with the path of a recording of `snapshot`, which is removed
+/// afterwards
+private func withRecording<T>(_ body: (String) throws -> T) throws -> T {
+  let base = FileManager.default.temporaryDirectory
+    .appendingPathComponent("mkcheck2-test-\(UUID().uuidString)").path
+  defer {
+    try? FileManager.default.removeItem(atPath: base + ".txt")
+    try? FileManager.default.removeItem(atPath: base + ".events")
+  }
+  try snapshot.write(toFile: base + ".txt", atomically: false, encoding: .utf8)
+  // The root exec, then clone, exec, input, output and exit of each process, then the root exit
+  #expect(try SnapshotBuild(path: base + ".txt").write(to: base + ".events") == 12)
+  return try body(base + ".events")
+}
+
+private func rewrite(_ path: String, _ change: (inout Data) -> Void) throws {
+  var data = try Data(contentsOf: URL(fileURLWithPath: path))
+  change(&data)
+  try data.write(to: URL(fileURLWithPath: path))
+}
+
+private func process(_ trace: Trace, image: String) -> Trace.Process? {
+  trace.procs.values.first {
+    trace.fileInfos.name(of: $0.image) == FilePath(SyntheticBuild.prefix + image)
+  }
+}
+
+private func names(_ ids: Set<FileID>, _ trace: Trace) -> Set<FilePath> {
+  Set(ids.map { trace.fileInfos.name(of: $0) })
+}
+
+@Test func recordingReplays() throws {
+  try withRecording { path in
+    let recording = try EventRecording(path: path)
+    #expect(recording.root == 1000)
+    #expect(recording.cwd == FilePath(SyntheticBuild.prefix + "/mkcheck2"))
+
+    let trace = try recording.replay()
+    #expect(trace.rootExitCode == 0)
+    #expect(trace.droppedEvents == 0)
+    let project = FilePath(SyntheticBuild.prefix + "/mkcheck2")
+    let cc = try #require(process(trace, image: "/usr/bin/cc"))
+    #expect(names(cc.inputs, trace).contains(project.appending("src/main.c")))
+    #expect(names(cc.outputs, trace).contains(project.appending("src/main.o")))
+    let ld = try #require(process(trace, image: "/usr/bin/ld"))
+    #expect(names(ld.inputs, trace).contains(project.appending("src/main.o")))
+    #expect(names(ld.outputs, trace).contains(project.appending("main")))
+  }
+}
+
+@Test func truncatedRecordingIsOnlyReplayedOnRequest() throws {
+  try withRecording { path in
+    // Cut in the middle of the exit record of the root, right before the trailer
+    try rewrite(path) { $0.removeLast(16 + 8) }
+    let recording = try EventRecording(path: path)
+    #expect(throws: Mkcheck2Error.self) { _ = try recording.replay() }
+
+    let trace = try recording.replay(allowTruncated: true)
+    #expect(trace.rootExitCode == nil)
+    #expect(process(trace, image: "/usr/bin/ld") != nil)
+  }
+}
+
+@Test func recordingOfAnotherLayoutIsRejected() throws {
+  try withRecording { path in
+    // The layout fingerprint
+    try rewrite(path) { $0[12] ^= 0xFF }
+    #expect(throws: Mkcheck2Error.self) { _ = try EventRecording(path: path) }
+  }
+}
+
+@Test func recordingOfAnotherVersionIsRejected() throws {
+  try withRecording { path in
+    try rewrite(path) { $0[8] &+= 1 }
+    #expect(throws: Mkcheck2Error.self) { _ = try EventRecording(path: path) }
+  }
+}
+
+/// Runs the body with the path of a recording of the root exec followed by
+/// the given records
+private func withRecording<T>(
+  of records: (inout EventRecordBuilder, EventRecordBuilder.Process) -> [[UInt8]],
+  _ body: (String) throws -> T
+) throws -> T {
+  let path = FileManager.default.temporaryDirectory
+    .appendingPathComponent("mkcheck2-test-\(UUID().uuidString).events").path
+  defer { try? FileManager.default.removeItem(atPath: path) }
+  var builder = EventRecordBuilder()
+  let root = EventRecordBuilder.Process(pid: 1000, uid: 1)
+  let recorder = try EventRecorder(path: path, root: root.pid, selfPid: 999, cwd: "/")
+  recorder.append(builder.event(.eventTypeExec, root, payload: 999, path: "/usr/bin/bash"))
+  for record in records(&builder, root) {
+    recorder.append(record)
+  }
+  try recorder.finish(exitCode: 0, droppedEvents: 0)
+  return try body(path)
+}
+
+@Test func malformedRecordIsRejected() throws {
+  // Shorter than a header
+  try withRecording(of: { _, _ in [[1, 2, 3, 4]] }) { path in
+    #expect(throws: Mkcheck2Error.self) { _ = try EventRecording(path: path).replay() }
+  }
+  // An exit event cut after its header
+  try withRecording(of: { builder, root in
+    let exit = builder.exit(root, status: 0, usage: mkcheck2_rusage())
+    var record = Array(exit.prefix(MemoryLayout<mkcheck2_event_header>.size))
+    record.withUnsafeMutableBytes {
+      $0.storeBytes(
+        of: UInt32($0.count), toByteOffset: MemoryLayout<mkcheck2_event_header>.offset(of: \.size)!,
+        as: UInt32.self)
+    }
+    return [record]
+  }) { path in
+    #expect(throws: Mkcheck2Error.self) { _ = try EventRecording(path: path).replay() }
+  }
+  // A rename without its source
+  try withRecording(of: { builder, root in
+    [builder.fatEvent(.eventTypeRename, root, paths: ["", "/tmp/b"])]
+  }) { path in
+    #expect(throws: Mkcheck2Error.self) { _ = try EventRecording(path: path).replay() }
+  }
+}
@@ -0,0 +1,84 @@
+import Foundation
+import SystemPackage
+import Testing
+
+@testable import mkcheck2
+
+@Test func pathTableRoundTrips() {
+  var table = PathTable()
+  for path: FilePath in ["/", "/usr/bin/cc", "/usr/include/stdio.h", "src/main.c", "main.c"] {
+    #expect(table.path(of: table.intern(path)) == path)
+  }
+}
+
+@Test func pathTableSharesPrefixes() {
+  var table = PathTable()
+  let cc = table.intern("/usr/bin/cc")
+  let count = table.count
+  let ld = table.intern("/usr/bin/ld")
+  // Only the last component is new
+  #expect(table.count == count + 1)
+  #expect(table.parent(of: cc) == table.parent(of: ld))
+  #expect(table.intern("/usr/bin/cc") == cc)
+  #expect(table.intern("//usr///bin/cc") == cc)
+  #expect(table.count == count + 1)
+}
+
+@Test func pathTableKeepsRelativePathsApart() {
+  var table = PathTable()
+  #expect(table.intern("/") == PathTable.root)
+  let absolute = table.intern("/main.c")
+  let relative = table.intern("main.c")
+  #expect(absolute != relative)
+  #expect(table.parent(of: absolute) == PathTable.root)
+  #expect(table.parent(of: relative) == PathTable.relativeRoot)
+  #expect(table.parent(of: PathTable.root) == PathTable.root)
+}
+
+@Test func pathTableKeepsBytesThatAreNotUTF8() {
+  var table = PathTable()
+  let path = FilePath(platformBytes: Array("/tmp/".utf8) + [0xFF, 0xFE] + Array(".o".utf8))
+  let rebuilt = table.path(of: table.intern(path))
+  #expect(rebuilt == path)
+  rebuilt.withPlatformString { cString in
+    #expect(strlen(cString) == 9)
+    #expect(UInt8(bitPattern: cString[5]) == 0xFF)
+  }
+}
+
+@Test func pathTableGrows() {
+  var table = PathTable()
+  let nodes = (0..<5000).map { table.intern(FilePath("/dir\($0 % 10)/file\($0)")) }
+  for (index, node) in nodes.enumerated() {
+    #expect(table.path(of: node) == FilePath("/dir\(index % 10)/file\(index)"))
+  }
+}
+
+@Test func fileTableFindsFiles() {
+  var files = FileTable()
+  let id = files.find("/src/main.c")
+  #expect(id == 1)
+  #expect(files.find("/src/main.c") == id)
+  #expect(files.name(of: id) == "/src/main.c")
+  #expect(files.ids == 1..<2)
+  // Ancestors get an id only once looked up
+  let parent = files.parent(of: id)
+  #expect(parent == 2)
+  #expect(files.name(of: parent) == "/src")
+  #expect(files.find("/src") == parent)
+  #expect(files[3] == nil)
+}
+
+@Test func fileTableMarksDeletedFiles() throws {
+  var files = FileTable()
+  let id = files.find("/tmp/a.o")
+  let dependency = files.find("/tmp/a.c")
+  files.addDependency(from: id, to: dependency)
+  files.markDeleted(id)
+  let info = try #require(files[id])
+  #expect(info.name == "/tmp/a.o")
+  #expect(info.deleted)
+  #expect(!info.exists)
+  #expect(info.deps == [dependency])
+  #expect(files[dependency]?.deleted == false)
+}
@@ -0,0 +1,33 @@
+import Testing
+
+@testable import mkcheck2
+
+private func records(_ seqs: [UInt64]) -> [ShardedConsumer.Record] {
+  seqs.map { ShardedConsumer.Record(seq: $0, bytes: [UInt8(truncatingIfNeeded: $0)]) }
+}
+
+@Test func reorderBufferReleasesInSequenceOrder() {
+  var buffer = ReorderBuffer()
+  // Two shards drained independently, each in order
+  buffer.insert(records([1, 4, 5]))
+  buffer.insert(records([2, 3, 7]))
+  #expect(buffer.release(below: 4).map(\.seq) == [1, 2, 3])
+  #expect(buffer.count == 3)
+  #expect(buffer.release(below: 4).isEmpty)
+}
+
+@Test func reorderBufferHoldsRecordsAtTheWatermark() {
+  var buffer = ReorderBuffer()
+  buffer.insert(records([5, 7]))
+  // A shard still writing record 6 keeps the watermark at 6
+  #expect(buffer.release(below: 6).map(\.seq) == [5])
+  buffer.insert(records([6]))
+  #expect(buffer.release(below: .max).map(\.seq) == [6, 7])
+  #expect(buffer.count == 0)
+}
+
+@Test func reorderBufferKeepsRecordBytes() {
+  var buffer = ReorderBuffer()
+  buffer.insert(records([2, 1]))
+  #expect(buffer.release(below: .max).map(\.bytes) == [[1], [2]])
+}
@@ -0,0 +1,61 @@
+import Foundation
+import SystemPackage
+import Testing
+
+@testable import mkcheck2
+
+/// A directory no machine has, so that lookups that miss the cache find nothing
+private let missing: FilePath = "/nonexistent-mkcheck2-test"
+
+@Test func symlinkIsReadOnceAndCached() throws {
+  var template = Array("/tmp/mkcheck2-test-XXXXXX".utf8CString)
+  let directory = try #require(mkdtemp(&template).map { FilePath(platformString: $0) })
+  defer { try? FileManager.default.removeItem(atPath: directory.string) }
+  let link = directory.appending("link")
+  #expect(symlink("target", link.string) == 0)
+
+  let cache = SymlinkCache()
+  #expect(cache.destination(of: link) == "target")
+  #expect(cache.resolve(link) == directory.appending("target"))
+  // Answered from the cache from now on
+  #expect(unlink(link.string) == 0)
+  #expect(cache.destination(of: link) == "target")
+  cache.invalidate(link)
+  #expect(cache.destination(of: link) == nil)
+}
+
+@Test func createdSymlinkIsKnownWithoutTheFileSystem() {
+  let cache = SymlinkCache()
+  let link = missing.appending("dir/link")
+  cache.symlinkCreated(at: link, destination: "../target")
+  #expect(cache.resolve(link) == missing.appending("target"))
+}
+
+@Test func renamedSymlinkMovesItsEntry() {
+  let cache = SymlinkCache()
+  cache.symlinkCreated(at: missing.appending("dir/link"), destination: "target")
+  cache.renamed(from: missing.appending("dir/link"), to: missing.appending("dir/moved"))
+  #expect(cache.destination(of: missing.appending("dir/moved")) == "target")
+  #expect(cache.destination(of: missing.appending("dir/link")) == nil)
+}
+
+@Test func renamedDirectoryForgetsItsSubtree() {
+  let cache = SymlinkCache()
+  cache.symlinkCreated(at: missing.appending("a/b/link"), destination: "target")
+  cache.symlinkCreated(at: missing.appending("other/link"), destination: "target")
+  cache.renamed(from: missing.appending("a"), to: missing.appending("c"))
+  // Looked up again at both places, where nothing exists
+  #expect(cache.destination(of: missing.appending("a/b/link")) == nil)
+  #expect(cache.destination(of: missing.appending("c/b/link")) == nil)
+  #expect(cache.destination(of: missing.appending("other/link")) == "target")
+}
+
+@Test func fullCacheIsEmptied() {
+  let cache = SymlinkCache()
+  cache.symlinkCreated(at: missing.appending("first/link"), destination: "target")
+  for index in 0..<SymlinkCache.maxDirectories {
+    cache.symlinkCreated(at: missing.appending("dir\(index)/link"), destination: "target")
+  }
+  #expect(cache.destination(of: missing.appending("first/link")) == nil)
+  #expect(cache.destination(of: missing.appending("dir0/link")) == nil)
+}
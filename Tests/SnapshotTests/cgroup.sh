@@ -0,0 +1,9 @@
+#!/bin/bash
+# mkcheck2: --cgroup
+
+touch $t/foo.txt
+cat $t/foo.txt
+
+stat $t/foo.txt &> /dev/null
+
+echo "Hello, world!" > $t/bar.txt
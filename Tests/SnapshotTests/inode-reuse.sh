@@ -0,0 +1,17 @@
+set -e
+
+# bash reads the files itself and lives through the whole test, so a file
+# getting the inode number of a deleted one must still be reported
+echo a > "$t/a.txt"
+read -r line < "$t/a.txt"
+"$utils" unlink-at "$t" "a.txt"
+echo b > "$t/b.txt"
+read -r line < "$t/b.txt"
+
+# Same with a file replaced by a rename
+echo c > "$t/c.txt"
+read -r line < "$t/c.txt"
+echo d > "$t/d.tmp"
+"$utils" rename-at "$t" "d.tmp" "$t" "c.txt"
+echo e > "$t/e.txt"
+read -r line < "$t/e.txt"
@@ -0,0 +1,11 @@
+#!/bin/bash
+# mkcheck2: --io-mode open
+set -e
+
+touch "$t/foo.txt"
+cat "$t/foo.txt" > /dev/null
+
+# Opened by bash with O_RDWR|O_CREAT, which keeps the content of an existing
+# file, so both an input and an output
+exec 3<> "$t/rw.txt"
+exec 3>&-
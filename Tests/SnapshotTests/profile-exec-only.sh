@@ -0,0 +1,10 @@
+#!/bin/bash
+# mkcheck2: --profile exec-only
+set -e
+
+touch "$t/foo.txt"
+cp /usr/bin/true "$t/true"
+
+# The relative exec is resolved against the directory changed to
+cd "$t"
+./true
@@ -0,0 +1,7 @@
+#!/bin/bash
+# mkcheck2: --profile io
+set -e
+
+touch "$t/foo.txt"
+cat "$t/foo.txt" > /dev/null
+stat "$t/foo.txt" &> /dev/null
@@ -0,0 +1,80 @@
+#!/bin/bash
+
+set -eu -o pipefail
+
+print_usage() {
+    echo "Usage: $0 [--record] [--translation-units N] [--iterations N]"
+    echo ""
+    echo "Options:"
+    echo "  --record               Also record the snapshot test scenarios and replay them (needs sudo)"
+    echo "  --translation-units N  The size of the synthetic build (default: 10000)"
+    echo "  --iterations N         The number of timed runs per recording (default: 5)"
+}
+
+translation_units=10000
+iterations=5
+while [ $# -gt 0 ]; do
+    case $1 in
+        "--record")
+            RECORD=1
+            ;;
+        "--translation-units")
+            shift
+            translation_units=$1
+            ;;
+        "--iterations")
+            shift
+            iterations=$1
+            ;;
+        "--help")
+            print_usage
+            exit 0
+            ;;
+        *)
+            echo "Unknown argument: $1"
+            print_usage
+            exit 1
+            ;;
+    esac
+    shift
+done
+
+set -x
+swift build -c release --product mkcheck2
+{ set +x; } 2>/dev/null
+mkcheck2=$PWD/.build/release/mkcheck2
+
+# The corpus is derived from the checked-in snapshot outputs, so that every
+# checkout and machine replays the same events without root, whatever the
+# record layout of this build
+corpus=Tests/Benchmarks.tmp
+rm -rf $corpus
+mkdir -p $corpus
+for expected in Tests/SnapshotTests/*.txt; do
+    $mkcheck2 bench generate -o $corpus/$(basename $expected .txt).events --snapshot $expected > /dev/null
+done
+
+if [ -n "${RECORD:-}" ]; then
+    set -x
+    ninja -C build
+    swift build -c release --product mkcheck2-test-utils
+    { set +x; } 2>/dev/null
+    for test_case in Tests/SnapshotTests/*.sh; do
+        name=$(basename $test_case .sh)
+        mkdir -p $corpus/$name.tmp
+        set -x
+        sudo env t=$corpus/$name.tmp utils=$PWD/.build/release/mkcheck2-test-utils \
+          $mkcheck2 --record $corpus/$name.recorded.events -- bash $test_case
+        { set +x; } 2>/dev/null
+    done
+    sudo chown -R "$(id -u):$(id -g)" $corpus
+fi
+
+set -x
+$mkcheck2 bench generate -o $corpus/synthetic.events --translation-units $translation_units
+{ set +x; } 2>/dev/null
+
+for events in $corpus/*.events; do
+    echo -e "\033[0;33m$(basename $events .events)\033[0m"
+    $mkcheck2 bench replay $events --iterations $iterations
+done
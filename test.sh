@@ -53,10 +53,61 @@ run_test() {
     out=$tmpdir/$(basename $test_case .sh).txt
     test_case_tmpdir=$tmpdir/$(basename $test_case .sh).tmp
     mkdir -p $test_case_tmpdir
-    set -x
-    sudo env t=$test_case_tmpdir utils=$PWD/.build/debug/mkcheck2-test-utils \
-      $PWD/.build/debug/mkcheck2 -o $out --format ascii -- bash $test_case
-    { set +x; } 2>/dev/null
+    # Options of mkcheck2 given by a "# mkcheck2: <options>" line of the test case
+    options=$(sed -n 's/^# mkcheck2: //p' $test_case)
+    # How the trace is taken, given by a "# mkcheck2-via: <mode>" line: run (default), daemon,
+    # convert or record
+    via=$(sed -n 's/^# mkcheck2-via: //p' $test_case)
+    mkcheck2=$PWD/.build/debug/mkcheck2
+    test_env="t=$test_case_tmpdir utils=$PWD/.build/debug/mkcheck2-test-utils"
+    case "${via:-run}" in
+        "run")
+            set -x
+            sudo env $test_env $mkcheck2 $options -o $out --format ascii -- bash $test_case
+            { set +x; } 2>/dev/null
+            ;;
+        "daemon")
+            socket=$test_case_tmpdir.sock
+            set -x
+            sudo $mkcheck2 daemon $options --socket $socket --pin-path /sys/fs/bpf/mkcheck2-test &
+            { set +x; } 2>/dev/null
+            daemon_pid=$!
+            for _ in $(seq 100); do
+                sudo test -S $socket && break
+                sleep 0.1
+            done
+            set -x
+            sudo env $test_env $mkcheck2 client --socket $socket -o $out --format ascii -- bash $test_case
+            sudo kill -TERM $daemon_pid
+            wait $daemon_pid
+            { set +x; } 2>/dev/null
+            ;;
+        "convert")
+            # The output is the difference between the trace and its conversions, so it is empty
+            json=$test_case_tmpdir.json
+            binary=$test_case_tmpdir.bin
+            set -x
+            sudo env $test_env $mkcheck2 $options -o $json --format json -- bash $test_case
+            $mkcheck2 convert $json $binary
+            $mkcheck2 convert $binary $test_case_tmpdir.roundtrip.json
+            { set +x; } 2>/dev/null
+            {
+                $mkcheck2 diff $json $binary
+                diff $json $test_case_tmpdir.roundtrip.json || true
+            } > $out
+            ;;
+        "record")
+            events=$test_case_tmpdir.events
+            set -x
+            sudo env $test_env $mkcheck2 $options --record $events -- bash $test_case
+            $mkcheck2 analyze $events -o $out --format ascii
+            { set +x; } 2>/dev/null
+            ;;
+        *)
+            echo "Unknown mode of $test_case: $via"
+            exit 1
+            ;;
+    esac
     # Update the expected output if UPDATE_SNAPSHOT is set
     if [ -n "${UPDATE_SNAPSHOT:-}" ]; then
         diff -u $expected $out || (cp $out $expected && echo -e "\033[0;33mUpdated snapshot: $test_case\033[0m")